@@ -314,11 +314,15 @@ unsigned pnfs_cb_devicenotify(struct cb_pnfs_devicenotifyargs *args,
 		goto out;
 	}
 
-	/* ??? fix me, until we have a way to find dev_id */
+	/* device ids are per layout type, not per file system */
 	list_for_each_entry (server, &clp->cl_superblocks, client_link)
-		if (PNFS_EXISTS_LDIO_OP(server, uninitialize_mountpoint))
+		if (PNFS_EXISTS_LDIO_OP(server, device_notify) &&
+		    server->pnfs_mountid &&
+		    server->pnfs_curr_ld->id == args->cbd_layout_type)
 			server->pnfs_curr_ld->ld_io_ops->
-				uninitialize_mountpoint(server->pnfs_mountid);
+				device_notify(server->pnfs_mountid,
+					      args->cbd_notify_type,
+					      &args->cbd_dev_id);
 
 	res = 0;
 	nfs_put_client(clp);
@@ -301,7 +301,7 @@ static unsigned decode_pnfs_devicenotify_args(struct svc_rqst *rqstp,
 
 	COPYMEM(args->cbd_dev_id.data, NFS4_PNFS_DEVICEID4_SIZE);
 
-	if (args->cbd_layout_type == NOTIFY_DEVICEID4_CHANGE)
+	if (args->cbd_notify_type == NOTIFY_DEVICEID4_CHANGE)
 		args->cbd_immediate = ntohl(*p++);
 	else
 		args->cbd_immediate = 0;
@@ -52,9 +52,11 @@
 #include <asm/system.h>
 #include <asm/uaccess.h>
 #include <asm/atomic.h>
+#include <asm/div64.h>
 
 #include "internal.h"
 #include "iostat.h"
+#include "pnfs.h"
 
 #define NFSDBG_FACILITY		NFSDBG_VFS
 
@@ -256,12 +258,34 @@ static const struct rpc_call_ops nfs_read_direct_ops = {
 	.rpc_release = nfs_readdata_release,
 };
 
+/*
+ * Size the next chunk of a direct I/O: at most iosize bytes, and not
+ * across a stripe boundary when the layout asks for that.
+ */
+static size_t nfs_direct_chunk(size_t iosize, size_t count, loff_t pos,
+			       u32 boundary)
+{
+	size_t bytes = min(iosize, count);
+
+	if (boundary) {
+		u64 stripe = pos;
+		u32 off = do_div(stripe, boundary);
+
+		bytes = min_t(size_t, bytes, boundary - off);
+	}
+	return bytes;
+}
+
 /*
  * For each rsize'd chunk of the user's buffer, dispatch an NFS READ
  * operation.  If nfs_readdata_alloc() or get_user_pages() fails,
  * bail and stop sending more reads.  Read length accounting is
  * handled automatically by nfs_direct_read_result().  Otherwise, if
  * no requests have been sent, just return an error.
+ *
+ * If the server hands out a layout for the range, the chunks are
+ * sized for the data servers, split on stripe boundaries and sent
+ * through the layout driver instead.
  */
 static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 						const struct iovec *iov,
@@ -272,6 +296,8 @@ static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 	unsigned long user_addr = (unsigned long)iov->iov_base;
 	size_t count = iov->iov_len;
 	size_t rsize = NFS_SERVER(inode)->rsize;
+	size_t ds_rsize;
+	u32 boundary;
 	struct rpc_task *task;
 	struct rpc_message msg = {
 		.rpc_cred = ctx->cred,
@@ -286,12 +312,16 @@ static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 	int result;
 	ssize_t started = 0;
 
+	ds_rsize = pnfs_direct_init_io(inode, ctx, count, pos, 0, &boundary);
+	if (ds_rsize)
+		rsize = ds_rsize;
+
 	do {
 		struct nfs_read_data *data;
 		size_t bytes;
 
 		pgbase = user_addr & ~PAGE_MASK;
-		bytes = min(rsize,count);
+		bytes = nfs_direct_chunk(rsize, count, pos, boundary);
 
 		result = -ENOMEM;
 		data = nfs_readdata_alloc(nfs_page_array_len(pgbase, bytes));
@@ -335,6 +365,9 @@ static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 		msg.rpc_argp = &data->args;
 		msg.rpc_resp = &data->res;
 
+		if (pnfs_try_to_read_data(data, &nfs_read_direct_ops) == 0)
+			goto next;
+
 		task_setup_data.task = &data->task;
 		task_setup_data.callback_data = data;
 		NFS_PROTO(inode)->read_setup(data, &msg);
@@ -350,7 +383,7 @@ static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 				(long long)NFS_FILEID(inode),
 				bytes,
 				(unsigned long long)data->args.offset);
-
+next:
 		started += bytes;
 		user_addr += bytes;
 		pos += bytes;
@@ -461,6 +494,16 @@ static void nfs_direct_write_reschedule(struct nfs_direct_req *dreq)
 		/* Use stable writes */
 		data->args.stable = NFS_FILE_SYNC;
 
+		/* Rewrites go to the MDS, even if the layout driver sent
+		 * the original to a data server.
+		 */
+		data->args.fh = NFS_FH(inode);
+#ifdef CONFIG_PNFS
+		data->ds_nfs_client = NULL;
+		data->pnfs_client = NULL;
+		data->pnfsflags = 0;
+#endif /* CONFIG_PNFS */
+
 		/*
 		 * Reset data->res.
 		 */
@@ -666,6 +709,9 @@ static const struct rpc_call_ops nfs_write_direct_ops = {
  * bail and stop sending more writes.  Write length accounting is
  * handled automatically by nfs_direct_write_result().  Otherwise, if
  * no requests have been sent, just return an error.
+ *
+ * With a layout the chunks go through the layout driver as stable
+ * writes, since a COMMIT to the MDS would not reach the data servers.
  */
 static ssize_t nfs_direct_write_schedule_segment(struct nfs_direct_req *dreq,
 						 const struct iovec *iov,
@@ -686,16 +732,24 @@ static ssize_t nfs_direct_write_schedule_segment(struct nfs_direct_req *dreq,
 		.flags = RPC_TASK_ASYNC,
 	};
 	size_t wsize = NFS_SERVER(inode)->wsize;
+	size_t ds_wsize;
+	u32 boundary;
 	unsigned int pgbase;
 	int result;
 	ssize_t started = 0;
 
+	ds_wsize = pnfs_direct_init_io(inode, ctx, count, pos, 1, &boundary);
+	if (ds_wsize) {
+		wsize = ds_wsize;
+		sync = NFS_FILE_SYNC;
+	}
+
 	do {
 		struct nfs_write_data *data;
 		size_t bytes;
 
 		pgbase = user_addr & ~PAGE_MASK;
-		bytes = min(wsize,count);
+		bytes = nfs_direct_chunk(wsize, count, pos, boundary);
 
 		result = -ENOMEM;
 		data = nfs_writedata_alloc(nfs_page_array_len(pgbase, bytes));
@@ -739,6 +793,9 @@ static ssize_t nfs_direct_write_schedule_segment(struct nfs_direct_req *dreq,
 		data->res.count = bytes;
 		data->res.verf = &data->verf;
 
+		if (pnfs_try_to_write_data(data, &nfs_write_direct_ops, 0) == 0)
+			goto next;
+
 		task_setup_data.task = &data->task;
 		task_setup_data.callback_data = data;
 		msg.rpc_argp = &data->args;
@@ -756,7 +813,7 @@ static ssize_t nfs_direct_write_schedule_segment(struct nfs_direct_req *dreq,
 				(long long)NFS_FILEID(inode),
 				bytes,
 				(unsigned long long)data->args.offset);
-
+next:
 		started += bytes;
 		user_addr += bytes;
 		pos += bytes;
@@ -835,6 +892,10 @@ static ssize_t nfs_direct_write(struct kiocb *iocb, const struct iovec *iov,
 	if (!result)
 		result = nfs_direct_wait(dreq);
 	nfs_direct_req_release(dreq);
+#ifdef CONFIG_PNFS
+	if (result > 0 && NFS_I(inode)->layoutcommit_ctx)
+		pnfs_layoutcommit_inode(inode, 1);
+#endif /* CONFIG_PNFS */
 
 	return result;
 }
@@ -95,6 +95,12 @@ filelayout_initialize_mountpoint(struct super_block *sb, struct nfs_fh *fh)
 	fl_mt->hlist = kmalloc(sizeof(struct nfs4_pnfs_dev_hlist), GFP_KERNEL);
 	if (!fl_mt->hlist)
 		goto cleanup_fl_mt;
+	status = nfs4_pnfs_devlist_init(fl_mt->hlist);
+	if (status) {
+		kfree(fl_mt->hlist);
+		fl_mt->hlist = NULL;
+		goto cleanup_fl_mt;
+	}
 
 	mt = kmalloc(sizeof(struct pnfs_mount_type), GFP_KERNEL);
 	if (!mt)
@@ -108,10 +114,6 @@ filelayout_initialize_mountpoint(struct super_block *sb, struct nfs_fh *fh)
 	if (status)
 		goto cleanup_mt;
 
-	status = nfs4_pnfs_devlist_init(fl_mt->hlist);
-	if (status)
-		goto cleanup_mt;
-
 	/* Retrieve and add all available devices */
 	status = process_deviceid_list(fl_mt, fh, dlist);
 	if (status)
@@ -126,6 +128,7 @@ cleanup_mt: ;
 	kfree(mt);
 
 cleanup_fl_mt: ;
+	nfs4_pnfs_devlist_destroy(fl_mt->hlist);
 	kfree(fl_mt->hlist);
 	kfree(fl_mt);
 
@@ -149,15 +152,30 @@ filelayout_uninitialize_mountpoint(struct pnfs_mount_type *mountid)
 	if (mountid)
 		fl_mt = (struct filelayout_mount_type *)mountid->mountid;
 
-	nfs4_pnfs_devlist_destroy(fl_mt->hlist);
-
-	if (fl_mt != NULL)
+	if (fl_mt != NULL) {
+		nfs4_pnfs_devlist_destroy(fl_mt->hlist);
+		kfree(fl_mt->hlist);
 		kfree(fl_mt);
+	}
 	kfree(mountid);
 
 	return 0;
 }
 
+/* CB_NOTIFY_DEVICEID: forget the device, it is fetched again when
+ * next needed.
+ */
+static void
+filelayout_device_notify(struct pnfs_mount_type *mountid, u32 notify_type,
+			 struct pnfs_deviceid *dev_id)
+{
+	struct filelayout_mount_type *fl_mt = mountid->mountid;
+
+	dprintk("%s: type %u dev_id %s\n", __func__, notify_type,
+		deviceid_fmt(dev_id));
+	nfs4_pnfs_device_invalidate(fl_mt, dev_id);
+}
+
 /* This function is used by the layout driver to calculate the
  * offset of the file on the dserver based on whether the
  * layout type is STRIPE_DENSE or STRIPE_SPARSE
@@ -208,6 +226,8 @@ static void filelayout_read_call_done(struct rpc_task *task, void *data)
 {
 	struct nfs_read_data *rdata = (struct nfs_read_data *)data;
 
+	if (rdata->ds_nfs_client)
+		nfs4_pnfs_ds_io_done(rdata->ds_nfs_client, task->tk_status);
 
 	if (rdata->orig_offset) {
 		dprintk("%s new off %llu orig offset %llu\n",
@@ -222,6 +242,9 @@ static void filelayout_write_call_done(struct rpc_task *task, void *data)
 {
 	struct nfs_write_data *wdata = (struct nfs_write_data *)data;
 
+	if (wdata->ds_nfs_client)
+		nfs4_pnfs_ds_io_done(wdata->ds_nfs_client, task->tk_status);
+
 	if (wdata->orig_offset) {
 		dprintk("%s new off %llu orig offset %llu\n",
 			__func__, wdata->args.offset, wdata->orig_offset);
@@ -271,20 +294,23 @@ static int filelayout_read_pagelist(
 				       offset,
 				       count,
 				       &dserver);
-	if (status) {
+	if (status)
 		printk(KERN_ERR "%s: dserver get failed status %d use MDS\n",
 		       __func__, status);
+	else if ((ds = nfs4_pnfs_ds_select(dserver.dev)) == NULL) {
+		dprintk("%s: no data server session yet, use MDS\n",
+			__func__);
+		status = -EAGAIN;
+	}
+	if (status) {
 		data->pnfs_client = NFS_CLIENT(inode);
 		data->ds_nfs_client = NULL;
 		data->args.fh = NFS_FH(inode);
 		status = 0;
 	} else {
-		ds = dserver.dev->ds_list[0];
-
 		dprintk("%s USE DS:ip %x %s\n", __func__,
 			htonl(ds->ds_ip_addr), ds->r_addr);
 
-		/* just try the first data server for the index..*/
 		data->pnfs_client = ds->ds_clp->cl_rpcclient;
 		data->ds_nfs_client = ds->ds_clp;
 		data->args.fh = dserver.fh;
@@ -343,18 +369,20 @@ static int filelayout_write_pagelist(
 				       offset,
 				       count,
 				       &dserver);
-
-	if (status) {
+	if (status)
 		printk(KERN_ERR "%s: dserver get failed status %d use MDS\n",
 		       __func__, status);
+	else if ((ds = nfs4_pnfs_ds_select(dserver.dev)) == NULL) {
+		dprintk("%s: no data server session yet, use MDS\n",
+			__func__);
+		status = -EAGAIN;
+	}
+	if (status) {
 		data->pnfs_client = NFS_CLIENT(inode);
 		data->ds_nfs_client = NULL;
 		data->args.fh = NFS_FH(inode);
 		status = 0;
 	} else {
-		/* use the first multipath data server */
-		ds = dserver.dev->ds_list[0];
-
 		dprintk("%s ino %lu %Zu@%Lu DS:%x:%hu %s\n",
 			__func__, inode->i_ino, count, offset,
 			htonl(ds->ds_ip_addr), ntohs(ds->ds_port),
@@ -430,7 +458,7 @@ filelayout_check_layout(struct pnfs_layout_type *lo,
 	if (dev == NULL) {
 		dprintk("%s NO device for dev_id %s\n",
 				__func__, deviceid_fmt(&fl->dev_id));
-		goto out;
+		return status;
 	}
 	/* FIX-ME: need a # stripe index field */
 	if (fl->first_stripe_index < 0 ||
@@ -457,8 +485,12 @@ filelayout_check_layout(struct pnfs_layout_type *lo,
 		dprintk("%s Stripe unit (%u) not aligned with rsize %u wsize %u\n",
 			__func__, fl->stripe_unit, nfss->ds_rsize, nfss->ds_wsize);
 	}
+	/* the segment keeps the device until filelayout_free_lseg */
+	fl->dev = dev;
 	status = 0;
 out:
+	if (status)
+		nfs4_pnfs_device_put(FILE_MT(lo->inode), dev);
 	dprintk("--> %s returns %d\n", __func__, status);
 	return status;
 }
@@ -538,6 +570,11 @@ filelayout_alloc_lseg(struct pnfs_layout_type *layoutid,
 static void
 filelayout_free_lseg(struct pnfs_layout_segment *lseg)
 {
+	struct nfs4_filelayout_segment *fl = LSEG_LD_DATA(lseg);
+
+	if (fl->dev)
+		nfs4_pnfs_device_put(FILE_MT(PNFS_INODE(lseg->layout)),
+				     fl->dev);
 	kfree(lseg);
 }
 
@@ -571,24 +608,31 @@ out:
  * Execute a COMMIT op to the MDS or to each data server on which a page
  * in 'pages' exists.
  * Invoke the pnfs_commit_complete callback.
+ *
+ * The pages are sorted by stripe index in a single pass, then one COMMIT
+ * per data server is sent.  The COMMITs run concurrently; a sync caller
+ * waits for all of them at the end.
  */
 int
 filelayout_commit(struct pnfs_layout_type *layoutid, int sync,
 		  struct nfs_write_data *data)
 {
 	struct nfs4_filelayout_segment *nfslay;
-	struct nfs_write_data   *dsdata = NULL;
+	struct nfs_write_data *dsdata[NFS4_PNFS_MAX_STRIPE_CNT];
+	struct nfs_page *last[NFS4_PNFS_MAX_STRIPE_CNT];
 	struct nfs4_pnfs_dserver dserver;
 	struct nfs4_pnfs_ds *ds;
-	struct nfs_page *req, *reqt;
-	struct list_head *pos, *tmp, *head = &data->pages;
-	loff_t file_offset, comp_offset;
-	size_t stripesz, cbytes;
-	int status;
+	struct nfs_page *req;
+	struct list_head *head = &data->pages;
+	loff_t file_offset;
+	size_t stripesz;
+	int status = 0;
 	struct nfs4_pnfs_dev_item *di;
-	u32 idx1, idx2;
+	u32 idx, nidx;
 
 	nfslay = LSEG_LD_DATA(data->lseg);
+	memset(dsdata, 0, sizeof(dsdata));
+	memset(last, 0, sizeof(last));
 
 	dprintk("%s data %p pnfs_client %p nfslay %p sync %d\n",
 		__func__, data, data->pnfs_client, nfslay, sync);
@@ -601,78 +645,98 @@ filelayout_commit(struct pnfs_layout_type *layoutid, int sync,
 	stripesz = filelayout_get_stripesize(layoutid);
 	dprintk("%s stripesize %Zd\n", __func__, stripesz);
 
-	di = nfs4_pnfs_device_item_get(FILE_MT(data->inode),
-				       NFS_FH(data->inode), &nfslay->dev_id);
+	di = nfslay->dev;
 	if (di == NULL) {
 		status = -EIO;
 		goto out_bad;
 	}
+	nidx = di->stripe_count;
 
-	/* COMMIT to each Data Server */
+	/* Sort the pages by the data server they were written to */
 	while (!list_empty(head)) {
 		req = nfs_list_entry(head->next);
+		file_offset = (loff_t)req->wb_index << PAGE_CACHE_SHIFT;
+		idx = filelayout_dserver_get_index(file_offset, di, nfslay);
 
+		if (!dsdata[idx]) {
+			dsdata[idx] = filelayout_clone_write_data(data);
+			if (!dsdata[idx]) {
+				status = -ENOMEM;
+				goto out_unsort;
+			}
+		}
+		nfs_list_remove_request(req);
+		nfs_list_add_request(req, &dsdata[idx]->pages);
+	}
+
+	/* COMMIT to each Data Server */
+	for (idx = 0; idx < nidx; idx++) {
+		if (!dsdata[idx])
+			continue;
+		req = nfs_list_entry(dsdata[idx]->pages.next);
 		file_offset = (loff_t)req->wb_index << PAGE_CACHE_SHIFT;
 
-		/* Get dserver for the current page */
+		/* Get dserver for the stripe index */
 		status = nfs4_pnfs_dserver_get(data->lseg,
 					       file_offset,
 					       req->wb_bytes,
 					       &dserver);
-
-		/* Get its index */
-		idx1 = filelayout_dserver_get_index(file_offset, di, nfslay);
-
 		if (status) {
 			status = -EIO;
-			goto out_bad;
+			goto out_unsort;
 		}
 
-		dsdata = filelayout_clone_write_data(data);
-		if (!dsdata) {
-			status = -ENOMEM;
-			goto out_bad;
+		/* any path to the data server will do for COMMIT */
+		ds = nfs4_pnfs_ds_select(dserver.dev);
+		if (!ds) {
+			status = -EIO;
+			goto out_unsort;
 		}
-
-		/* Just try the first multipath data server */
-		ds = dserver.dev->ds_list[0];
-		dsdata->pnfs_client = ds->ds_clp->cl_rpcclient;
-		dsdata->ds_nfs_client = ds->ds_clp;
-		dsdata->args.fh = dserver.fh;
-		cbytes = req->wb_bytes;
-
-		/* Gather all pages going to the current data server by
-		 * comparing their indices.
-		 * XXX: This recalculates the indices unecessarily.
-		 *      One idea would be to calc the index for every page
-		 *      and then compare if they are the same. */
-		list_for_each_safe(pos, tmp, head) {
-			reqt = nfs_list_entry(pos);
-			comp_offset = (loff_t)reqt->wb_index << PAGE_CACHE_SHIFT;
-			idx2 = filelayout_dserver_get_index(comp_offset, di, nfslay);
-			if (idx1 == idx2) {
-				nfs_list_remove_request(reqt);
-				nfs_list_add_request(reqt, &dsdata->pages);
-				cbytes += reqt->wb_bytes;
-			}
+		dsdata[idx]->pnfs_client = ds->ds_clp->cl_rpcclient;
+		dsdata[idx]->ds_nfs_client = ds->ds_clp;
+		dsdata[idx]->args.fh = dserver.fh;
+
+		/* the COMMIT is over once its last page is released */
+		if (sync & FLUSH_SYNC) {
+			last[idx] = nfs_list_entry(dsdata[idx]->pages.prev);
+			kref_get(&last[idx]->wb_kref);
 		}
 
-		dprintk("%s: Initiating commit: %Zu@%llu USE DS:\n",
-			__func__, cbytes, file_offset);
+		dprintk("%s: Initiating commit: idx %u @%llu USE DS:\n",
+			__func__, idx, file_offset);
 		print_ds(ds);
 
 		/* Send COMMIT to data server */
-		nfs_initiate_commit(dsdata, dsdata->pnfs_client, sync);
+		nfs_initiate_commit(dsdata[idx], dsdata[idx]->pnfs_client,
+				    sync & ~FLUSH_SYNC);
+		dsdata[idx] = NULL;
 	}
 	/* Release original commit data since it is not used */
 	nfs_commit_free(data);
-	return 0;
-
+	status = 0;
+	goto out_wait;
+
+out_unsort:
+	/* put the pages not sent yet back on the commit list */
+	for (idx = 0; idx < nidx; idx++) {
+		if (!dsdata[idx])
+			continue;
+		nfs_retry_commit(&dsdata[idx]->pages);
+		nfs_commit_free(dsdata[idx]);
+	}
 out_bad:
+	nfs_retry_commit(head);
 	printk(KERN_ERR "%s: dserver get failed status %d\n", __func__, status);
 
 	/* XXX should we send COMMIT to MDS e.g. not free data and return 1 ? */
 	nfs_commit_free(data);
+out_wait:
+	for (idx = 0; idx < NFS4_PNFS_MAX_STRIPE_CNT; idx++) {
+		if (!last[idx])
+			continue;
+		nfs_wait_on_request(last[idx]);
+		nfs_release_request(last[idx]);
+	}
 	return status;
 }
 
@@ -768,6 +832,7 @@ struct layoutdriver_io_operations filelayout_io_operations = {
 	.free_lseg               = filelayout_free_lseg,
 	.initialize_mountpoint   = filelayout_initialize_mountpoint,
 	.uninitialize_mountpoint = filelayout_uninitialize_mountpoint,
+	.device_notify           = filelayout_device_notify,
 };
 
 struct layoutdriver_policy_operations filelayout_policy_operations = {
@@ -789,9 +854,15 @@ struct pnfs_layoutdriver_type filelayout_type = {
 
 static int __init nfs4filelayout_init(void)
 {
+	int status;
+
 	printk(KERN_INFO "%s: NFSv4 File Layout Driver Registering...\n",
 	       __func__);
 
+	status = nfs4_pnfs_ds_pool_init();
+	if (status)
+		return status;
+
 	/* Need to register file_operations struct with global list to indicate
 	* that NFS4 file layout is a possible pNFS I/O module
 	*/
@@ -807,6 +878,9 @@ static void __exit nfs4filelayout_exit(void)
 
 	/* Unregister NFS4 file layout driver with pNFS client*/
 	pnfs_unregister_layoutdriver(&filelayout_type);
+	nfs4_pnfs_ds_pool_exit();
+	/* devices and device tables freed by call_rcu */
+	rcu_barrier();
 }
 
 module_init(nfs4filelayout_init);
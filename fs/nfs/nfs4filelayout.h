@@ -20,9 +20,15 @@
 #define NFS4_PNFS_DEV_HASH_BITS 5
 #define NFS4_PNFS_DEV_HASH_SIZE (1 << NFS4_PNFS_DEV_HASH_BITS)
 #define NFS4_PNFS_DEV_HASH_MASK (NFS4_PNFS_DEV_HASH_SIZE - 1)
+/* The device hash doubles past two devices a bucket, up to this */
+#define NFS4_PNFS_DEV_HASH_MAX_BITS 10
+/* Unused devices kept cached per mount before the oldest are freed */
+#define NFS4_PNFS_DEV_LRU_MAX 64
 
 #define NFS4_PNFS_MAX_STRIPE_CNT 16
 #define NFS4_PNFS_MAX_MULTI_DS   2
+/* How long a multipath address is avoided after an I/O to it failed */
+#define NFS4_PNFS_DS_RETRY_TIMEO (60 * HZ)
 
 #define FILE_MT(inode) ((struct filelayout_mount_type *) \
 			(NFS_SERVER(inode)->pnfs_mountid->mountid))
@@ -32,13 +38,27 @@ enum stripetype4 {
 	STRIPE_DENSE = 2
 };
 
-/* Individual ip address */
+/* Data server session states, see nfs4_pnfs_ds_connect */
+enum nfs4_pnfs_ds_state {
+	DS_UNCONNECTED = 0,
+	DS_CONNECTING,
+	DS_CONNECTED,
+	DS_FAILED,
+};
+
+/* Individual ip address, shared by all mounts through the data server pool */
 struct nfs4_pnfs_ds {
-	struct hlist_node 	ds_node;  /* nfs4_pnfs_dev_hlist dev_dslist */
+	struct hlist_node 	ds_node;  /* nfs4_ds_pool */
 	u32 			ds_ip_addr;
 	u32 			ds_port;
 	struct nfs_client	*ds_clp;
 	atomic_t		ds_count;
+	int			ds_state;
+	int			ds_error;	/* result of last connect */
+	unsigned long		ds_connect_time;
+	struct work_struct	ds_connect_work;
+	char			*ds_hostname;
+	struct rpc_timeout	ds_timeo;
 	char r_addr[29];
 };
 
@@ -46,21 +66,41 @@ struct nfs4_pnfs_ds {
 struct nfs4_pnfs_dev {
 	u32 			stripe_index;
 	int 			num_ds;
+	unsigned int		ds_rotor;	/* next ds_list entry to use */
 	struct nfs4_pnfs_ds	*ds_list[NFS4_PNFS_MAX_MULTI_DS];
 };
 
 /* stripe_count is length of dev_list, bounded by NFS4_PNFS_MAX_STRIPE_CNT */
 struct nfs4_pnfs_dev_item {
-	struct hlist_node	hash_node;   /* nfs4_pnfs_dev_hlist dev_list */
+	struct hlist_node	hash_node;   /* nfs4_pnfs_dev_hlist dev_table */
+	struct list_head	lru;	     /* nfs4_pnfs_dev_hlist dev_lru */
+	struct rcu_head		rcu;
+	atomic_t		count;	     /* layout segments using it */
 	struct pnfs_deviceid	dev_id;
 	u32 			stripe_count;
 	struct nfs4_pnfs_dev	*stripe_devs;
 };
 
+struct nfs4_pnfs_dev_table {
+	unsigned int		bits;
+	struct rcu_head		rcu;
+	struct hlist_head	buckets[0];
+};
+
+/*
+ * Devices are looked up under rcu_read_lock, dev_lock serializes
+ * changes.  A device stays hashed until it is evicted or the server
+ * notifies that it changed.  Devices that no layout segment uses are
+ * kept on dev_lru, oldest first.  Growing the table and evicting
+ * devices is left to dev_work, as both may sleep.
+ */
 struct nfs4_pnfs_dev_hlist {
-	rwlock_t		dev_lock;
-	struct hlist_head	dev_list[NFS4_PNFS_DEV_HASH_SIZE];
-	struct hlist_head	dev_dslist[NFS4_PNFS_DEV_HASH_SIZE];
+	spinlock_t		dev_lock;
+	struct nfs4_pnfs_dev_table *dev_table;
+	unsigned int		dev_count;	/* hashed devices */
+	struct list_head	dev_lru;
+	unsigned int		dev_lru_count;
+	struct work_struct	dev_work;
 };
 
 /* Actual file layout device (single devid) */
@@ -78,6 +118,7 @@ struct nfs4_filelayout_segment {
 	struct pnfs_deviceid dev_id;
 	unsigned int num_fh;
 	struct nfs_fh fh_array[NFS4_PNFS_MAX_STRIPE_CNT];
+	struct nfs4_pnfs_dev_item *dev;	/* holds a reference */
 };
 
 struct nfs4_filelayout {
@@ -97,6 +138,8 @@ extern struct pnfs_client_operations *pnfs_callback_ops;
 char *deviceid_fmt(const struct pnfs_deviceid *dev_id);
 int  nfs4_pnfs_devlist_init(struct nfs4_pnfs_dev_hlist *hlist);
 void nfs4_pnfs_devlist_destroy(struct nfs4_pnfs_dev_hlist *hlist);
+int nfs4_pnfs_ds_pool_init(void);
+void nfs4_pnfs_ds_pool_exit(void);
 int nfs4_pnfs_dserver_get(struct pnfs_layout_segment *lseg,
 			  loff_t offset,
 			  size_t count,
@@ -108,6 +151,12 @@ int process_deviceid_list(struct filelayout_mount_type *mt,
 struct nfs4_pnfs_dev_item * nfs4_pnfs_device_item_get(struct filelayout_mount_type *mt,
 						      struct nfs_fh *fh,
 						      struct pnfs_deviceid *dev_id);
+void nfs4_pnfs_device_put(struct filelayout_mount_type *mt,
+			  struct nfs4_pnfs_dev_item *dev);
+void nfs4_pnfs_device_invalidate(struct filelayout_mount_type *mt,
+				 struct pnfs_deviceid *dev_id);
+struct nfs4_pnfs_ds *nfs4_pnfs_ds_select(struct nfs4_pnfs_dev *fdev);
+void nfs4_pnfs_ds_io_done(struct nfs_client *clp, int status);
 u32 filelayout_dserver_get_index(loff_t offset,
 				 struct nfs4_pnfs_dev_item *di,
 				 struct nfs4_filelayout_segment *layout);
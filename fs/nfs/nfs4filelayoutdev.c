@@ -42,6 +42,10 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
 #include <linux/nfs4.h>
 #include <linux/nfs_fs.h>
@@ -58,6 +62,24 @@
 
 #define NFSDBG_FACILITY		NFSDBG_PNFS_LD
 
+/*
+ * Data servers are kept in a pool shared by all mounts, so that two
+ * mounts striping over the same data server use one session to it.
+ * Each nfs4_pnfs_dev ds_list entry holds a reference, as does a
+ * running connect.
+ */
+static struct hlist_head nfs4_ds_pool[NFS4_PNFS_DEV_HASH_SIZE];
+static DEFINE_SPINLOCK(nfs4_ds_pool_lock);
+/* data server sessions are set up here, see nfs4_pnfs_ds_connect */
+static struct workqueue_struct *nfs4_ds_connect_wq;
+
+static const char *nfs4_ds_state_name[] = {
+	[DS_UNCONNECTED]	= "idle",
+	[DS_CONNECTING]		= "connecting",
+	[DS_CONNECTED]		= "connected",
+	[DS_FAILED]		= "failed",
+};
+
 struct nfs4_pnfs_dev_item *nfs4_pnfs_device_item_get(
 					struct filelayout_mount_type *mt,
 					struct nfs_fh *fh,
@@ -69,21 +91,21 @@ print_ds_list(struct nfs4_pnfs_dev *fdev)
 	struct nfs4_pnfs_ds *ds;
 	int i;
 
-	ds = fdev->ds_list[0];
-	if (ds == NULL) {
-		dprintk("%s NULL device \n", __func__);
-		return;
-	}
 	for (i = 0; i < fdev->num_ds; i++) {
+		ds = fdev->ds_list[i];
+		if (ds == NULL) {
+			dprintk("%s NULL device \n", __func__);
+			continue;
+		}
 		dprintk("        ip_addr %x\n", ntohl(ds->ds_ip_addr));
 		dprintk("        port %hu\n", ntohs(ds->ds_port));
 		dprintk("        client %p\n", ds->ds_clp);
+		dprintk("        state %s\n", nfs4_ds_state_name[ds->ds_state]);
 		dprintk("        ref count %d\n", atomic_read(&ds->ds_count));
 		if (ds->ds_clp)
 			dprintk("        cl_exchange_flags %x\n",
 					    ds->ds_clp->cl_exchange_flags);
 		dprintk("        ip:port %s\n", ds->r_addr);
-		ds++;
 	}
 }
 
@@ -119,7 +141,7 @@ deviceid_fmt(const struct pnfs_deviceid *dev_id)
 }
 
 unsigned long
-_deviceid_hash(const struct pnfs_deviceid *dev_id)
+_deviceid_hash(const struct pnfs_deviceid *dev_id, unsigned int bits)
 {
 	unsigned char *cptr = (unsigned char *)dev_id->data;
 	unsigned int nbytes = NFS4_PNFS_DEVICEID4_SIZE;
@@ -129,7 +151,7 @@ _deviceid_hash(const struct pnfs_deviceid *dev_id)
 		x *= 37;
 		x += *cptr++;
 	}
-	return x & NFS4_PNFS_DEV_HASH_MASK;
+	return hash_long((unsigned long)x, bits);
 }
 
 /* Assumes lock is held */
@@ -137,14 +159,15 @@ static inline struct nfs4_pnfs_dev_item *
 _device_lookup(struct nfs4_pnfs_dev_hlist *hlist,
 	       const struct pnfs_deviceid *dev_id)
 {
+	struct nfs4_pnfs_dev_table *tbl = hlist->dev_table;
 	unsigned long      hash;
 	struct hlist_node *np;
 
 	dprintk("_device_lookup: dev_id=%s\n", deviceid_fmt(dev_id));
 
-	hash = _deviceid_hash(dev_id);
+	hash = _deviceid_hash(dev_id, tbl->bits);
 
-	hlist_for_each(np, &hlist->dev_list[hash]) {
+	hlist_for_each(np, &tbl->buckets[hash]) {
 		struct nfs4_pnfs_dev_item *dev;
 		dev = hlist_entry(np, struct nfs4_pnfs_dev_item, hash_node);
 		if (!memcmp(&dev->dev_id, dev_id, NFS4_PNFS_DEVICEID4_SIZE))
@@ -153,9 +176,58 @@ _device_lookup(struct nfs4_pnfs_dev_hlist *hlist,
 	return NULL;
 }
 
+/*
+ * Lockless lookup, returns the device with a reference held.  It
+ * misses devices that nobody uses (those are on the LRU with a zero
+ * count) and, while the table is being resized, maybe some others;
+ * the caller then looks again under dev_lock.
+ */
+static struct nfs4_pnfs_dev_item *
+_device_lookup_rcu(struct nfs4_pnfs_dev_hlist *hlist,
+		   const struct pnfs_deviceid *dev_id)
+{
+	struct nfs4_pnfs_dev_table *tbl;
+	struct nfs4_pnfs_dev_item *dev;
+	struct hlist_node *np;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(hlist->dev_table);
+	hlist_for_each_entry_rcu(dev, np,
+			&tbl->buckets[_deviceid_hash(dev_id, tbl->bits)],
+			hash_node) {
+		if (!memcmp(&dev->dev_id, dev_id, NFS4_PNFS_DEVICEID4_SIZE) &&
+		    atomic_inc_not_zero(&dev->count)) {
+			rcu_read_unlock();
+			return dev;
+		}
+	}
+	rcu_read_unlock();
+	return NULL;
+}
+
 /* Assumes lock is held */
+static inline void
+_device_get(struct nfs4_pnfs_dev_hlist *hlist, struct nfs4_pnfs_dev_item *dev)
+{
+	if (atomic_inc_return(&dev->count) == 1) {
+		list_del_init(&dev->lru);
+		hlist->dev_lru_count--;
+	}
+}
+
+/* Assumes lock is held */
+static inline void
+_device_unhash(struct nfs4_pnfs_dev_hlist *hlist,
+	       struct nfs4_pnfs_dev_item *dev)
+{
+	hlist_del_rcu(&dev->hash_node);
+	dev->hash_node.pprev = NULL;	/* hlist_unhashed */
+	hlist->dev_count--;
+}
+
+/* Assumes nfs4_ds_pool_lock is held */
 static inline struct nfs4_pnfs_ds *
-_data_server_lookup(struct nfs4_pnfs_dev_hlist *hlist, u32 ip_addr, u32 port)
+_data_server_lookup(u32 ip_addr, u32 port)
 {
 	unsigned long      hash;
 	struct hlist_node *np;
@@ -165,7 +237,7 @@ _data_server_lookup(struct nfs4_pnfs_dev_hlist *hlist, u32 ip_addr, u32 port)
 
 	hash = hash_long(ip_addr, NFS4_PNFS_DEV_HASH_BITS);
 
-	hlist_for_each(np, &hlist->dev_dslist[hash]) {
+	hlist_for_each(np, &nfs4_ds_pool[hash]) {
 		struct nfs4_pnfs_ds *ds;
 		ds = hlist_entry(np, struct nfs4_pnfs_ds, ds_node);
 		if (ds->ds_ip_addr == ip_addr &&
@@ -187,13 +259,14 @@ _device_add(struct nfs4_pnfs_dev_hlist *hlist, struct nfs4_pnfs_dev_item *dev)
 		deviceid_fmt(&dev->dev_id));
 	print_stripe_devs(dev);
 
-	hash = _deviceid_hash(&dev->dev_id);
-	hlist_add_head(&dev->hash_node, &hlist->dev_list[hash]);
+	hash = _deviceid_hash(&dev->dev_id, hlist->dev_table->bits);
+	hlist_add_head_rcu(&dev->hash_node, &hlist->dev_table->buckets[hash]);
+	hlist->dev_count++;
 }
 
-/* Assumes lock is held */
+/* Assumes nfs4_ds_pool_lock is held */
 static inline void
-_data_server_add(struct nfs4_pnfs_dev_hlist *hlist, struct nfs4_pnfs_ds *ds)
+_data_server_add(struct nfs4_pnfs_ds *ds)
 {
 	unsigned long      hash;
 
@@ -201,19 +274,18 @@ _data_server_add(struct nfs4_pnfs_dev_hlist *hlist, struct nfs4_pnfs_ds *ds)
 			ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
 
 	hash = hash_long(ds->ds_ip_addr, NFS4_PNFS_DEV_HASH_BITS);
-	hlist_add_head(&ds->ds_node, &hlist->dev_dslist[hash]);
+	hlist_add_head(&ds->ds_node, &nfs4_ds_pool[hash]);
 }
 
 /* Create an rpc to the data server defined in 'dev_list' */
 static int
-nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
+nfs4_pnfs_ds_create(struct nfs4_pnfs_ds *ds, struct nfs_client **clpp)
 {
 	struct nfs_server	tmp = {
 		.nfs_client = NULL,
 		.minorversion = 1,
 	};
 	struct sockaddr_in	sin;
-	struct rpc_clnt 	*mds_clnt = mds_srv->client;
 	struct nfs_client 	*clp;
 	struct rpc_cred		*cred = NULL;
 	char			ip_addr[16];
@@ -226,7 +298,8 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 	sin.sin_addr.s_addr = ds->ds_ip_addr;
 	sin.sin_port = ds->ds_port;
 
-	/* Set timeout to the mds rpc clnt value.
+	/* Timeout and hostname were taken from the mds when the data
+	 * server was added to the pool.
 	 * XXX - find the correct authflavor....
 	 *
 	 * Fake a client ipaddr (used for sessionid) with hostname
@@ -248,13 +321,13 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 	 * We specify a retrans and timeout interval equual to MDS. ??
 	 */
 	err = nfs4_set_client(&tmp,
-			      mds_srv->nfs_client->cl_hostname,
+			      ds->ds_hostname,
 			      (struct sockaddr *)&sin,
 			      sizeof(struct sockaddr),
 			      ip_addr,
 			      RPC_AUTH_UNIX,
 			      IPPROTO_TCP,
-			      mds_clnt->cl_xprt->timeout);
+			      &ds->ds_timeo);
 	if (err < 0)
 		goto out;
 
@@ -283,7 +356,7 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 					 clp->cl_ds_session);
 	if (err)
 		goto out_put;
-	ds->ds_clp = clp;
+	*clpp = clp;
 
 	dprintk("%s: ip=%x, port=%hu, rpcclient %p\n", __func__,
 				ntohl(ds->ds_ip_addr), ntohs(ds->ds_port),
@@ -304,17 +377,92 @@ destroy_ds(struct nfs4_pnfs_ds *ds)
 					  ds->ds_clp->cl_rpcclient);
 		nfs_put_client(ds->ds_clp);
 	}
+	kfree(ds->ds_hostname);
 	kfree(ds);
 }
 
-/* Assumes lock is NOT held */
+/* Drop a reference, tearing the session down with the last one */
+static void
+nfs4_pnfs_ds_put(struct nfs4_pnfs_ds *ds)
+{
+	if (!atomic_dec_and_lock(&ds->ds_count, &nfs4_ds_pool_lock))
+		return;
+	hlist_del_init(&ds->ds_node);
+	spin_unlock(&nfs4_ds_pool_lock);
+
+	dprintk("%s destroy data server %s\n", __func__, ds->r_addr);
+	destroy_ds(ds);
+}
+
+static void
+nfs4_pnfs_ds_connect_work(struct work_struct *work)
+{
+	struct nfs4_pnfs_ds *ds =
+		container_of(work, struct nfs4_pnfs_ds, ds_connect_work);
+	struct nfs_client *clp = NULL;
+	int err;
+
+	err = nfs4_pnfs_ds_create(ds, &clp);
+
+	spin_lock(&nfs4_ds_pool_lock);
+	if (!err) {
+		/* lockless readers in nfs4_pnfs_ds_select test ds_clp */
+		smp_wmb();
+		ds->ds_clp = clp;
+		ds->ds_state = DS_CONNECTED;
+	} else {
+		printk(KERN_ERR "%s: data server %s connect error %d\n",
+		       __func__, ds->r_addr, err);
+		ds->ds_state = DS_FAILED;
+	}
+	ds->ds_error = err;
+	spin_unlock(&nfs4_ds_pool_lock);
+
+	nfs4_pnfs_ds_put(ds);
+}
+
+/*
+ * Set up the session to a data server on nfs4_ds_connect_wq, so that
+ * the data servers of a device are connected to in parallel and the
+ * I/O path never waits for one.  A connect that failed is only retried
+ * after NFS4_PNFS_DS_RETRY_TIMEO.  Doesn't sleep.
+ */
+static void
+nfs4_pnfs_ds_connect(struct nfs4_pnfs_ds *ds)
+{
+	spin_lock(&nfs4_ds_pool_lock);
+	if (ds->ds_state == DS_CONNECTING || ds->ds_state == DS_CONNECTED ||
+	    (ds->ds_state == DS_FAILED &&
+	     time_before(jiffies,
+			 ds->ds_connect_time + NFS4_PNFS_DS_RETRY_TIMEO))) {
+		spin_unlock(&nfs4_ds_pool_lock);
+		return;
+	}
+	ds->ds_state = DS_CONNECTING;
+	ds->ds_connect_time = jiffies;
+	atomic_inc(&ds->ds_count);
+	spin_unlock(&nfs4_ds_pool_lock);
+
+	dprintk("%s queueing connect to %s\n", __func__, ds->r_addr);
+	queue_work(nfs4_ds_connect_wq, &ds->ds_connect_work);
+}
+
+static void
+device_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nfs4_pnfs_dev_item, rcu));
+}
+
+/*
+ * Free a device that is no longer hashed.  Lockless lookups may still
+ * be looking at the item itself, but never past a zero count, so
+ * only the item waits for a grace period.
+ */
 static void
-device_destroy(struct nfs4_pnfs_dev_item *dev,
-	       struct nfs4_pnfs_dev_hlist *hlist)
+device_destroy(struct nfs4_pnfs_dev_item *dev)
 {
 	struct nfs4_pnfs_dev *fdev;
 	struct nfs4_pnfs_ds *ds;
-	HLIST_HEAD(release);
 	int i, j;
 
 	if (!dev)
@@ -324,47 +472,156 @@ device_destroy(struct nfs4_pnfs_dev_item *dev,
 		deviceid_fmt(&dev->dev_id));
 	print_stripe_devs(dev);
 
-	write_lock(&hlist->dev_lock);
-	hlist_del_init(&dev->hash_node);
-
 	fdev = &dev->stripe_devs[0];
-	for (i = 0; i < dev->stripe_count; i++) {
+	for (i = 0; fdev && i < dev->stripe_count; i++) {
 		for (j = 0; j < fdev->num_ds; j++) {
 			ds = fdev->ds_list[j];
-			if (ds != NULL) {
-				/* move to release list */
-				hlist_del_init(&ds->ds_node);
-				hlist_add_head(&ds->ds_node, &release);
-			}
+			if (ds != NULL)
+				nfs4_pnfs_ds_put(ds);
 		}
 		fdev++;
 	}
-	write_unlock(&hlist->dev_lock);
-	while (!hlist_empty(&release)) {
-		ds = hlist_entry(release.first, struct nfs4_pnfs_ds, ds_node);
-		hlist_del(&ds->ds_node);
-		/* wait until the last reference to destroy the ds session
-		 * and nfs_put_client on the ds_clp */
-		if (!atomic_dec_and_test(&ds->ds_count))
-			ds->ds_clp = NULL;
-		destroy_ds(ds);
-	}
 	kfree(dev->stripe_devs);
-	kfree(dev);
+	call_rcu(&dev->rcu, device_free_rcu);
 }
 
-int
-nfs4_pnfs_devlist_init(struct nfs4_pnfs_dev_hlist *hlist)
+static struct nfs4_pnfs_dev_table *
+device_table_alloc(unsigned int bits)
 {
+	struct nfs4_pnfs_dev_table *tbl;
 	int i;
 
-	hlist->dev_lock = __RW_LOCK_UNLOCKED("pnfs_devlist_lock");
+	tbl = kmalloc(sizeof(*tbl) + (sizeof(struct hlist_head) << bits),
+		      GFP_KERNEL);
+	if (!tbl)
+		return NULL;
+	tbl->bits = bits;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&tbl->buckets[i]);
+	return tbl;
+}
 
-	for (i = 0; i < NFS4_PNFS_DEV_HASH_SIZE; i++) {
-		INIT_HLIST_HEAD(&hlist->dev_list[i]);
-		INIT_HLIST_HEAD(&hlist->dev_dslist[i]);
+static void
+device_table_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nfs4_pnfs_dev_table, rcu));
+}
+
+/*
+ * Double the hash table.  Devices are moved over one at a time, so a
+ * lockless lookup running meanwhile may miss one and fall back to the
+ * locked lookup; the old table is freed once no lookup can be on it.
+ */
+static void
+device_table_grow(struct nfs4_pnfs_dev_hlist *hlist, unsigned int bits)
+{
+	struct nfs4_pnfs_dev_table *old, *new;
+	struct nfs4_pnfs_dev_item *dev;
+	unsigned long hash;
+	int i;
+
+	new = device_table_alloc(bits + 1);
+	if (!new)
+		return;
+
+	spin_lock(&hlist->dev_lock);
+	old = hlist->dev_table;
+	if (old->bits != bits) {
+		spin_unlock(&hlist->dev_lock);
+		kfree(new);
+		return;
+	}
+	for (i = 0; i < (1 << bits); i++) {
+		while (!hlist_empty(&old->buckets[i])) {
+			dev = hlist_entry(old->buckets[i].first,
+					  struct nfs4_pnfs_dev_item, hash_node);
+			hlist_del_rcu(&dev->hash_node);
+			hash = _deviceid_hash(&dev->dev_id, new->bits);
+			hlist_add_head_rcu(&dev->hash_node,
+					   &new->buckets[hash]);
+		}
+	}
+	rcu_assign_pointer(hlist->dev_table, new);
+	spin_unlock(&hlist->dev_lock);
+
+	dprintk("%s: %u devices, hash bits %u\n", __func__,
+		hlist->dev_count, new->bits);
+	call_rcu(&old->rcu, device_table_free_rcu);
+}
+
+/*
+ * Free the devices on the LRU that are no longer hashed, and the
+ * oldest ones past 'max'.
+ */
+static void
+device_lru_reap(struct nfs4_pnfs_dev_hlist *hlist, unsigned int max)
+{
+	struct nfs4_pnfs_dev_item *dev;
+	LIST_HEAD(release);
+
+	spin_lock(&hlist->dev_lock);
+	while (!list_empty(&hlist->dev_lru)) {
+		dev = list_entry(hlist->dev_lru.next,
+				 struct nfs4_pnfs_dev_item, lru);
+		if (hlist->dev_lru_count <= max &&
+		    !hlist_unhashed(&dev->hash_node))
+			break;
+		if (!hlist_unhashed(&dev->hash_node))
+			_device_unhash(hlist, dev);
+		list_move(&dev->lru, &release);
+		hlist->dev_lru_count--;
 	}
+	spin_unlock(&hlist->dev_lock);
 
+	while (!list_empty(&release)) {
+		dev = list_entry(release.next, struct nfs4_pnfs_dev_item, lru);
+		list_del(&dev->lru);
+		device_destroy(dev);
+	}
+}
+
+/* Assumes lock is held */
+static inline int
+_device_table_full(struct nfs4_pnfs_dev_hlist *hlist)
+{
+	return hlist->dev_count > (2U << hlist->dev_table->bits) &&
+	       hlist->dev_table->bits < NFS4_PNFS_DEV_HASH_MAX_BITS;
+}
+
+/*
+ * Grow the table and evict devices outside of the callers, which run
+ * on rpciod and under the layout lock: both allocate, and freeing a
+ * device may destroy a data server session.
+ */
+static void
+device_work(struct work_struct *work)
+{
+	struct nfs4_pnfs_dev_hlist *hlist =
+		container_of(work, struct nfs4_pnfs_dev_hlist, dev_work);
+	unsigned int bits = 0;
+
+	spin_lock(&hlist->dev_lock);
+	if (_device_table_full(hlist))
+		bits = hlist->dev_table->bits;
+	spin_unlock(&hlist->dev_lock);
+
+	if (bits)
+		device_table_grow(hlist, bits);
+	device_lru_reap(hlist, NFS4_PNFS_DEV_LRU_MAX);
+}
+
+int
+nfs4_pnfs_devlist_init(struct nfs4_pnfs_dev_hlist *hlist)
+{
+	spin_lock_init(&hlist->dev_lock);
+	INIT_LIST_HEAD(&hlist->dev_lru);
+	INIT_WORK(&hlist->dev_work, device_work);
+	hlist->dev_count = 0;
+	hlist->dev_lru_count = 0;
+
+	hlist->dev_table = device_table_alloc(NFS4_PNFS_DEV_HASH_BITS);
+	if (!hlist->dev_table)
+		return -ENOMEM;
 	return 0;
 }
 
@@ -374,66 +631,81 @@ nfs4_pnfs_devlist_init(struct nfs4_pnfs_dev_hlist *hlist)
 void
 nfs4_pnfs_devlist_destroy(struct nfs4_pnfs_dev_hlist *hlist)
 {
+	struct nfs4_pnfs_dev_table *tbl;
 	int i;
 
-	if (hlist == NULL)
+	if (hlist == NULL || hlist->dev_table == NULL)
 		return;
 
+	cancel_work_sync(&hlist->dev_work);
 	/* No lock held, as synchronization should occur at upper levels */
-	for (i = 0; i < NFS4_PNFS_DEV_HASH_SIZE; i++) {
+	tbl = hlist->dev_table;
+	for (i = 0; i < (1 << tbl->bits); i++) {
 		struct hlist_node *np, *next;
 
-		hlist_for_each_safe(np, next, &hlist->dev_list[i]) {
+		hlist_for_each_safe(np, next, &tbl->buckets[i]) {
 			struct nfs4_pnfs_dev_item *dev;
 			dev = hlist_entry(np, struct nfs4_pnfs_dev_item,
 					  hash_node);
-			/* device_destroy grabs hlist->dev_lock */
-			device_destroy(dev, hlist);
+			_device_unhash(hlist, dev);
+			list_del_init(&dev->lru);
+			device_destroy(dev);
 		}
 	}
+	/* and those a notification already unhashed */
+	device_lru_reap(hlist, 0);
+	kfree(tbl);
+	hlist->dev_table = NULL;
 }
 
 /*
- * Add the device to the list of available devices for this mount point.
- * The * rpc client is created during first I/O.
+ * Add the device to the list of available devices for this mount point,
+ * and return it with a reference held.  If another thread added it
+ * first, that one is returned instead.
  */
-static int
+static struct nfs4_pnfs_dev_item *
 nfs4_pnfs_device_add(struct filelayout_mount_type *mt,
 		     struct nfs4_pnfs_dev_item *dev)
 {
 	struct nfs4_pnfs_dev_item *tmp_dev;
 	struct nfs4_pnfs_dev_hlist *hlist = mt->hlist;
+	int work = 0;
 
 	dprintk("nfs4_pnfs_device_add\n");
 
-	/* Write lock, do lookup again, and then add device */
-	write_lock(&hlist->dev_lock);
+	/* Lock, do lookup again, and then add device */
+	spin_lock(&hlist->dev_lock);
 	tmp_dev = _device_lookup(hlist, &dev->dev_id);
-	if (tmp_dev == NULL)
+	if (tmp_dev == NULL) {
 		_device_add(hlist, dev);
-	write_unlock(&hlist->dev_lock);
+		work = _device_table_full(hlist) ||
+		       hlist->dev_lru_count > NFS4_PNFS_DEV_LRU_MAX;
+	} else
+		_device_get(hlist, tmp_dev);
+	spin_unlock(&hlist->dev_lock);
 
 	/* Cleanup, if device was recently added */
 	if (tmp_dev != NULL) {
 		dprintk(" device found, not adding (after creation)\n");
-		device_destroy(dev, hlist);
+		device_destroy(dev);
+		return tmp_dev;
 	}
 
-	return 0;
+	if (work)
+		schedule_work(&hlist->dev_work);
+	return dev;
 }
 
-static void
-nfs4_pnfs_ds_add(struct filelayout_mount_type *mt, struct nfs4_pnfs_ds **dsp,
-		 u32 ip_addr, u32 port, char *r_addr, int len)
+/* Look the data server up in the pool, adding it if it isn't there */
+static struct nfs4_pnfs_ds *
+nfs4_pnfs_ds_add(struct nfs_server *mds_srv, u32 ip_addr, u32 port,
+		 char *r_addr, int len)
 {
 	struct nfs4_pnfs_ds *tmp_ds, *ds;
-	struct nfs4_pnfs_dev_hlist *hlist = mt->hlist;
-
-	*dsp = NULL;
 
 	ds = kzalloc(sizeof(*tmp_ds), GFP_KERNEL);
 	if (!ds)
-		return;
+		return NULL;
 
 	/* Initialize ds */
 	ds->ds_ip_addr = ip_addr;
@@ -441,25 +713,36 @@ nfs4_pnfs_ds_add(struct filelayout_mount_type *mt, struct nfs4_pnfs_ds **dsp,
 	strncpy(ds->r_addr, r_addr, len);
 	atomic_set(&ds->ds_count, 1);
 	INIT_HLIST_NODE(&ds->ds_node);
+	INIT_WORK(&ds->ds_connect_work, nfs4_pnfs_ds_connect_work);
 	ds->ds_clp = NULL;
+	ds->ds_state = DS_UNCONNECTED;
+	/* The session may outlive this mount, keep what it needs of it */
+	ds->ds_timeo = *mds_srv->client->cl_xprt->timeout;
+	ds->ds_hostname = kstrdup(mds_srv->nfs_client->cl_hostname,
+				  GFP_KERNEL);
+	if (!ds->ds_hostname) {
+		kfree(ds);
+		return NULL;
+	}
 
-	write_lock(&hlist->dev_lock);
-	tmp_ds = _data_server_lookup(hlist, ip_addr, port);
+	spin_lock(&nfs4_ds_pool_lock);
+	tmp_ds = _data_server_lookup(ip_addr, port);
 	if (tmp_ds == NULL) {
 		dprintk("%s add new data server ip 0x%x\n", __func__,
 				ds->ds_ip_addr);
-		_data_server_add(hlist, ds);
-		*dsp = ds;
-	}
-	write_unlock(&hlist->dev_lock);
+		_data_server_add(ds);
+	} else
+		atomic_inc(&tmp_ds->ds_count);
+	spin_unlock(&nfs4_ds_pool_lock);
+
 	if (tmp_ds != NULL) {
 		destroy_ds(ds);
-		atomic_inc(&tmp_ds->ds_count);
 		dprintk("%s data server found ip 0x%x, inc'ed ds_count to %d\n",
 				__func__, tmp_ds->ds_ip_addr,
 				atomic_read(&tmp_ds->ds_count));
-		*dsp = tmp_ds;
+		ds = tmp_ds;
 	}
+	return ds;
 }
 
 static struct nfs4_pnfs_ds *
@@ -468,7 +751,7 @@ decode_and_add_ds(uint32_t **pp, struct filelayout_mount_type *mt)
 	struct nfs_server *mds_srv = NFS_SB(mt->fl_sb);
 	struct nfs4_pnfs_ds *ds = NULL;
 	char r_addr[29]; /* max size of ip/port string */
-	int len, err;
+	int len;
 	u32 ip_addr, port;
 	int tmp[6];
 	uint32_t *p = *pp;
@@ -500,20 +783,18 @@ decode_and_add_ds(uint32_t **pp, struct filelayout_mount_type *mt)
 	ip_addr = htonl((tmp[0]<<24) | (tmp[1]<<16) | (tmp[2]<<8) | (tmp[3]));
 	port = htons((tmp[4] << 8) | (tmp[5]));
 
-	nfs4_pnfs_ds_add(mt, &ds, ip_addr, port, r_addr, len);
+	ds = nfs4_pnfs_ds_add(mds_srv, ip_addr, port, r_addr, len);
+	if (ds == NULL)
+		goto out_err;
 
-	/* XXX: Do we connect to data servers here?
-	 * Don't want a lot of un-used (never used!) connections....
-	 * Do we wait until LAYOUTGET which will be called on OPEN?
+	/* The device is about to be used, so start connecting now; by
+	 * the time the first I/O selects a data server the sessions to
+	 * all of them are set up or well on their way.
+	 *
+	 * An address that can't be reached is kept all the same: the
+	 * data server may have other multipath addresses that work.
 	 */
-	if (!ds->ds_clp) {
-		err = nfs4_pnfs_ds_create(mds_srv, ds);
-		if (err) {
-			printk(KERN_ERR "%s nfs4_pnfs_ds_create error %d\n",
-			       __func__, err);
-			goto out_err;
-		}
-	}
+	nfs4_pnfs_ds_connect(ds);
 
 	dprintk("%s: addr:port string = %s\n", __func__, r_addr);
 	return ds;
@@ -545,6 +826,8 @@ decode_device(struct filelayout_mount_type *mt, struct pnfs_device *dev)
 	file_dev = kzalloc(sizeof(*file_dev), GFP_KERNEL);
 	if (!file_dev)
 		goto out_err;
+	INIT_LIST_HEAD(&file_dev->lru);
+	atomic_set(&file_dev->count, 1);
 
 	file_dev->stripe_devs = kzalloc(sizeof(struct nfs4_pnfs_dev) * len,
 					GFP_KERNEL);
@@ -595,7 +878,7 @@ decode_device(struct filelayout_mount_type *mt, struct pnfs_device *dev)
 	return file_dev;
 
 out_err_free:
-	device_destroy(file_dev, mt->hlist);
+	device_destroy(file_dev);
 out_err:
 	dprintk("%s ERROR: returning NULL\n", __func__);
 	return NULL;
@@ -604,7 +887,7 @@ out_err:
 /* Decode the opaque device specified in 'dev'
  * and add it to the list of available devices for this
  * mount point.
- * Must at some point be followed up with device_destroy
+ * Must at some point be followed up with nfs4_pnfs_device_put
  */
 static struct nfs4_pnfs_dev_item*
 decode_and_add_device(struct filelayout_mount_type *mt, struct pnfs_device *dev)
@@ -615,38 +898,36 @@ decode_and_add_device(struct filelayout_mount_type *mt, struct pnfs_device *dev)
 	if (!file_dev) {
 		printk(KERN_WARNING "%s: Could not decode device\n",
 			__func__);
-		device_destroy(file_dev, mt->hlist);
 		return NULL;
 	}
 
-	if (nfs4_pnfs_device_add(mt, file_dev))
-		return NULL;
-
-	return file_dev;
+	return nfs4_pnfs_device_add(mt, file_dev);
 }
 
 /* For each deviceid, if not already in the cache,
  * call getdeviceinfo and add the devices associated with
  * the deviceid to the list of available devices for this
- * mount point.
- * Must at some point be followed up with device_destroy.
+ * mount point.  They stay cached, unused, until evicted.
  */
 int
 process_deviceid_list(struct filelayout_mount_type *mt,
 		      struct nfs_fh *fh,
 		      struct pnfs_devicelist *devlist)
 {
+	struct nfs4_pnfs_dev_item *dev;
 	int i;
 
 	dprintk("--> %s: num_devs=%d\n", __func__, devlist->num_devs);
 
 	for (i = 0; i < devlist->num_devs; i++) {
-		if (!nfs4_pnfs_device_item_get(mt, fh, &devlist->dev_id[i])) {
+		dev = nfs4_pnfs_device_item_get(mt, fh, &devlist->dev_id[i]);
+		if (!dev) {
 			printk(KERN_WARNING
 			       "<-- %s: Error retrieving device %d\n",
 			       __func__, i);
 			return 1;
 		}
+		nfs4_pnfs_device_put(mt, dev);
 	}
 	dprintk("<-- %s: success\n", __func__);
 	return 0;
@@ -661,6 +942,7 @@ get_device_info(struct filelayout_mount_type *mt,
 		struct pnfs_deviceid *dev_id)
 {
 	struct pnfs_device *pdev = NULL;
+	struct nfs4_pnfs_dev_item *dev;
 	int rc;
 
 	dprintk("%s mt %p\n", __func__, mt);
@@ -670,8 +952,9 @@ get_device_info(struct filelayout_mount_type *mt,
 
 	memcpy(&pdev->dev_id, dev_id, NFS4_PNFS_DEVICEID4_SIZE);
 	pdev->layout_type = LAYOUT_NFSV4_FILES;
-	/* TODO: Update types when CB_NOTIFY_DEVICEID is available */
-	pdev->dev_notify_types = 0;
+	/* see nfs4_pnfs_device_invalidate */
+	pdev->dev_notify_types = (1 << NOTIFY_DEVICEID4_CHANGE) |
+				 (1 << NOTIFY_DEVICEID4_DELETE);
 
 	rc = pnfs_callback_ops->nfs_getdeviceinfo(mt->fl_sb, fh, pdev);
 	dprintk("%s getdevice info returns %d\n", __func__, rc);
@@ -683,25 +966,161 @@ get_device_info(struct filelayout_mount_type *mt,
 	/* Found new device, need to decode it and then add it to the
 	 * list of known devices for this mountpoint.
 	 */
-	return decode_and_add_device(mt, pdev);
+	dev = decode_and_add_device(mt, pdev);
+	kfree(pdev);
+	return dev;
 }
 
+/*
+ * Return the device with a reference held, asking the server for it
+ * if it isn't cached.  Drop the reference with nfs4_pnfs_device_put.
+ */
 struct nfs4_pnfs_dev_item *
 nfs4_pnfs_device_item_get(struct filelayout_mount_type *mt,
 			  struct nfs_fh *fh,
 			  struct pnfs_deviceid *dev_id)
 {
+	struct nfs4_pnfs_dev_hlist *hlist = mt->hlist;
 	struct nfs4_pnfs_dev_item *dev;
 
-	read_lock(&mt->hlist->dev_lock);
-	dev = _device_lookup(mt->hlist, dev_id);
-	read_unlock(&mt->hlist->dev_lock);
+	dev = _device_lookup_rcu(hlist, dev_id);
+	if (dev != NULL)
+		return dev;
+
+	spin_lock(&hlist->dev_lock);
+	dev = _device_lookup(hlist, dev_id);
+	if (dev != NULL)
+		_device_get(hlist, dev);
+	spin_unlock(&hlist->dev_lock);
 
 	if (dev == NULL)
 		dev = get_device_info(mt, fh, dev_id);
 	return dev;
 }
 
+/*
+ * Drop a reference to a device.  The last one puts it on the LRU;
+ * the freeing is left to dev_work, since this can be called
+ * from rpciod and under the layout lock.
+ */
+void
+nfs4_pnfs_device_put(struct filelayout_mount_type *mt,
+		     struct nfs4_pnfs_dev_item *dev)
+{
+	struct nfs4_pnfs_dev_hlist *hlist = mt->hlist;
+
+	if (!atomic_dec_and_lock(&dev->count, &hlist->dev_lock))
+		return;
+	/* reap unhashed devices first */
+	if (hlist_unhashed(&dev->hash_node))
+		list_add(&dev->lru, &hlist->dev_lru);
+	else
+		list_add_tail(&dev->lru, &hlist->dev_lru);
+	hlist->dev_lru_count++;
+	spin_unlock(&hlist->dev_lock);
+}
+
+/*
+ * The server notified that a device changed or went away.  Unhash it
+ * so that new layouts fetch it again; layouts still using the old
+ * one keep it until they are freed.
+ */
+void
+nfs4_pnfs_device_invalidate(struct filelayout_mount_type *mt,
+			    struct pnfs_deviceid *dev_id)
+{
+	struct nfs4_pnfs_dev_hlist *hlist = mt->hlist;
+	struct nfs4_pnfs_dev_item *dev;
+
+	spin_lock(&hlist->dev_lock);
+	dev = _device_lookup(hlist, dev_id);
+	if (dev != NULL) {
+		_device_unhash(hlist, dev);
+		if (!atomic_read(&dev->count))
+			list_move(&dev->lru, &hlist->dev_lru);
+	}
+	spin_unlock(&hlist->dev_lock);
+
+	if (dev != NULL)
+		schedule_work(&hlist->dev_work);
+}
+
+/*
+ * Pick the multipath address of a data server to send the next I/O to.
+ * The addresses are used in turn, spreading I/O over all of them, but
+ * those without a session and those that failed in the last
+ * NFS4_PNFS_DS_RETRY_TIMEO are passed over.  If every address failed
+ * recently, the one that failed longest ago is retried.
+ */
+static struct nfs4_pnfs_ds *
+_nfs4_pnfs_ds_select(struct nfs4_pnfs_dev *fdev, unsigned int start)
+{
+	struct nfs4_pnfs_ds *ds, *stale = NULL;
+	unsigned long failed;
+	int i;
+
+	for (i = 0; i < fdev->num_ds; i++) {
+		ds = fdev->ds_list[(start + i) % fdev->num_ds];
+		if (ds == NULL)
+			continue;
+		if (ds->ds_clp == NULL) {
+			/* retries a failed connect once it is due */
+			nfs4_pnfs_ds_connect(ds);
+			continue;
+		}
+		smp_rmb();
+		failed = ds->ds_clp->cl_ds_failed;
+		if (!failed ||
+		    time_after(jiffies, failed + NFS4_PNFS_DS_RETRY_TIMEO))
+			return ds;
+		if (stale == NULL ||
+		    time_before(failed, stale->ds_clp->cl_ds_failed))
+			stale = ds;
+	}
+	return stale;
+}
+
+/*
+ * As above, for the read, write and commit paths, which may run on
+ * rpciod or from writeback and so must not wait for a connect.
+ * Returns NULL while no address has a session yet, in which case the
+ * I/O goes to the MDS.
+ */
+struct nfs4_pnfs_ds *
+nfs4_pnfs_ds_select(struct nfs4_pnfs_dev *fdev)
+{
+	return _nfs4_pnfs_ds_select(fdev, fdev->ds_rotor++);
+}
+
+/*
+ * Note how an I/O to a data server address ended, so that
+ * nfs4_pnfs_ds_select fails over to another address when this one
+ * stops working, and back once it answers again.
+ */
+void
+nfs4_pnfs_ds_io_done(struct nfs_client *clp, int status)
+{
+	switch (status) {
+	case -EIO:
+	case -ETIMEDOUT:
+	case -ECONNREFUSED:
+	case -ECONNRESET:
+	case -EHOSTDOWN:
+	case -EHOSTUNREACH:
+	case -ENETUNREACH:
+	case -ENOTCONN:
+	case -EPIPE:
+		if (!clp->cl_ds_failed)
+			dprintk("%s: data server %p failed (%d)\n",
+				__func__, clp, status);
+		clp->cl_ds_failed = jiffies | 1;
+		break;
+	default:
+		if (status >= 0)
+			clp->cl_ds_failed = 0;
+	}
+}
+
 /* Want res = ((offset / layout->stripe_unit) % di->stripe_count)
  * Then: ((res + fsi) % di->stripe_count)
  */
@@ -728,7 +1147,6 @@ nfs4_pnfs_dserver_get(struct pnfs_layout_segment *lseg,
 		      struct nfs4_pnfs_dserver *dserver)
 {
 	struct nfs4_filelayout_segment *layout = LSEG_LD_DATA(lseg);
-	struct inode *inode = PNFS_INODE(lseg->layout);
 	struct nfs4_pnfs_dev_item *di;
 	u64 tmp, tmp2;
 	u32 stripe_idx, end_idx;
@@ -736,8 +1154,8 @@ nfs4_pnfs_dserver_get(struct pnfs_layout_segment *lseg,
 	if (!layout)
 		return 1;
 
-	di = nfs4_pnfs_device_item_get(FILE_MT(inode), NFS_FH(inode),
-				       &layout->dev_id);
+	/* the segment holds the device, no lookup needed */
+	di = layout->dev;
 	if (di == NULL)
 		return 1;
 
@@ -777,23 +1195,80 @@ nfs4_pnfs_dserver_get(struct pnfs_layout_segment *lseg,
 	return 0;
 }
 
-/* Currently not used.
- * I have disabled checking the device count until we can think of a good way
- * to call nfs4_pnfs_device_put in a generic way from the pNFS client.
- * The only way I think think of is to put the nfs4_pnfs_dev_item directly
- * in the nfs4_write/read_data structure, which breaks the clear line between
- * the pNFS client and layout drivers.  If I did do this, then I could call
- * an ioctl on the NFSv4 file layout driver to decrement the device count.
+#ifdef CONFIG_PROC_FS
+/*
+ * display the data server pool in "/proc/fs/nfsfs/dataservers"
  */
-#if 0
-static void
-nfs4_pnfs_device_put(struct nfs_server *server, struct nfs4_pnfs_dev_hlist *hlist, struct nfs4_pnfs_dev_item *dev)
+static int
+nfs4_ds_pool_show(struct seq_file *m, void *v)
 {
-	dprintk("nfs4_pnfs_device_put: dev_id=%u\n", dev->dev_id);
-	/* XXX Do we need to invoke this put_client? */
-	/* server->rpc_ops->put_client(dev->clp); */
-	atomic_dec(&dev->count);
+	struct nfs4_pnfs_ds *ds;
+	struct hlist_node *np;
+	unsigned long failed;
+	int i;
+
+	seq_puts(m, "ADDRESS                       STATE      USE ERR  FAILED\n");
+
+	spin_lock(&nfs4_ds_pool_lock);
+	for (i = 0; i < NFS4_PNFS_DEV_HASH_SIZE; i++) {
+		hlist_for_each_entry(ds, np, &nfs4_ds_pool[i], ds_node) {
+			failed = ds->ds_clp ? ds->ds_clp->cl_ds_failed : 0;
+			seq_printf(m, "%-29s %-10s %3d %3d  %lus\n",
+				   ds->r_addr,
+				   nfs4_ds_state_name[ds->ds_state],
+				   atomic_read(&ds->ds_count),
+				   ds->ds_error,
+				   failed ? (jiffies - failed) / HZ : 0);
+		}
+	}
+	spin_unlock(&nfs4_ds_pool_lock);
+	return 0;
 }
+
+static int
+nfs4_ds_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nfs4_ds_pool_show, NULL);
+}
+
+static const struct file_operations nfs4_ds_pool_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nfs4_ds_pool_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_PROC_FS */
+
+int
+nfs4_pnfs_ds_pool_init(void)
+{
+	int i;
+
+	for (i = 0; i < NFS4_PNFS_DEV_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&nfs4_ds_pool[i]);
+	nfs4_ds_connect_wq = create_workqueue("pnfs_ds_connect");
+	if (nfs4_ds_connect_wq == NULL)
+		return -ENOMEM;
+#ifdef CONFIG_PROC_FS
+	if (!proc_create("fs/nfsfs/dataservers", S_IFREG|S_IRUGO, NULL,
+			 &nfs4_ds_pool_fops)) {
+		destroy_workqueue(nfs4_ds_connect_wq);
+		return -ENOMEM;
+	}
 #endif
+	return 0;
+}
+
+/* All mounts are gone, and with them all pool references */
+void
+nfs4_pnfs_ds_pool_exit(void)
+{
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("fs/nfsfs/dataservers", NULL);
+#endif
+	/* drops the references held by connects still in progress */
+	destroy_workqueue(nfs4_ds_connect_wq);
+}
 
 #endif /* CONFIG_PNFS */
@@ -1779,6 +1779,9 @@ static int nfs4_intent_set_file(struct nameidata *nd, struct path *path, struct
 		struct nfs_open_context *ctx;
 		ctx = nfs_file_open_context(filp);
 		ctx->state = state;
+#ifdef CONFIG_PNFS
+		pnfs_layoutget_on_open(ctx);
+#endif /* CONFIG_PNFS */
 		return 0;
 	}
 	ret = PTR_ERR(filp);
@@ -5139,7 +5142,7 @@ static void nfs4_pnfs_layoutget_release(void *calldata)
 	BUG_ON(!lo);
 
 	dprintk("--> %s\n", __func__);
-	pnfs_layout_release(lo);
+	pnfs_layoutget_release(lo, lgp);
 	kfree(calldata);
 	dprintk("<-- %s\n", __func__);
 }
@@ -5167,13 +5170,21 @@ static int nfs4_proc_pnfs_layoutget(struct nfs4_pnfs_layoutget *lgp)
 		.callback_data = lgp,
 		.flags = RPC_TASK_ASYNC,
 	};
+	int async = lgp->async;
 	int status;
 
 	dprintk("--> %s\n", __func__);
 
 	task = rpc_run_task(&task_setup_data);
 	if (IS_ERR(task)) {
-		status = PTR_ERR(task);
+		/* the release has already run, even for a prefetch */
+		status = async ? 0 : PTR_ERR(task);
+		goto out;
+	}
+	if (async) {
+		/* don't touch lgp, the reply may already have freed it */
+		rpc_put_task(task);
+		status = 0;
 		goto out;
 	}
 	status = nfs4_wait_for_completion_rpc_task(task);
@@ -311,6 +311,12 @@ pnfs_unregister_layoutdriver(struct pnfs_layoutdriver_type *ld_type)
 #define BUG_ON_UNLOCKED_LO(lo) do {} while (0)
 #endif /* CONFIG_SMP */
 
+static inline int
+pnfs_layout_empty(struct pnfs_layout_type *lo)
+{
+	return RB_EMPTY_ROOT(&lo->segs[0]) && RB_EMPTY_ROOT(&lo->segs[1]);
+}
+
 /*
  * get and lock nfs->current_layout
  */
@@ -341,7 +347,7 @@ put_unlock_current_layout(struct nfs_inode *nfsi,
 	BUG_ON_UNLOCKED_LO(lo);
 	BUG_ON(lo->refcount <= 0);
 
-	if (--lo->refcount == 0 && list_empty(&lo->segs)) {
+	if (--lo->refcount == 0 && pnfs_layout_empty(lo)) {
 		struct layoutdriver_io_operations *io_ops =
 			PNFS_LD_IO_OPS(lo);
 
@@ -374,10 +380,28 @@ pnfs_layout_release(struct pnfs_layout_type *lo)
 	put_unlock_current_layout(nfsi, lo);
 }
 
+/*
+ * Called when a LAYOUTGET is released: drop the layout reference taken
+ * by whoever issued it, and for a prefetch also the open context.
+ */
+void
+pnfs_layoutget_release(struct pnfs_layout_type *lo,
+		       struct nfs4_pnfs_layoutget *lgp)
+{
+	struct nfs_inode *nfsi = NFS_I(lo->inode);
+
+	spin_lock(&nfsi->lo_lock);
+	if (lgp->async)
+		nfsi->pnfs_layout_state &= ~NFS_INO_LAYOUT_PREFETCH;
+	put_unlock_current_layout(nfsi, lo);
+	if (lgp->async)
+		put_nfs_open_context(lgp->args.ctx);
+}
+
 static inline void
 init_lseg(struct pnfs_layout_type *lo, struct pnfs_layout_segment *lseg)
 {
-	INIT_LIST_HEAD(&lseg->fi_list);
+	RB_CLEAR_NODE(&lseg->fi_node);
 	kref_init(&lseg->kref);
 	lseg->layout = lo;
 }
@@ -458,6 +482,186 @@ lo_seg_intersecting(struct nfs4_pnfs_layout_segment *l1,
 	       (end2 == NFS4_LENGTH_EOF || end2 > start1);
 }
 
+/*
+ * Layout segments are kept in two trees per layout, one per iomode,
+ * sorted by offset.  Each node also records the highest end offset in
+ * its subtree, so that a segment covering a range can be found without
+ * walking every segment that starts before it.
+ */
+static inline struct rb_root *
+lseg_tree(struct pnfs_layout_type *lo, enum pnfs_iomode iomode)
+{
+	return &lo->segs[iomode == IOMODE_RW];
+}
+
+static inline u64
+lseg_end(struct pnfs_layout_segment *lseg)
+{
+	return end_offset(lseg->range.offset, lseg->range.length);
+}
+
+static void
+lseg_update_max_end(struct rb_node *node)
+{
+	struct pnfs_layout_segment *lseg, *child;
+	u64 max_end;
+
+	lseg = rb_entry(node, struct pnfs_layout_segment, fi_node);
+	max_end = lseg_end(lseg);
+	if (node->rb_left) {
+		child = rb_entry(node->rb_left, struct pnfs_layout_segment,
+				 fi_node);
+		if (child->fi_max_end > max_end)
+			max_end = child->fi_max_end;
+	}
+	if (node->rb_right) {
+		child = rb_entry(node->rb_right, struct pnfs_layout_segment,
+				 fi_node);
+		if (child->fi_max_end > max_end)
+			max_end = child->fi_max_end;
+	}
+	lseg->fi_max_end = max_end;
+}
+
+/*
+ * Recompute fi_max_end from node up to the root.  Rebalancing only
+ * rotates nodes along this path, so fixing them and their siblings is
+ * enough.
+ */
+static void
+lseg_update_path(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	while (node) {
+		lseg_update_max_end(node);
+		parent = rb_parent(node);
+		if (!parent)
+			break;
+		if (node == parent->rb_left && parent->rb_right)
+			lseg_update_max_end(parent->rb_right);
+		else if (node == parent->rb_right && parent->rb_left)
+			lseg_update_max_end(parent->rb_left);
+		node = parent;
+	}
+}
+
+/*
+ * cmp two layout segments for sorting into layout cache
+ */
+static inline s64
+cmp_layout(struct nfs4_pnfs_layout_segment *l1,
+	   struct nfs4_pnfs_layout_segment *l2)
+{
+	/* lower offset < higher offset */
+	if (l1->offset != l2->offset)
+		return l1->offset < l2->offset ? -1 : 1;
+
+	/* longer length < shorter length */
+	if (l1->length != l2->length)
+		return l1->length > l2->length ? -1 : 1;
+	return 0;
+}
+
+static void
+lseg_tree_insert(struct rb_root *root, struct pnfs_layout_segment *lseg)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct pnfs_layout_segment *lp;
+
+	while (*p) {
+		parent = *p;
+		lp = rb_entry(parent, struct pnfs_layout_segment, fi_node);
+		if (cmp_layout(&lseg->range, &lp->range) < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lseg->fi_node, parent, p);
+	lseg->fi_max_end = lseg_end(lseg);
+	rb_insert_color(&lseg->fi_node, root);
+
+	/* start from the deepest node the rebalancing may have moved */
+	if (lseg->fi_node.rb_left)
+		lseg_update_path(lseg->fi_node.rb_left);
+	else if (lseg->fi_node.rb_right)
+		lseg_update_path(lseg->fi_node.rb_right);
+	else
+		lseg_update_path(&lseg->fi_node);
+}
+
+static void
+lseg_tree_erase(struct rb_root *root, struct pnfs_layout_segment *lseg)
+{
+	struct rb_node *node = &lseg->fi_node, *deepest;
+
+	/* find the deepest node whose subtree rb_erase will change */
+	if (!node->rb_left && !node->rb_right)
+		deepest = rb_parent(node);
+	else if (!node->rb_right)
+		deepest = node->rb_left;
+	else if (!node->rb_left)
+		deepest = node->rb_right;
+	else {
+		deepest = rb_next(node);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (rb_parent(deepest) != node)
+			deepest = rb_parent(deepest);
+	}
+
+	rb_erase(node, root);
+	RB_CLEAR_NODE(node);
+	lseg_update_path(deepest);
+}
+
+/*
+ * Find a segment covering [start, end).  Segments to the left of a node
+ * all start no later than it, so once a node starts at or before start,
+ * its left subtree holds a match iff its fi_max_end reaches end.
+ */
+static struct pnfs_layout_segment *
+lseg_tree_find(struct rb_root *root, u64 start, u64 end)
+{
+	struct rb_node *node = root->rb_node;
+	struct pnfs_layout_segment *lseg, *child;
+
+	while (node) {
+		lseg = rb_entry(node, struct pnfs_layout_segment, fi_node);
+		if (lseg->range.offset > start) {
+			node = node->rb_left;
+			continue;
+		}
+		if (node->rb_left) {
+			child = rb_entry(node->rb_left,
+					 struct pnfs_layout_segment, fi_node);
+			if (child->fi_max_end >= end)
+				goto descend;
+		}
+		if (lseg_end(lseg) >= end)
+			return lseg;
+		node = node->rb_right;
+	}
+	return NULL;
+
+descend:
+	/* every segment below node->rb_left starts early enough */
+	node = node->rb_left;
+	while (node) {
+		lseg = rb_entry(node, struct pnfs_layout_segment, fi_node);
+		if (lseg_end(lseg) >= end)
+			return lseg;
+		child = node->rb_left ? rb_entry(node->rb_left,
+				struct pnfs_layout_segment, fi_node) : NULL;
+		if (child && child->fi_max_end >= end)
+			node = node->rb_left;
+		else
+			node = node->rb_right;
+	}
+	BUG();
+	return NULL;
+}
+
 static void
 pnfs_set_layout_stateid(struct pnfs_layout_type *lo, nfs4_stateid *stateid)
 {
@@ -514,7 +718,8 @@ get_layout(struct inode *ino,
 	   struct nfs_open_context *ctx,
 	   struct nfs4_pnfs_layout_segment *range,
 	   struct pnfs_layout_segment **lsegpp,
-	   struct pnfs_layout_type *lo)
+	   struct pnfs_layout_type *lo,
+	   int async)
 {
 	int status;
 	struct nfs_server *server = NFS_SERVER(ino);
@@ -534,6 +739,13 @@ get_layout(struct inode *ino,
 	lgp->args.inode = ino;
 	lgp->args.ctx = ctx;
 	lgp->lsegpp = lsegpp;
+	if (async) {
+		/* a prefetch is happy with whatever part it gets */
+		lgp->args.minlength = min_t(u64, range->length,
+					    PAGE_CACHE_SIZE);
+		lgp->args.ctx = get_nfs_open_context(ctx);
+		lgp->async = 1;
+	}
 
 	if (!memcmp(lo->stateid.data, &zero_stateid, NFS4_STATEID_SIZE))
 		pnfs_layout_from_open_stateid(&lgp->args.stateid, ctx->state);
@@ -560,20 +772,32 @@ static void
 pnfs_free_layout(struct pnfs_layout_type *lo,
 		 struct nfs4_pnfs_layout_segment *range)
 {
-	struct pnfs_layout_segment *lseg, *next;
+	struct pnfs_layout_segment *lseg;
+	struct rb_node *node, *next;
+	u64 end = end_offset(range->offset, range->length);
+	int i;
+
 	dprintk("%s:Begin lo %p offset %llu length %llu iomode %d\n",
 		__func__, lo, range->offset, range->length, range->iomode);
 
 	BUG_ON_UNLOCKED_LO(lo);
-	list_for_each_entry_safe (lseg, next, &lo->segs, fi_list) {
-		if (!free_matching_lseg(lseg, range))
-			continue;
-		dprintk("%s: freeing lseg %p iomode %d "
-			"offset %llu length %llu\n", __func__,
-			lseg, lseg->range.iomode, lseg->range.offset,
-			lseg->range.length);
-		list_del(&lseg->fi_list);
-		put_lseg(lseg);
+	for (i = 0; i < ARRAY_SIZE(lo->segs); i++) {
+		for (node = rb_first(&lo->segs[i]); node; node = next) {
+			next = rb_next(node);
+			lseg = rb_entry(node, struct pnfs_layout_segment,
+					fi_node);
+			/* the rest start past the range */
+			if (end != NFS4_LENGTH_EOF && lseg->range.offset >= end)
+				break;
+			if (!free_matching_lseg(lseg, range))
+				continue;
+			dprintk("%s: freeing lseg %p iomode %d "
+				"offset %llu length %llu\n", __func__,
+				lseg, lseg->range.iomode, lseg->range.offset,
+				lseg->range.length);
+			lseg_tree_erase(&lo->segs[i], lseg);
+			put_lseg(lseg);
+		}
 	}
 
 	dprintk("%s:Return\n", __func__);
@@ -658,60 +882,17 @@ pnfs_return_layout_done(struct pnfs_layout_type *lo,
 	dprintk("<-- %s\n", __func__);
 }
 
-/*
- * cmp two layout segments for sorting into layout cache
- */
-static inline s64
-cmp_layout(struct nfs4_pnfs_layout_segment *l1,
-	   struct nfs4_pnfs_layout_segment *l2)
-{
-	s64 d;
-
-	/* lower offset < higher offset */
-	d = l1->offset - l2->offset;
-	if (d)
-		return d;
-
-	/* read < read/write */
-	d = (l1->iomode == IOMODE_RW) - (l2->iomode == IOMODE_RW);
-	if (d)
-		return d;
-
-	/* longer length < shorter length */
-	return l2->length - l1->length;
-}
-
 static void
 pnfs_insert_layout(struct pnfs_layout_type *lo,
 		   struct pnfs_layout_segment *lseg)
 {
-	struct pnfs_layout_segment *lp;
-	int found = 0;
-
 	dprintk("%s:Begin\n", __func__);
 
 	BUG_ON_UNLOCKED_LO(lo);
-	list_for_each_entry (lp, &lo->segs, fi_list) {
-		if (cmp_layout(&lp->range, &lseg->range) > 0)
-			continue;
-		list_add_tail(&lseg->fi_list, &lp->fi_list);
-		dprintk("%s: inserted lseg %p "
-			"iomode %d offset %llu length %llu before "
-			"lp %p iomode %d offset %llu length %llu\n",
-			__func__, lseg, lseg->range.iomode,
-			lseg->range.offset, lseg->range.length,
-			lp, lp->range.iomode, lp->range.offset,
-			lp->range.length);
-		found = 1;
-		break;
-	}
-	if (!found) {
-		list_add_tail(&lseg->fi_list, &lo->segs);
-		dprintk("%s: inserted lseg %p "
-			"iomode %d offset %llu length %llu at tail\n",
-			__func__, lseg, lseg->range.iomode,
-			lseg->range.offset, lseg->range.length);
-	}
+	lseg_tree_insert(lseg_tree(lo, lseg->range.iomode), lseg);
+	dprintk("%s: inserted lseg %p iomode %d offset %llu length %llu\n",
+		__func__, lseg, lseg->range.iomode,
+		lseg->range.offset, lseg->range.length);
 
 	dprintk("%s:Return\n", __func__);
 }
@@ -762,7 +943,8 @@ alloc_init_layout(struct inode *ino, struct layoutdriver_io_operations *io_ops)
 	seqlock_init(&lo->seqlock);
 	memset(&lo->stateid, 0, NFS4_STATEID_SIZE);
 	lo->refcount = 1;
-	INIT_LIST_HEAD(&lo->segs);
+	lo->segs[0] = RB_ROOT;
+	lo->segs[1] = RB_ROOT;
 	lo->roc_iomode = 0;
 	lo->inode = ino;
 	return lo;
@@ -839,35 +1021,29 @@ get_lock_alloc_layout(struct inode *ino,
 	return lo;
 }
 
-static inline int
-has_matching_lseg(struct pnfs_layout_segment *lseg,
-		  struct nfs4_pnfs_layout_segment *range)
-{
-	return (range->iomode == IOMODE_READ ||
-		lseg->range.iomode == IOMODE_RW) &&
-	       lo_seg_contained(&lseg->range, range);
-}
-
 /*
- * lookup range in layout
+ * lookup range in layout.  A READ range may be served by either a READ
+ * or an RW segment, an RW range only by an RW segment.
  */
 static struct pnfs_layout_segment *
 pnfs_has_layout(struct pnfs_layout_type *lo,
 		struct nfs4_pnfs_layout_segment *range,
 		int take_ref)
 {
-	struct pnfs_layout_segment *lseg, *ret = NULL;
+	struct pnfs_layout_segment *ret = NULL;
+	u64 end = end_offset(range->offset, range->length);
 
 	dprintk("%s:Begin\n", __func__);
 
 	BUG_ON_UNLOCKED_LO(lo);
-	list_for_each_entry (lseg, &lo->segs, fi_list) {
-		if (!has_matching_lseg(lseg, range))
-			continue;
-		ret = lseg;
-		if (take_ref)
-			kref_get(&ret->kref);
-	}
+	if (range->iomode == IOMODE_READ)
+		ret = lseg_tree_find(lseg_tree(lo, IOMODE_READ),
+				     range->offset, end);
+	if (!ret)
+		ret = lseg_tree_find(lseg_tree(lo, IOMODE_RW),
+				     range->offset, end);
+	if (ret && take_ref)
+		kref_get(&ret->kref);
 
 	dprintk("%s:Return %p\n", __func__, ret);
 	return ret;
@@ -955,7 +1131,7 @@ pnfs_update_layout(struct inode *ino,
 
 	spin_unlock(&nfsi->lo_lock);
 
-	result = get_layout(ino, ctx, &arg, lsegpp, lo);
+	result = get_layout(ino, ctx, &arg, lsegpp, lo, 0);
 out:
 	dprintk("%s end (err:%d) state 0x%lx lseg %p\n",
 			__func__, result, nfsi->pnfs_layout_state, lseg);
@@ -967,6 +1143,75 @@ out_put:
 	goto out;
 }
 
+/*
+ * Ask for a layout for the given range without waiting for the reply,
+ * so that it is cached by the time I/O needs it.  Only one prefetch per
+ * inode is in flight at a time, and a failed one does not stop
+ * pnfs_update_layout() from trying again.
+ */
+static void
+pnfs_layout_prefetch(struct inode *ino,
+		     struct nfs_open_context *ctx,
+		     u64 pos,
+		     u64 count,
+		     enum pnfs_iomode iomode)
+{
+	struct nfs4_pnfs_layout_segment arg = {
+		.iomode = iomode,
+		.offset = pos,
+		.length = count
+	};
+	struct nfs_inode *nfsi = NFS_I(ino);
+	struct nfs_server *nfss = NFS_SERVER(ino);
+	struct pnfs_layout_type *lo;
+
+	if (!ctx || !ctx->state || !count)
+		return;
+
+	lo = get_lock_alloc_layout(ino, nfss->pnfs_curr_ld->ld_io_ops);
+	if (IS_ERR(lo))
+		return;
+	if ((nfsi->pnfs_layout_state &
+	     (NFS_INO_LAYOUT_FAILED | NFS_INO_LAYOUT_PREFETCH)) ||
+	    pnfs_has_layout(lo, &arg, 0)) {
+		put_unlock_current_layout(nfsi, lo);
+		return;
+	}
+	nfsi->pnfs_layout_state |= NFS_INO_LAYOUT_PREFETCH;
+	spin_unlock(&nfsi->lo_lock);
+
+	dprintk("%s: prefetching layout for %llu@%llu iomode %d\n",
+		__func__, arg.length, arg.offset, arg.iomode);
+
+	/* from here on, the release of the LAYOUTGET drops our references */
+	if (get_layout(ino, ctx, &arg, NULL, lo, 1) != 0) {
+		spin_lock(&nfsi->lo_lock);
+		nfsi->pnfs_layout_state &= ~NFS_INO_LAYOUT_PREFETCH;
+		put_unlock_current_layout(nfsi, lo);
+	}
+}
+
+/*
+ * Called once OPEN has returned: if the layout driver wants it, start
+ * fetching a layout for the whole file so the first I/O does not have
+ * to wait for a LAYOUTGET round trip.
+ */
+void
+pnfs_layoutget_on_open(struct nfs_open_context *ctx)
+{
+	struct inode *ino = ctx->path.dentry->d_inode;
+	struct nfs_server *nfss = NFS_SERVER(ino);
+
+	if (!S_ISREG(ino->i_mode) ||
+	    !PNFS_EXISTS_LDPOLICY_OP(nfss, layoutget_on_open) ||
+	    !nfss->pnfs_curr_ld->ld_policy_ops->layoutget_on_open(
+							nfss->pnfs_mountid))
+		return;
+
+	pnfs_layout_prefetch(ino, ctx, 0, NFS4_LENGTH_EOF,
+			     (ctx->mode & FMODE_WRITE) ? IOMODE_RW : IOMODE_READ);
+}
+
 void
 pnfs_get_layout_done(struct pnfs_layout_type *lo,
 		     struct nfs4_pnfs_layoutget *lgp,
@@ -1041,8 +1286,10 @@ pnfs_get_layout_done(struct pnfs_layout_type *lo,
 	lgp->status = 0;
 
 get_out:
-	/* remember that get layout failed and don't try again */
-	if (lgp->status < 0)
+	/* remember that get layout failed and don't try again, unless
+	 * this was only a prefetch
+	 */
+	if (lgp->status < 0 && !lgp->async)
 		nfsi->pnfs_layout_state |= NFS_INO_LAYOUT_FAILED;
 	spin_unlock(&nfsi->lo_lock);
 
@@ -1212,6 +1459,12 @@ pnfs_pageio_init_read(struct nfs_pageio_descriptor *pgio,
 		pgio->pg_boundary = pnfs_getboundary(inode);
 		if (pgio->pg_boundary)
 			pnfs_set_pg_test(inode, pgio);
+
+		/* readahead means sequential access: get the layout for
+		 * the next window before it is needed
+		 */
+		pnfs_layout_prefetch(inode, ctx, loff + count, count,
+				     IOMODE_READ);
 	}
 }
 
@@ -1230,6 +1483,37 @@ pnfs_pageio_init_write(struct nfs_pageio_descriptor *pgio, struct inode *inode)
 	pnfs_set_pg_test(inode, pgio);
 }
 
+/*
+ * Get a layout for a direct I/O of count bytes at pos.  Returns the
+ * data server I/O size and sets *boundary to the stripe size the I/O
+ * must be split on (0 if it may cross stripes), or returns 0 if the
+ * I/O should go to the MDS.
+ */
+size_t
+pnfs_direct_init_io(struct inode *inode, struct nfs_open_context *ctx,
+		    size_t count, loff_t pos, int iswrite, u32 *boundary)
+{
+	struct nfs_server *nfss = NFS_SERVER(inode);
+	int status;
+
+	*boundary = 0;
+	if (!pnfs_enabled_sb(nfss) || below_threshold(inode, count, iswrite))
+		return 0;
+	if (iswrite ? !PNFS_EXISTS_LDIO_OP(nfss, write_pagelist) :
+		      !PNFS_EXISTS_LDIO_OP(nfss, read_pagelist))
+		return 0;
+
+	status = pnfs_update_layout(inode, ctx, count, pos,
+				    iswrite ? IOMODE_RW : IOMODE_READ, NULL);
+	dprintk("%s: %Zu@%Lu iswrite %d layout status %d\n",
+		__func__, count, pos, iswrite, status);
+	if (status)
+		return 0;
+
+	*boundary = pnfs_getboundary(inode);
+	return iswrite ? nfss->ds_wsize : nfss->ds_rsize;
+}
+
 /*
  * Get a layoutout for COMMIT
  */
@@ -53,11 +53,16 @@ int _pnfs_try_to_commit(struct nfs_write_data *);
 void pnfs_pageio_init_read(struct nfs_pageio_descriptor *, struct inode *, struct nfs_open_context *, struct list_head *, size_t *);
 void pnfs_pageio_init_write(struct nfs_pageio_descriptor *, struct inode *);
 void pnfs_update_layout_commit(struct inode *, struct list_head *, pgoff_t, unsigned int);
+size_t pnfs_direct_init_io(struct inode *, struct nfs_open_context *, size_t,
+			   loff_t, int, u32 *);
 void pnfs_free_fsdata(struct pnfs_fsdata *fsdata);
 ssize_t pnfs_file_write(struct file *, const char __user *, size_t, loff_t *);
 void pnfs_get_layout_done(struct pnfs_layout_type *,
 			  struct nfs4_pnfs_layoutget *, int);
 void pnfs_layout_release(struct pnfs_layout_type *);
+void pnfs_layoutget_release(struct pnfs_layout_type *,
+			    struct nfs4_pnfs_layoutget *);
+void pnfs_layoutget_on_open(struct nfs_open_context *);
 int _pnfs_write_begin(struct inode *inode, struct page *page,
 		      loff_t pos, unsigned len, void **fsdata);
 int _pnfs_write_end(struct inode *inode, struct page *page,
@@ -201,6 +206,15 @@ static inline int pnfs_return_layout(struct inode *ino,
 
 #else  /* CONFIG_PNFS */
 
+static inline size_t pnfs_direct_init_io(struct inode *inode,
+					 struct nfs_open_context *ctx,
+					 size_t count, loff_t pos, int iswrite,
+					 u32 *boundary)
+{
+	*boundary = 0;
+	return 0;
+}
+
 static inline int pnfs_try_to_read_data(struct nfs_read_data *data,
 					const struct rpc_call_ops *call_ops)
 {
@@ -1271,6 +1271,26 @@ int nfs_initiate_commit(struct nfs_write_data *data,
 }
 EXPORT_SYMBOL(nfs_initiate_commit);
 
+/*
+ * Put back requests that could not be committed, so that a later
+ * commit picks them up again.
+ */
+void nfs_retry_commit(struct list_head *page_list)
+{
+	struct nfs_page *req;
+
+	while (!list_empty(page_list)) {
+		req = nfs_list_entry(page_list->next);
+		nfs_list_remove_request(req);
+		nfs_mark_request_commit(req);
+		dec_zone_page_state(req->wb_page, NR_UNSTABLE_NFS);
+		dec_bdi_stat(req->wb_page->mapping->backing_dev_info,
+				BDI_RECLAIMABLE);
+		nfs_clear_page_tag_locked(req);
+	}
+}
+EXPORT_SYMBOL(nfs_retry_commit);
+
 /*
  * Set up the argument/result storage required for the RPC call.
  */
@@ -1316,7 +1336,6 @@ static int
 nfs_commit_list(struct inode *inode, struct list_head *head, int how)
 {
 	struct nfs_write_data	*data;
-	struct nfs_page         *req;
 	int			status = -ENOMEM;
 
 	data = nfs_commit_alloc();
@@ -1329,15 +1348,7 @@ nfs_commit_list(struct inode *inode, struct list_head *head, int how)
 	if (!status)
 		return 0;
  out_bad:
-	while (!list_empty(head)) {
-		req = nfs_list_entry(head->next);
-		nfs_list_remove_request(req);
-		nfs_mark_request_commit(req);
-		dec_zone_page_state(req->wb_page, NR_UNSTABLE_NFS);
-		dec_bdi_stat(req->wb_page->mapping->backing_dev_info,
-				BDI_RECLAIMABLE);
-		nfs_clear_page_tag_locked(req);
-	}
+	nfs_retry_commit(head);
 	return status;
 }
 
@@ -463,6 +463,9 @@ static int check_export(struct inode *inode, int flags, unsigned char *uuid)
 		if (!inode->i_sb->s_export_op->get_device_iter)
 			inode->i_sb->s_export_op->get_device_iter =
 				spnfs_getdeviceiter;
+		if (!inode->i_sb->s_export_op->get_device_list)
+			inode->i_sb->s_export_op->get_device_list =
+				spnfs_getdevicelist;
 		if (!inode->i_sb->s_export_op->get_device_info)
 			inode->i_sb->s_export_op->get_device_info =
 				spnfs_getdeviceinfo;
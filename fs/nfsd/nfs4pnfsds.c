@@ -44,6 +44,11 @@
 #include <linux/nfsd/state.h>
 #include <linux/nfsd/pnfsd.h>
 #include <linux/exportfs.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/swap.h>
+#include <linux/vmalloc.h>
 
 /*
  *******************
@@ -53,35 +58,73 @@
 /*
  * Hash tables for pNFS Data Server state
  *
- * mds_nodeid:	list of struct pnfs_mds_id one per Metadata server (MDS) using
- *		this data server (DS).
+ * mds_id_hashtbl[]: hash of struct pnfs_mds_id, one per Metadata server
+ *			(MDS) using this data server (DS).
  *
- * mds_clid_hashtbl[]: uses clientid_hashval(), hash of all clientids obtained
+ * mds_clid_hashtbl: uses ds_clid_hashval(), hash of all clientids obtained
  *			from any MDS.
  *
- * ds_stid_hashtbl[]: uses stateid_hashval(), hash of all stateids obtained
+ * ds_stid_hashtbl: uses ds_stid_hashval(), hash of all stateids obtained
  *			from any MDS.
  *
+ * The clientid and stateid tables are allocated when the first stateid
+ * arrives and double whenever their chains average more than
+ * DS_HASH_LOAD entries, up to a limit set by the size of low memory.
+ *
+ * Everything here caches state that lives on the MDS, so it can be
+ * dropped at any time: stateids that have not been used for a lease
+ * period are reclaimed by the laundromat and fetched again through
+ * get_state should a client come back with them.  A clientid goes with
+ * its last stateid and an MDS id with its last clientid.
+ *
+ * All of it is protected by the nfs4 state lock.
  */
-/* Hash tables for clientid state */
-#define CLIENT_HASH_BITS                 4
-#define CLIENT_HASH_SIZE                (1 << CLIENT_HASH_BITS)
-#define CLIENT_HASH_MASK                (CLIENT_HASH_SIZE - 1)
-
-#define clientid_hashval(id) \
-	((id) & CLIENT_HASH_MASK)
-
-/* hash table for pnfs_ds_stateid */
-#define STATEID_HASH_BITS              10
-#define STATEID_HASH_SIZE              (1 << STATEID_HASH_BITS)
-#define STATEID_HASH_MASK              (STATEID_HASH_SIZE - 1)
+#define MDS_ID_HASH_BITS		4
+#define MDS_ID_HASH_SIZE		(1 << MDS_ID_HASH_BITS)
+
+#define DS_CLID_HASH_BITS_MIN		6
+#define DS_STID_HASH_BITS_MIN		10
+#define DS_HASH_LOAD			4
+
+struct ds_hashtbl {
+	struct list_head	*tbl;
+	unsigned int		bits;
+	unsigned int		max_bits;
+	unsigned int		count;
+};
+
+static struct list_head mds_id_hashtbl[MDS_ID_HASH_SIZE];
+static struct ds_hashtbl mds_clid_hashtbl;
+static struct ds_hashtbl ds_stid_hashtbl;
+static LIST_HEAD(ds_stid_lru);
+
+static struct {
+	unsigned int	lookups;
+	unsigned int	hits;
+	unsigned int	mds_fetches;
+	unsigned int	longest_chain;
+	unsigned int	resizes;
+	unsigned int	reclaimed;
+} ds_stats;
+
+static inline unsigned int
+mds_id_hashval(u32 mdsid)
+{
+	return hash_long(mdsid, MDS_ID_HASH_BITS);
+}
 
-#define stateid_hashval(owner_id, file_id)  \
-	(((owner_id) + (file_id)) & STATEID_HASH_MASK)
+static inline unsigned int
+ds_clid_hashval(clientid_t *clid, unsigned int bits)
+{
+	return jhash_2words(clid->cl_boot, clid->cl_id, 0) &
+		((1 << bits) - 1);
+}
 
-static struct list_head mds_id_tbl;
-static struct list_head mds_clid_hashtbl[CLIENT_HASH_SIZE];
-static struct list_head ds_stid_hashtbl[STATEID_HASH_SIZE];
+static inline unsigned int
+ds_stid_hashval(u32 owner_id, u32 file_id, unsigned int bits)
+{
+	return jhash_2words(owner_id, file_id, 0) & ((1 << bits) - 1);
+}
 
 static int
 cmp_clid(clientid_t *cl1, clientid_t *cl2)
@@ -90,18 +133,100 @@ cmp_clid(clientid_t *cl1, clientid_t *cl2)
 		(cl1->cl_id == cl2->cl_id));
 }
 
-void
-nfs4_pnfs_state_init(void)
+static struct list_head *
+ds_alloc_hashtbl(unsigned int bits)
 {
+	size_t size = sizeof(struct list_head) << bits;
+	struct list_head *tbl;
 	int i;
 
-	for (i = 0; i < CLIENT_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&mds_clid_hashtbl[i]);
+	if (size > PAGE_SIZE)
+		tbl = vmalloc(size);
+	else
+		tbl = kmalloc(size, GFP_KERNEL);
+	if (!tbl)
+		return NULL;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_LIST_HEAD(&tbl[i]);
+	return tbl;
+}
+
+static void
+ds_free_hashtbl(struct list_head *tbl, unsigned int bits)
+{
+	if ((sizeof(struct list_head) << bits) > PAGE_SIZE)
+		vfree(tbl);
+	else
+		kfree(tbl);
+}
+
+/*
+ * Make sure the table exists and, if it has become crowded, try to
+ * double it.  Failing to grow is harmless: the chains just get longer.
+ */
+static int
+ds_hashtbl_reserve(struct ds_hashtbl *ht, unsigned int min_bits,
+		   unsigned int (*hashval)(struct list_head *, unsigned int))
+{
+	struct list_head *tbl, *pos, *next;
+	unsigned int bits;
+	int i;
+
+	if (!ht->tbl) {
+		ht->max_bits = max_t(unsigned int, min_bits,
+				     ilog2(nr_free_buffer_pages()));
+		ht->tbl = ds_alloc_hashtbl(min_bits);
+		if (!ht->tbl)
+			return -ENOMEM;
+		ht->bits = min_bits;
+		return 0;
+	}
+
+	if (ht->count < (DS_HASH_LOAD << ht->bits) || ht->bits >= ht->max_bits)
+		return 0;
+
+	bits = ht->bits + 1;
+	tbl = ds_alloc_hashtbl(bits);
+	if (!tbl)
+		return 0;
+	for (i = 0; i < (1 << ht->bits); i++)
+		list_for_each_safe(pos, next, &ht->tbl[i])
+			list_move(pos, &tbl[hashval(pos, bits)]);
+	ds_free_hashtbl(ht->tbl, ht->bits);
+	ht->tbl = tbl;
+	ht->bits = bits;
+	ds_stats.resizes++;
+	dprintk("pNFSD: %s: %u entries, %u buckets\n", __func__,
+		ht->count, 1 << bits);
+	return 0;
+}
+
+static unsigned int
+ds_clid_rehash(struct list_head *pos, unsigned int bits)
+{
+	struct pnfs_ds_clientid *dcp;
+
+	dcp = list_entry(pos, struct pnfs_ds_clientid, dc_hash);
+	return ds_clid_hashval(&dcp->dc_mdsclid, bits);
+}
+
+static unsigned int
+ds_stid_rehash(struct list_head *pos, unsigned int bits)
+{
+	struct pnfs_ds_stateid *dsp;
+
+	dsp = list_entry(pos, struct pnfs_ds_stateid, ds_hash);
+	return ds_stid_hashval(dsp->ds_stid.si_stateownerid,
+			       dsp->ds_stid.si_fileid, bits);
+}
 
-	for (i = 0; i < STATEID_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&ds_stid_hashtbl[i]);
+void
+nfs4_pnfs_state_init(void)
+{
+	int i;
 
-	INIT_LIST_HEAD(&mds_id_tbl);
+	for (i = 0; i < MDS_ID_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&mds_id_hashtbl[i]);
 }
 
 static struct pnfs_mds_id *
@@ -110,7 +235,8 @@ find_pnfs_mds_id(u32 mdsid)
 	struct pnfs_mds_id *local = NULL;
 
 	dprintk("pNFSD: %s\n", __func__);
-	list_for_each_entry(local, &mds_id_tbl, di_hash) {
+	list_for_each_entry(local, &mds_id_hashtbl[mds_id_hashval(mdsid)],
+			    di_hash) {
 		if (local->di_mdsid == mdsid)
 			return local;
 	}
@@ -125,8 +251,10 @@ find_pnfs_ds_clientid(clientid_t *clid)
 
 	dprintk("pNFSD: %s\n", __func__);
 
-	hashval = clientid_hashval(clid->cl_id);
-	list_for_each_entry(local, &mds_clid_hashtbl[hashval], dc_hash) {
+	if (!mds_clid_hashtbl.tbl)
+		return NULL;
+	hashval = ds_clid_hashval(clid, mds_clid_hashtbl.bits);
+	list_for_each_entry(local, &mds_clid_hashtbl.tbl[hashval], dc_hash) {
 		if (cmp_clid(&local->dc_mdsclid, clid))
 			return local;
 	}
@@ -139,54 +267,139 @@ find_pnfs_ds_stateid(stateid_t *stid)
 	struct pnfs_ds_stateid *local = NULL;
 	u32 st_id = stid->si_stateownerid;
 	u32 f_id = stid->si_fileid;
-	unsigned int hashval;
+	unsigned int hashval, chain = 0;
 
 	dprintk("pNFSD: %s\n", __func__);
 
-	hashval = stateid_hashval(st_id, f_id);
-	list_for_each_entry(local, &ds_stid_hashtbl[hashval], ds_hash) {
+	ds_stats.lookups++;
+	if (!ds_stid_hashtbl.tbl)
+		return NULL;
+	hashval = ds_stid_hashval(st_id, f_id, ds_stid_hashtbl.bits);
+	list_for_each_entry(local, &ds_stid_hashtbl.tbl[hashval], ds_hash) {
+		chain++;
 		if ((local->ds_stid.si_stateownerid == st_id) &&
 				(local->ds_stid.si_fileid == f_id) &&
-				(local->ds_stid.si_boot == stid->si_boot))
-			return local;
+				(local->ds_stid.si_boot == stid->si_boot)) {
+			ds_stats.hits++;
+			goto out;
+		}
 	}
-	return NULL;
+	local = NULL;
+out:
+	if (chain > ds_stats.longest_chain)
+		ds_stats.longest_chain = chain;
+	return local;
 }
 
-#if 0
-FIXME: keep following functions?
-
 static void
 release_mds_id(struct pnfs_mds_id *mdp)
 {
 	dprintk("pNFSD: %s\n", __func__);
 
 	list_del(&mdp->di_hash);
-	list_del(&mdp->di_mdsclid);
 	kfree(mdp);
 }
 
 static void
 release_ds_clientid(struct pnfs_ds_clientid *dcp)
 {
+	struct pnfs_mds_id *mdp = dcp->dc_mds;
+
 	dprintk("pNFSD: %s\n", __func__);
 
 	list_del(&dcp->dc_hash);
-	list_del(&dcp->dc_stateid);
 	list_del(&dcp->dc_permdsid);
+	mds_clid_hashtbl.count--;
 	kfree(dcp);
+	if (list_empty(&mdp->di_mdsclid))
+		release_mds_id(mdp);
 }
 
 static void
 release_ds_stateid(struct pnfs_ds_stateid *dsp)
 {
+	struct pnfs_ds_clientid *dcp = dsp->ds_client;
+
 	dprintk("pNFSD: %s\n", __func__);
 
 	list_del(&dsp->ds_hash);
 	list_del(&dsp->ds_perclid);
+	list_del(&dsp->ds_lru);
+	ds_stid_hashtbl.count--;
 	kfree(dsp);
+	if (list_empty(&dcp->dc_stateid))
+		release_ds_clientid(dcp);
+}
+
+/*
+ * Called from the laundromat: drop the stateids no client has used
+ * since the cutoff.  The caller holds the state lock.
+ */
+void
+nfs4_pnfs_ds_laundromat(time_t cutoff)
+{
+	struct pnfs_ds_stateid *dsp;
+
+	while (!list_empty(&ds_stid_lru)) {
+		dsp = list_entry(ds_stid_lru.next, struct pnfs_ds_stateid,
+				 ds_lru);
+		if (time_after((unsigned long)dsp->ds_time,
+			       (unsigned long)cutoff))
+			break;
+		dprintk("pNFSD: reclaiming unused DS stateid %08x/%08x\n",
+			dsp->ds_stid.si_stateownerid, dsp->ds_stid.si_fileid);
+		release_ds_stateid(dsp);
+		ds_stats.reclaimed++;
+	}
+}
+
+/*
+ * Drop all data server state when the server shuts down.  The caller
+ * holds the state lock.
+ */
+void
+nfs4_pnfs_state_shutdown(void)
+{
+	while (!list_empty(&ds_stid_lru))
+		release_ds_stateid(list_entry(ds_stid_lru.next,
+					      struct pnfs_ds_stateid, ds_lru));
+	if (ds_stid_hashtbl.tbl)
+		ds_free_hashtbl(ds_stid_hashtbl.tbl, ds_stid_hashtbl.bits);
+	if (mds_clid_hashtbl.tbl)
+		ds_free_hashtbl(mds_clid_hashtbl.tbl, mds_clid_hashtbl.bits);
+	memset(&ds_stid_hashtbl, 0, sizeof(ds_stid_hashtbl));
+	memset(&mds_clid_hashtbl, 0, sizeof(mds_clid_hashtbl));
+}
+
+/*
+ * Report the state of the tables for the pnfs_ds_stats file.
+ */
+int
+nfs4_pnfs_ds_stats(char *buf)
+{
+	int len;
+
+	nfs4_lock_state();
+	len = sprintf(buf, "stateids:              %u\n"
+			   "stateid buckets:       %u\n"
+			   "clientids:             %u\n"
+			   "clientid buckets:      %u\n"
+			   "lookups:               %u\n"
+			   "hits:                  %u\n"
+			   "mds fetches:           %u\n"
+			   "longest chain:         %u\n"
+			   "resizes:               %u\n"
+			   "reclaimed:             %u\n",
+		      ds_stid_hashtbl.count,
+		      ds_stid_hashtbl.tbl ? 1U << ds_stid_hashtbl.bits : 0,
+		      mds_clid_hashtbl.count,
+		      mds_clid_hashtbl.tbl ? 1U << mds_clid_hashtbl.bits : 0,
+		      ds_stats.lookups, ds_stats.hits, ds_stats.mds_fetches,
+		      ds_stats.longest_chain, ds_stats.resizes,
+		      ds_stats.reclaimed);
+	nfs4_unlock_state();
+	return len;
 }
-#endif
 
 static struct pnfs_mds_id *
 alloc_init_mds_id(struct pnfs_get_state *gsp)
@@ -200,7 +413,7 @@ alloc_init_mds_id(struct pnfs_get_state *gsp)
 		return NULL;
 	INIT_LIST_HEAD(&mdp->di_hash);
 	INIT_LIST_HEAD(&mdp->di_mdsclid);
-	list_add(&mdp->di_hash, &mds_id_tbl);
+	list_add(&mdp->di_hash, &mds_id_hashtbl[mds_id_hashval(gsp->dsid)]);
 	mdp->di_mdsid = gsp->dsid;
 	mdp->di_mdsboot = 0;
 	return mdp;
@@ -211,24 +424,33 @@ alloc_init_ds_clientid(struct pnfs_get_state *gsp)
 {
 	struct pnfs_mds_id *mdp;
 	struct pnfs_ds_clientid *dcp;
-	unsigned int hashval = clientid_hashval(gsp->clid.cl_id);
+	unsigned int hashval;
 
 	dprintk("pNFSD: %s\n", __func__);
 
+	if (ds_hashtbl_reserve(&mds_clid_hashtbl, DS_CLID_HASH_BITS_MIN,
+			       ds_clid_rehash))
+		return NULL;
 	mdp = find_pnfs_mds_id(gsp->dsid);
 	if (!mdp)
 		mdp = alloc_init_mds_id(gsp);
 	if (!mdp)
 		return NULL;
 	dcp = kmalloc(sizeof(*dcp), GFP_KERNEL);
-	if (!dcp)
+	if (!dcp) {
+		if (list_empty(&mdp->di_mdsclid))
+			release_mds_id(mdp);
 		return NULL;
+	}
 
 	INIT_LIST_HEAD(&dcp->dc_hash);
 	INIT_LIST_HEAD(&dcp->dc_stateid);
 	INIT_LIST_HEAD(&dcp->dc_permdsid);
-	list_add(&dcp->dc_hash, &mds_clid_hashtbl[hashval]);
+	hashval = ds_clid_hashval(&gsp->clid, mds_clid_hashtbl.bits);
+	list_add(&dcp->dc_hash, &mds_clid_hashtbl.tbl[hashval]);
 	list_add(&dcp->dc_permdsid, &mdp->di_mdsclid);
+	mds_clid_hashtbl.count++;
+	dcp->dc_mds = mdp;
 	dcp->dc_mdsclid = gsp->clid;
 	return dcp;
 }
@@ -244,6 +466,9 @@ alloc_init_ds_stateid(struct svc_fh *cfh, struct pnfs_get_state *gsp)
 
 	dprintk("pNFSD: %s\n", __func__);
 
+	if (ds_hashtbl_reserve(&ds_stid_hashtbl, DS_STID_HASH_BITS_MIN,
+			       ds_stid_rehash))
+		return NULL;
 	dcp = find_pnfs_ds_clientid(&gsp->clid);
 	if (!dcp)
 		dcp = alloc_init_ds_clientid(gsp);
@@ -251,8 +476,11 @@ alloc_init_ds_stateid(struct svc_fh *cfh, struct pnfs_get_state *gsp)
 		return NULL;
 
 	dsp = kmalloc(sizeof(*dsp), GFP_KERNEL);
-	if (!dsp)
+	if (!dsp) {
+		if (list_empty(&dcp->dc_stateid))
+			release_ds_clientid(dcp);
 		return dsp;
+	}
 
 	INIT_LIST_HEAD(&dsp->ds_hash);
 	INIT_LIST_HEAD(&dsp->ds_perclid);
@@ -264,11 +492,15 @@ alloc_init_ds_stateid(struct svc_fh *cfh, struct pnfs_get_state *gsp)
 	dsp->ds_status = 0;
 	dsp->ds_verifier[0] = gsp->verifier[0];
 	dsp->ds_verifier[1] = gsp->verifier[1];
+	dsp->ds_client = dcp;
+	dsp->ds_time = get_seconds();
 
 	list_add(&dsp->ds_perclid, &dcp->dc_stateid);
+	list_add_tail(&dsp->ds_lru, &ds_stid_lru);
 
-	hashval = stateid_hashval(st_id, f_id);
-	list_add(&dsp->ds_hash, &ds_stid_hashtbl[hashval]);
+	hashval = ds_stid_hashval(st_id, f_id, ds_stid_hashtbl.bits);
+	list_add(&dsp->ds_hash, &ds_stid_hashtbl.tbl[hashval]);
+	ds_stid_hashtbl.count++;
 	return dsp;
 }
 
@@ -301,6 +533,8 @@ nfsv4_ds_get_state(struct svc_fh *cfh, stateid_t *stidp)
 
 	dsp = find_pnfs_ds_stateid(stidp);
 	if (dsp) {
+		dsp->ds_time = get_seconds();
+		list_move_tail(&dsp->ds_lru, &ds_stid_lru);
 		if (stidp->si_generation == dsp->ds_stid.si_generation)
 			return dsp;
 	}
@@ -308,6 +542,7 @@ nfsv4_ds_get_state(struct svc_fh *cfh, stateid_t *stidp)
 	memcpy(&gs.stid, stidp, sizeof(stateid_t));
 	sb = ino->i_sb;
 	if (sb && sb->s_export_op->get_state) {
+		ds_stats.mds_fetches++;
 		nfs4_unlock_state();
 		status = sb->s_export_op->get_state(ino, &cfh->fh_handle, &gs);
 		dprintk("pNFSD: %s from MDS status %d\n", __func__, status);
@@ -315,6 +550,8 @@ nfsv4_ds_get_state(struct svc_fh *cfh, stateid_t *stidp)
 	}
 	if (status)
 		return NULL;
+	/* the table may have changed while we were unlocked */
+	dsp = find_pnfs_ds_stateid(stidp);
 	if (dsp)
 		update_ds_stateid(dsp, cfh, &gs);
 	else
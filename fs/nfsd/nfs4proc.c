@@ -660,7 +660,6 @@ nfsd4_read(struct svc_rqst *rqstp, struct nfsd4_compound_state *cstate,
 	flags = CHECK_FH | RD_STATE;
 	if (read->rd_minorversion == 1)
 		flags |= NFS_4_1;
-	nfs4_lock_state();
 	/* check stateid */
 	if ((status = nfs4_preprocess_stateid_op(&cstate->current_fh,
 				&read->rd_stateid,
@@ -668,11 +667,8 @@ nfsd4_read(struct svc_rqst *rqstp, struct nfsd4_compound_state *cstate,
 		dprintk("NFSD: nfsd4_read: couldn't process stateid!\n");
 		goto out;
 	}
-	if (read->rd_filp)
-		get_file(read->rd_filp);
 	status = nfs_ok;
 out:
-	nfs4_unlock_state();
 	read->rd_rqstp = rqstp;
 	read->rd_fhp = &cstate->current_fh;
 	return status;
@@ -800,10 +796,8 @@ nfsd4_setattr(struct svc_rqst *rqstp, struct nfsd4_compound_state *cstate,
 		flags = CHECK_FH | WR_STATE;
 		if (setattr->sa_minorversion == 1)
 			flags |= NFS_4_1;
-		nfs4_lock_state();
 		status = nfs4_preprocess_stateid_op(&cstate->current_fh,
 			&setattr->sa_stateid, flags, NULL);
-		nfs4_unlock_state();
 		if (status) {
 			dprintk("NFSD: nfsd4_setattr: couldn't process stateid!\n");
 			return status;
@@ -841,12 +835,8 @@ nfsd4_write(struct svc_rqst *rqstp, struct nfsd4_compound_state *cstate,
 	flags = CHECK_FH | WR_STATE;
 	if (write->wr_minorversion == 1)
 		flags |= NFS_4_1;
-	nfs4_lock_state();
 	status = nfs4_preprocess_stateid_op(&cstate->current_fh, stateid,
 					flags, &filp);
-	if (filp)
-		get_file(filp);
-	nfs4_unlock_state();
 
 	if (status) {
 		dprintk("NFSD: nfsd4_write: couldn't process stateid!\n");
@@ -860,12 +850,18 @@ nfsd4_write(struct svc_rqst *rqstp, struct nfsd4_compound_state *cstate,
 #if defined(CONFIG_SPNFS)
 	sb = current_fh->fh_dentry->d_inode->i_sb;
 	if (sb->s_export_op->get_verifier) {
-		struct pnfs_ds_stateid *dsp = find_pnfs_ds_stateid(stateid);
+		struct pnfs_ds_stateid *dsp;
+
+		/* DS stateids can be reclaimed, so look under the lock */
+		nfs4_lock_state();
+		dsp = find_pnfs_ds_stateid(stateid);
 		if (dsp) {
 			/* get it from MDS */
 			*p++ = dsp->ds_verifier[0];
 			*p++ = dsp->ds_verifier[1];
-		} else {
+		}
+		nfs4_unlock_state();
+		if (!dsp) {
 			/* must be on MDS */
 			sb->s_export_op->get_verifier(sb, p);
 			p += 2;
@@ -878,7 +874,7 @@ nfsd4_write(struct svc_rqst *rqstp, struct nfsd4_compound_state *cstate,
 	}
 #if defined(CONFIG_SPNFS)
 	if (spnfs_enabled()) {
-		status = spnfs_write(current_fh->fh_dentry->d_inode->i_ino,
+		status = spnfs_write(current_fh->fh_dentry->d_inode,
 			write->wr_offset, write->wr_buflen, write->wr_vlen,
 			rqstp);
 		if (status < 0)
@@ -1057,7 +1053,8 @@ nfsd4_getdevlist(struct svc_rqst *rqstp,
 
 	/* Do nothing if underlying file system does not support
 	 * getdevicelist */
-	if (!sb->s_export_op->get_device_iter) {
+	if (!sb->s_export_op->get_device_iter &&
+	    !sb->s_export_op->get_device_list) {
 		status = nfserr_notsupp;
 		goto out;
 	}
@@ -1482,6 +1479,15 @@ nfsd4_proc_compound(struct svc_rqst *rqstp,
 		else
 			BUG_ON(op->status == nfs_ok);
 
+#if defined(CONFIG_NFSD_V4_1)
+		/* SEQUENCE found a retransmission: send the cached reply */
+		if (op->status == nfserr_replay_cache) {
+			status = nfsd4_replay_cache_entry(resp,
+						current_ses->cs_slot);
+			goto out;
+		}
+#endif /* CONFIG_NFSD_V4_1 */
+
 encode_op:
 		if (op->status == nfserr_replay_me) {
 			op->replay = &cstate->replay_owner->so_replay;
@@ -1512,12 +1518,25 @@ out:
 	if (current_ses) {
 		struct nfs41_slot *cs_slot = current_ses->cs_slot;
 		if (cs_slot) {
-			if (op && op->status != nfserr_dropit) {
-				dprintk("%s: SET SLOT STATE TO AVAILABLE\n",
-					__func__);
-				nfs41_set_slot_state(cs_slot,
-						     NFS4_SLOT_AVAILABLE);
+			/*
+			 * A request dropped for an upcall gets no reply;
+			 * its seqid is run again by whatever comes first,
+			 * the revisit or a retransmission, so that the
+			 * slot is not held by a deferral that may never
+			 * come back.
+			 */
+			if (op && op->status == nfserr_dropit) {
+				cs_slot->sl_deferred = 1;
+				cs_slot->sl_datalen = 0;
+			} else {
+				cs_slot->sl_deferred = 0;
+				if (op && op->status != nfserr_replay_cache)
+					nfsd4_store_cache_entry(resp, cs_slot,
+								status);
 			}
+			dprintk("%s: SET SLOT STATE TO AVAILABLE\n",
+				__func__);
+			nfs41_set_slot_state(cs_slot, NFS4_SLOT_AVAILABLE);
 			nfs41_put_session(cs_slot->sl_session);
 		}
 		kfree(current_ses);
@@ -44,6 +44,7 @@
 #include <linux/nfsd/nfsd.h>
 #include <linux/nfsd/cache.h>
 #include <linux/mount.h>
+#include <linux/file.h>
 #include <linux/workqueue.h>
 #include <linux/smp_lock.h>
 #include <linux/kthread.h>
@@ -53,12 +54,12 @@
 #include <linux/namei.h>
 #include <linux/swap.h>
 #include <linux/mutex.h>
-#include <linux/crc32.h>
 #include <linux/lockd/bind.h>
 #include <linux/module.h>
 #if defined(CONFIG_PNFSD)
 #include <linux/exportfs.h>
 #include <linux/nfsd/pnfsd.h>
+#include <linux/nfsd4_spnfs.h>
 #endif /* CONFIG_PNFSD */
 
 #define NFSDDBG_FACILITY                NFSDDBG_PROC
@@ -112,8 +113,35 @@ static void release_pnfs_ds_dev_list(struct nfs4_stateid *stp);
  * client_mutex:
  * 	protects clientid_hashtbl[], clientstr_hashtbl[],
  * 	unconfstr_hashtbl[], uncofid_hashtbl[].
+ *
+ * client_lru_lock:
+ * 	protects client_lru and nfs4_client.cl_time, so that leases can
+ * 	be renewed without client_mutex.
+ *
+ * sessionid_lock:
+ * 	serializes changes to sessionid_hashtbl[]; lookups use RCU.
+ *
+ * nfs4_client.cl_lock:
+ * 	protects the client's cl_sessions list and, for each of them,
+ * 	the reply cache memory of the slots.  A slot itself belongs to
+ * 	whoever moved its sl_state away from NFS4_SLOT_AVAILABLE.
+ *
+ * nfs4_file.fi_lock:
+ * 	taken with client_mutex to change the file's fi_stateids and
+ * 	fi_delegations lists; either lock is enough to walk them.
+ *
+ * SEQUENCE takes none of these on its fast path (see nfsd4_sequence).
+ * Where they nest, client_mutex comes first and client_lru_lock before
+ * cl_lock.
+ *
+ * READ, WRITE and SETATTR check their stateid without client_mutex
+ * (see nfs4_preprocess_stateid_op): file_hashtbl[], stateid_hashtbl[]
+ * and lockstateid_hashtbl[] are changed under client_mutex but may be
+ * searched under rcu_read_lock, so files, stateids, stateowners and
+ * clients are only freed after a grace period.
  */
 static DEFINE_MUTEX(client_mutex);
+static DEFINE_SPINLOCK(client_lru_lock);
 static struct thread_info *client_mutex_owner;
 
 static struct kmem_cache *stateowner_slab = NULL;
@@ -173,13 +201,19 @@ static void release_stateid(struct nfs4_stateid *stp, int flags);
 static DEFINE_SPINLOCK(recall_lock);
 static struct list_head del_recall_lru;
 
+static void
+free_nfs4_file_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(file_slab, container_of(head, struct nfs4_file, fi_rcu));
+}
+
 static void
 free_nfs4_file(struct kref *kref)
 {
 	struct nfs4_file *fp = container_of(kref, struct nfs4_file, fi_ref);
-	list_del(&fp->fi_hash);
+	list_del_rcu(&fp->fi_hash);
 	iput(fp->fi_inode);
-	kmem_cache_free(file_slab, fp);
+	call_rcu(&fp->fi_rcu, free_nfs4_file_rcu);
 }
 
 static inline void
@@ -198,6 +232,12 @@ get_nfs4_file(struct nfs4_file *fi)
 static int num_delegations;
 unsigned int max_delegations;
 
+#if defined(CONFIG_NFSD_V4_1)
+/* slot reply cache memory of all sessions */
+static atomic_long_t nfsd_slot_cache_total;
+static unsigned long nfsd_slot_cache_max;
+#endif /* CONFIG_NFSD_V4_1 */
+
 /*
  * Open owner state (share locks)
  */
@@ -270,7 +310,9 @@ alloc_init_deleg(struct nfs4_client *clp, struct nfs4_stateid *stp, struct svc_f
 		        current_fh->fh_handle.fh_size);
 	dp->dl_time = 0;
 	atomic_set(&dp->dl_count, 1);
+	spin_lock(&fp->fi_lock);
 	list_add(&dp->dl_perfile, &fp->fi_delegations);
+	spin_unlock(&fp->fi_lock);
 	list_add(&dp->dl_perclnt, &clp->cl_delegations);
 	return dp;
 }
@@ -312,7 +354,9 @@ nfs4_close_delegation(struct nfs4_delegation *dp)
 static void
 unhash_delegation(struct nfs4_delegation *dp)
 {
+	spin_lock(&dp->dl_file->fi_lock);
 	list_del_init(&dp->dl_perfile);
+	spin_unlock(&dp->dl_file->fi_lock);
 	list_del_init(&dp->dl_perclnt);
 	spin_lock(&recall_lock);
 	list_del_init(&dp->dl_recall_lru);
@@ -363,6 +407,7 @@ static struct list_head close_lru;
 /* Use a prime for hash table size */
 #define SESSION_HASH_SIZE	1031
 static struct list_head sessionid_hashtbl[SESSION_HASH_SIZE];
+static DEFINE_SPINLOCK(sessionid_lock);
 
 int
 nfs41_get_slot_state(struct nfs41_slot *slot)
@@ -373,18 +418,24 @@ nfs41_get_slot_state(struct nfs41_slot *slot)
 void
 nfs41_set_slot_state(struct nfs41_slot *slot, int state)
 {
+	/* make the reply cache update visible before the slot is free */
+	smp_mb();
 	atomic_set(&slot->sl_state, state);
 }
 
+/*
+ * Session ids are made by gen_sessionid: the clientid followed by the
+ * boot time and a counter.  The clientid and counter words are all it
+ * takes to spread them, no need to checksum the whole id.
+ */
 static int
 hash_sessionid(nfs41_sessionid *sessionid)
 {
-	u32 csum = 0;
+	u32 *p = (u32 *)(*sessionid);
 	int idx;
 
-	csum = crc32(0, sessionid, sizeof(*sessionid));
-	idx = csum % SESSION_HASH_SIZE;
-	dprintk("%s IDX: %u csum %u\n", __func__, idx, csum);
+	idx = (p[1] ^ p[3]) % SESSION_HASH_SIZE;
+	dprintk("%s IDX: %u\n", __func__, idx);
 	return idx;
 }
 
@@ -414,14 +465,29 @@ alloc_init_session(struct nfs4_client *clp, struct nfsd4_create_session *cses)
 {
 	struct nfs41_session *new;
 	int idx, status = nfserr_resource, slotsize, i;
+	u32 numslots, cached;
 
 	new = kzalloc(sizeof(*new), GFP_KERNEL);
 	if (!new)
 		goto out;
 
-	if (cses->fore_channel.maxreqs >= NFS41_MAX_SLOTS)
-		cses->fore_channel.maxreqs = NFS41_MAX_SLOTS;
-	new->se_fnumslots = cses->fore_channel.maxreqs;
+	/*
+	 * Every slot may keep up to maxresp_cached bytes of reply.  That
+	 * memory is only allocated once the client uses the slot, and only
+	 * while the client and the server stay within their budgets (see
+	 * nfsd4_slot_cache_alloc), so grant all the slots asked for and let
+	 * target_highest_slotid steer how many are actually used.
+	 */
+	cached = min_t(u32, cses->fore_channel.maxresp_cached,
+		       NFSD_SLOT_CACHE_SIZE);
+	numslots = min_t(u32, cses->fore_channel.maxreqs, NFS41_MAX_SLOTS);
+	if (numslots == 0)
+		numslots = 1;
+	cses->fore_channel.maxreqs = numslots;
+	cses->fore_channel.maxresp_cached = cached;
+	new->se_fnumslots = numslots;
+	new->se_fmaxresp_cached = cached;
+	new->se_target_slots = min_t(u32, numslots, NFSD_INITIAL_TARGET_SLOTS);
 	slotsize = new->se_fnumslots * sizeof(struct nfs41_slot);
 
 	new->se_slots = kzalloc(slotsize, GFP_KERNEL);
@@ -444,14 +510,19 @@ alloc_init_session(struct nfs4_client *clp, struct nfsd4_create_session *cses)
 	new->se_fheaderpad_sz = cses->fore_channel.headerpadsz;
 	new->se_fmaxreq_sz = cses->fore_channel.maxreq_sz;
 	new->se_fmaxresp_sz = cses->fore_channel.maxresp_sz;
-	new->se_fmaxresp_cached = cses->fore_channel.maxresp_cached;
 	new->se_fmaxops = cses->fore_channel.maxops;
 
 	kref_init(&new->se_ref);
 	INIT_LIST_HEAD(&new->se_hash);
 	INIT_LIST_HEAD(&new->se_perclnt);
-	list_add(&new->se_hash, &sessionid_hashtbl[idx]);
+	/* SEQUENCE may use the session after the client is expired */
+	atomic_inc(&clp->cl_count);
+	spin_lock(&clp->cl_lock);
 	list_add(&new->se_perclnt, &clp->cl_sessions);
+	spin_unlock(&clp->cl_lock);
+	spin_lock(&sessionid_lock);
+	list_add_rcu(&new->se_hash, &sessionid_hashtbl[idx]);
+	spin_unlock(&sessionid_lock);
 
 	status = nfs_ok;
 out:
@@ -461,6 +532,12 @@ out_free:
 	goto out;
 }
 
+/*
+ * Look up a session by id.  The session is returned with a reference
+ * the caller must drop with nfs41_put_session.  The hash chains are
+ * walked under RCU only; a session whose last reference is gone is
+ * on its way out and is skipped.
+ */
 struct nfs41_session *
 find_in_sessionid_hashtbl(nfs41_sessionid *sessionid)
 {
@@ -471,14 +548,18 @@ find_in_sessionid_hashtbl(nfs41_sessionid *sessionid)
 	idx = hash_sessionid(sessionid);
 	dprintk("%s: idx is %d\n", __func__, idx);
 	/* Search in the appropriate list */
-	list_for_each_entry(elem, &sessionid_hashtbl[idx], se_hash) {
+	rcu_read_lock();
+	list_for_each_entry_rcu(elem, &sessionid_hashtbl[idx], se_hash) {
 		dump_sessionid("list traversal", &elem->se_sessionid);
 		if (!memcmp(elem->se_sessionid, sessionid,
-			    sizeof(nfs41_sessionid))) {
+			    sizeof(nfs41_sessionid)) &&
+		    atomic_inc_not_zero(&elem->se_ref.refcount)) {
 			dprintk("%s: found session %p\n", __func__, elem);
+			rcu_read_unlock();
 			return elem;
 		}
 	}
+	rcu_read_unlock();
 
 	dprintk("%s: session not found\n", __func__);
 	return NULL;
@@ -487,19 +568,57 @@ find_in_sessionid_hashtbl(nfs41_sessionid *sessionid)
 static void
 destroy_session(struct nfs41_session *ses)
 {
-	list_del(&ses->se_hash);
+	struct nfs4_client *clp = ses->se_client;
+	int i;
+
+	spin_lock(&sessionid_lock);
+	list_del_rcu(&ses->se_hash);
+	spin_unlock(&sessionid_lock);
+
+	spin_lock(&clp->cl_lock);
 	list_del(&ses->se_perclnt);
+	/*
+	 * A compound still running on the session may store its reply, so
+	 * only give back the budget here; free_session frees the memory.
+	 * Marking the table empty keeps SEQUENCE from adding to it.
+	 */
+	for (i = 0; i < ses->se_fnumslots; i++) {
+		if (!ses->se_slots[i].sl_data)
+			continue;
+		clp->cl_slot_cache -= ses->se_fmaxresp_cached;
+		atomic_long_sub(ses->se_fmaxresp_cached,
+				&nfsd_slot_cache_total);
+	}
+	ses->se_fmaxresp_cached = 0;
+	spin_unlock(&clp->cl_lock);
 	nfs41_put_session(ses);
 }
 
+static void
+free_session_rcu(struct rcu_head *head)
+{
+	struct nfs41_session *ses;
+	int i;
+
+	ses = container_of(head, struct nfs41_session, se_rcu);
+	for (i = 0; i < ses->se_fnumslots; i++)
+		kfree(ses->se_slots[i].sl_data);
+	kfree(ses->se_slots);
+	kfree(ses);
+}
+
+/*
+ * The client may go at once, but find_in_sessionid_hashtbl may still
+ * be looking at the session itself until an RCU grace period is over.
+ */
 void
 free_session(struct kref *kref)
 {
 	struct nfs41_session *ses;
 
 	ses = container_of(kref, struct nfs41_session, se_ref);
-	kfree(ses->se_slots);
-	kfree(ses);
+	put_nfs4_client(ses->se_client);
+	call_rcu(&ses->se_rcu, free_session_rcu);
 }
 #endif /* CONFIG_NFSD_V4_1 */
 
@@ -512,8 +631,16 @@ renew_client(struct nfs4_client *clp)
 	dprintk("renewing client (clientid %08x/%08x)\n", 
 			clp->cl_clientid.cl_boot, 
 			clp->cl_clientid.cl_id);
-	list_move_tail(&clp->cl_lru, &client_lru);
-	clp->cl_time = get_seconds();
+	/* already renewed this second, the lease can't have moved */
+	if (clp->cl_time == get_seconds())
+		return;
+	spin_lock(&client_lru_lock);
+	/* not if the laundromat already took it off to expire it */
+	if (!list_empty(&clp->cl_lru)) {
+		list_move_tail(&clp->cl_lru, &client_lru);
+		clp->cl_time = get_seconds();
+	}
+	spin_unlock(&client_lru_lock);
 }
 
 /* SETCLIENTID and SETCLIENTID_CONFIRM Helper functions */
@@ -565,6 +692,12 @@ shutdown_callback_client(struct nfs4_client *clp)
 	}
 }
 
+static void
+free_client_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nfs4_client, cl_rcu));
+}
+
 static inline void
 free_client(struct nfs4_client *clp)
 {
@@ -579,7 +712,8 @@ free_client(struct nfs4_client *clp)
 	if (clp->cl_cred.cr_group_info)
 		put_group_info(clp->cl_cred.cr_group_info);
 	kfree(clp->cl_name.data);
-	kfree(clp);
+	/* a stateid check may still be renewing the lease */
+	call_rcu(&clp->cl_rcu, free_client_rcu);
 }
 
 void
@@ -625,7 +759,9 @@ expire_client(struct nfs4_client *clp)
 	}
 	list_del_init(&clp->cl_idhash);
 	list_del_init(&clp->cl_strhash);
+	spin_lock(&client_lru_lock);
 	list_del_init(&clp->cl_lru);
+	spin_unlock(&client_lru_lock);
 #if defined(CONFIG_PNFSD)
 	while (!list_empty(&clp->cl_layouts)) {
 		lp = list_entry(clp->cl_layouts.next, struct nfs4_layout, lo_perclnt);
@@ -677,6 +813,7 @@ static struct nfs4_client *create_client(struct xdr_netobj name, char *recdir)
 	INIT_LIST_HEAD(&clp->cl_layoutrecalls);
 #endif /* CONFIG_PNFSD */
 #if defined(CONFIG_NFSD_V4_1)
+	spin_lock_init(&clp->cl_lock);
 	INIT_LIST_HEAD(&clp->cl_sessions);
 	mutex_init(&clp->cl_cb_mutex);
 #endif /* CONFIG_NFSD_V4_1 */
@@ -765,8 +902,10 @@ add_to_unconfirmed(struct nfs4_client *clp, unsigned int strhashval)
 	list_add(&clp->cl_strhash, &unconf_str_hashtbl[strhashval]);
 	idhashval = clientid_hashval(clp->cl_clientid.cl_id);
 	list_add(&clp->cl_idhash, &unconf_id_hashtbl[idhashval]);
+	spin_lock(&client_lru_lock);
 	list_add_tail(&clp->cl_lru, &client_lru);
 	clp->cl_time = get_seconds();
+	spin_unlock(&client_lru_lock);
 }
 
 static void
@@ -1319,6 +1458,7 @@ __be32 nfsd4_create_session(struct svc_rqst *rqstp,
 {
 	u32 ip_addr = svc_addr_in(rqstp)->sin_addr.s_addr;
 	struct nfs4_client *conf, *unconf;
+	struct nfs41_session *ses;
 	__u32   max_blocksize = svc_max_payload(rqstp);
 	int status = 0;
 
@@ -1388,7 +1528,13 @@ out_replay:
 	session->seqid = conf->cl_seqid;
 	session->fore_channel.maxreq_sz = max_blocksize;
 	session->fore_channel.maxresp_sz = max_blocksize;
-	session->fore_channel.maxresp_cached = max_blocksize;
+	/* slots and reply cache size as granted to the session */
+	ses = find_in_sessionid_hashtbl(&conf->cl_sessionid);
+	if (ses) {
+		session->fore_channel.maxreqs = ses->se_fnumslots;
+		session->fore_channel.maxresp_cached = ses->se_fmaxresp_cached;
+		nfs41_put_session(ses);
+	}
 	session->back_channel.maxreq_sz = max_blocksize;
 	session->back_channel.maxresp_sz = max_blocksize;
 	session->back_channel.maxresp_cached = max_blocksize;
@@ -1411,13 +1557,13 @@ alloc_init_file(struct inode *ino, struct svc_fh *current_fh)
 	if (fp) {
 		kref_init(&fp->fi_ref);
 		INIT_LIST_HEAD(&fp->fi_hash);
+		spin_lock_init(&fp->fi_lock);
 		INIT_LIST_HEAD(&fp->fi_stateids);
 		INIT_LIST_HEAD(&fp->fi_delegations);
 #if defined(CONFIG_PNFSD)
 		INIT_LIST_HEAD(&fp->fi_layouts);
 		INIT_LIST_HEAD(&fp->fi_layout_states);
 #endif /* CONFIG_PNFSD */
-		list_add(&fp->fi_hash, &file_hashtbl[hashval]);
 		fp->fi_inode = igrab(ino);
 		fp->fi_id = current_fileid++;
 		fp->fi_had_conflict = false;
@@ -1429,6 +1575,7 @@ alloc_init_file(struct inode *ino, struct svc_fh *current_fh)
 		memcpy(fp->fi_fhval, &current_fh->fh_handle.fh_base,
 		       fp->fi_fhlen);
 #endif /* CONFIG_PNFSD */
+		list_add_rcu(&fp->fi_hash, &file_hashtbl[hashval]);
 		return fp;
 	}
 	return NULL;
@@ -1446,6 +1593,8 @@ nfsd4_free_slab(struct kmem_cache **slab)
 void
 nfsd4_free_slabs(void)
 {
+	/* state freed by call_rcu */
+	rcu_barrier();
 	nfsd4_free_slab(&stateowner_slab);
 	nfsd4_free_slab(&file_slab);
 	nfsd4_free_slab(&stateid_slab);
@@ -1493,13 +1642,21 @@ out_nomem:
 	return -ENOMEM;
 }
 
+static void
+nfs4_free_stateowner_rcu(struct rcu_head *head)
+{
+	struct nfs4_stateowner *sop =
+		container_of(head, struct nfs4_stateowner, so_rcu);
+	kfree(sop->so_owner.data);
+	kmem_cache_free(stateowner_slab, sop);
+}
+
 void
 nfs4_free_stateowner(struct kref *kref)
 {
 	struct nfs4_stateowner *sop =
 		container_of(kref, struct nfs4_stateowner, so_ref);
-	kfree(sop->so_owner.data);
-	kmem_cache_free(stateowner_slab, sop);
+	call_rcu(&sop->so_rcu, nfs4_free_stateowner_rcu);
 }
 
 static inline struct nfs4_stateowner *
@@ -1605,9 +1762,10 @@ init_stateid(struct nfs4_stateid *stp, struct nfs4_file *fp, struct nfsd4_open *
 #if defined(CONFIG_PNFSD)
 	INIT_LIST_HEAD(&stp->st_pnfs_ds_id);
 #endif /* CONFIG_PNFSD */
-	list_add(&stp->st_hash, &stateid_hashtbl[hashval]);
 	list_add(&stp->st_perstateowner, &sop->so_stateids);
+	spin_lock(&fp->fi_lock);
 	list_add(&stp->st_perfile, &fp->fi_stateids);
+	spin_unlock(&fp->fi_lock);
 	stp->st_stateowner = sop;
 	get_nfs4_file(fp);
 	stp->st_file = fp;
@@ -1620,6 +1778,15 @@ init_stateid(struct nfs4_stateid *stp, struct nfs4_file *fp, struct nfsd4_open *
 	__set_bit(open->op_share_access, &stp->st_access_bmap);
 	__set_bit(open->op_share_deny, &stp->st_deny_bmap);
 	stp->st_openstp = NULL;
+	/* nfs4_new_open has set st_vfs_file */
+	list_add_rcu(&stp->st_hash, &stateid_hashtbl[hashval]);
+}
+
+static void
+free_stateid_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(stateid_slab,
+			container_of(head, struct nfs4_stateid, st_rcu));
 }
 
 static void
@@ -1627,15 +1794,17 @@ release_stateid(struct nfs4_stateid *stp, int flags)
 {
 	struct file *filp = stp->st_vfs_file;
 
-	list_del(&stp->st_hash);
+	list_del_rcu(&stp->st_hash);
+	spin_lock(&stp->st_file->fi_lock);
 	list_del(&stp->st_perfile);
+	spin_unlock(&stp->st_file->fi_lock);
 	list_del(&stp->st_perstateowner);
 #if defined(CONFIG_PNFSD)
 	release_pnfs_ds_dev_list(stp);
 #endif /* CONFIG_PNFSD */
 	if (flags & OPEN_STATE) {
 		release_stateid_lockowners(stp);
-		stp->st_vfs_file = NULL;
+		rcu_assign_pointer(stp->st_vfs_file, NULL);
 		BUG_ON_UNLOCKED_STATE();
 		nfs4_unlock_state();	/* allow nested layout recall/return */
 		nfsd_close(filp);
@@ -1643,7 +1812,7 @@ release_stateid(struct nfs4_stateid *stp, int flags)
 	} else if (flags & LOCK_STATE)
 		locks_remove_posix(filp, (fl_owner_t) stp->st_stateowner);
 	put_nfs4_file(stp->st_file);
-	kmem_cache_free(stateid_slab, stp);
+	call_rcu(&stp->st_rcu, free_stateid_rcu);
 }
 
 static void
@@ -1677,23 +1846,37 @@ find_openstateowner_str(unsigned int hashval, struct nfsd4_open *open)
 	return NULL;
 }
 
-/* search file_hashtbl[] for file */
+/*
+ * Search file_hashtbl[] for file, under the state lock or rcu_read_lock.
+ * No reference is taken; without the state lock the file may be on its
+ * way out, with empty lists.
+ */
 static struct nfs4_file *
-find_file(struct inode *ino)
+__find_file(struct inode *ino)
 {
 	unsigned int hashval = file_hashval(ino);
 	struct nfs4_file *fp;
 
-	BUG_ON_UNLOCKED_STATE();
-	list_for_each_entry(fp, &file_hashtbl[hashval], fi_hash) {
-		if (fp->fi_inode == ino) {
-			get_nfs4_file(fp);
+	list_for_each_entry_rcu(fp, &file_hashtbl[hashval], fi_hash) {
+		if (fp->fi_inode == ino)
 			return fp;
-		}
 	}
 	return NULL;
 }
 
+/* search file_hashtbl[] for file */
+static struct nfs4_file *
+find_file(struct inode *ino)
+{
+	struct nfs4_file *fp;
+
+	BUG_ON_UNLOCKED_STATE();
+	fp = __find_file(ino);
+	if (fp)
+		get_nfs4_file(fp);
+	return fp;
+}
+
 static struct nfs4_file *
 find_alloc_file(struct inode *ino, struct svc_fh *current_fh)
 {
@@ -1783,19 +1966,23 @@ nfs4_share_conflict(struct svc_fh *current_fh, unsigned int deny_type)
 
 	dprintk("NFSD: nfs4_share_conflict\n");
 
-	fp = find_file(ino);
+	ret = nfs_ok;
+	rcu_read_lock();
+	fp = __find_file(ino);
 	if (!fp)
-		return nfs_ok;
-	ret = nfserr_locked;
+		goto out;
 	/* Search for conflicting share reservations */
+	spin_lock(&fp->fi_lock);
 	list_for_each_entry(stp, &fp->fi_stateids, st_perfile) {
 		if (test_bit(deny_type, &stp->st_deny_bmap) ||
-		    test_bit(NFS4_SHARE_DENY_BOTH, &stp->st_deny_bmap))
-			goto out;
+		    test_bit(NFS4_SHARE_DENY_BOTH, &stp->st_deny_bmap)) {
+			ret = nfserr_locked;
+			break;
+		}
 	}
-	ret = nfs_ok;
+	spin_unlock(&fp->fi_lock);
 out:
-	put_nfs4_file(fp);
+	rcu_read_unlock();
 	return ret;
 }
 
@@ -2226,6 +2413,9 @@ nfs4_open_delegation(struct svc_fh *fh, struct nfsd4_open *open, struct nfs4_sta
 	fl.fl_file = stp->st_vfs_file;
 	fl.fl_pid = current->tgid;
 
+	/* cached v2/v3 opens would make the lease look contended */
+	nfsd_file_close_inode(stp->st_vfs_file->f_path.dentry->d_inode);
+
 	/* vfs_setlease checks to see if delegation should be handed out.
 	 * the lock_manager callbacks fl_mylease and fl_change are used
 	 */
@@ -2385,6 +2575,166 @@ out:
 }
 
 #if defined(CONFIG_NFSD_V4_1)
+/*
+ * Slot reply cache memory is getting scarce: stop growing sessions and
+ * have the laundromat shrink them.
+ */
+static inline int
+nfsd_slot_cache_pressure(void)
+{
+	return atomic_long_read(&nfsd_slot_cache_total) >
+		nfsd_slot_cache_max / 4 * 3;
+}
+
+/*
+ * Charge the client and the server for a reply cache for @slot, if they
+ * can afford it, and return its size.  Called with cl_lock held on a
+ * slot just claimed; the caller then allocates the memory with
+ * nfsd4_slot_cache_alloc.  A slot without a cache answers
+ * retransmissions with NFS4ERR_RETRY_UNCACHED_REP.
+ */
+static u32
+nfsd4_slot_cache_reserve(struct nfs41_session *ses, struct nfs41_slot *slot)
+{
+	struct nfs4_client *clp = ses->se_client;
+	u32 cached = ses->se_fmaxresp_cached;
+
+	if (slot->sl_data || cached == 0)
+		return 0;
+	if (clp->cl_slot_cache + cached > NFSD_CLIENT_SLOT_CACHE)
+		return 0;
+	if (atomic_long_add_return(cached, &nfsd_slot_cache_total) >
+	    nfsd_slot_cache_max) {
+		atomic_long_sub(cached, &nfsd_slot_cache_total);
+		return 0;
+	}
+	clp->cl_slot_cache += cached;
+	return cached;
+}
+
+/*
+ * Allocate the @cached bytes reserved for @slot.  The slot is in
+ * progress, so nobody else looks at sl_data meanwhile.  If the session
+ * was destroyed in between, destroy_session didn't know about the
+ * reservation, so it is given back here.
+ */
+static void
+nfsd4_slot_cache_alloc(struct nfs41_session *ses, struct nfs41_slot *slot,
+		       u32 cached)
+{
+	struct nfs4_client *clp = ses->se_client;
+	char *data;
+
+	data = kmalloc(cached, GFP_KERNEL);
+	spin_lock(&clp->cl_lock);
+	if (data && ses->se_fmaxresp_cached) {
+		slot->sl_data = data;
+		data = NULL;
+	} else {
+		clp->cl_slot_cache -= cached;
+		atomic_long_sub(cached, &nfsd_slot_cache_total);
+	}
+	spin_unlock(&clp->cl_lock);
+	kfree(data);
+}
+
+/* Called with cl_lock held */
+static void
+nfsd4_slot_cache_free(struct nfs41_session *ses, struct nfs41_slot *slot)
+{
+	if (!slot->sl_data)
+		return;
+	kfree(slot->sl_data);
+	slot->sl_data = NULL;
+	slot->sl_datalen = 0;
+	ses->se_client->cl_slot_cache -= ses->se_fmaxresp_cached;
+	atomic_long_sub(ses->se_fmaxresp_cached, &nfsd_slot_cache_total);
+}
+
+/*
+ * Called by the laundromat with cl_lock held: bring the session's
+ * target down to the slots the client actually used since the last run,
+ * and under memory pressure to half the current target, then free the
+ * reply cache of idle slots above the target.  Clients that kept hitting
+ * the target in the meantime have had it raised by nfsd4_sequence.
+ */
+static void
+nfsd4_shrink_slots(struct nfs41_session *ses, int pressure)
+{
+	struct nfs41_slot *slot;
+	u32 target = max_t(u32, ses->se_peak_slots, 1);
+	int i;
+
+	if (pressure)
+		target = min_t(u32, target,
+			       max_t(u32, ses->se_target_slots / 2, 1));
+	if (target != ses->se_target_slots)
+		dprintk("%s: session target %u -> %u slots\n", __func__,
+			ses->se_target_slots, target);
+	ses->se_target_slots = target;
+	ses->se_peak_slots = 0;
+
+	for (i = target; i < ses->se_fnumslots; i++) {
+		slot = &ses->se_slots[i];
+		/* keep SEQUENCE off the slot while its cache goes */
+		if (atomic_cmpxchg(&slot->sl_state, NFS4_SLOT_AVAILABLE,
+				   NFS4_SLOT_RECLAIM) != NFS4_SLOT_AVAILABLE)
+			continue;
+		nfsd4_slot_cache_free(ses, slot);
+		nfs41_set_slot_state(slot, NFS4_SLOT_AVAILABLE);
+	}
+}
+
+/*
+ * Keep the reply to the compound just run on @slot, so that a
+ * retransmission can be answered without running it again.  Only the
+ * part following the tag is kept; the tag comes from the retransmitted
+ * request.  Replies with page data, or larger than the session's
+ * maxresp_cached, are not kept.
+ */
+void
+nfsd4_store_cache_entry(struct nfsd4_compoundres *resp,
+			struct nfs41_slot *slot, __be32 status)
+{
+	__be32 *start = resp->tagp + 2 + XDR_QUADLEN(resp->taglen);
+	u32 len = (char *)resp->p - (char *)start;
+
+	slot->sl_datalen = 0;
+	if (!slot->sl_data || resp->xbuf->page_len ||
+	    len > slot->sl_session->se_fmaxresp_cached)
+		return;
+	memcpy(slot->sl_data, start, len);
+	slot->sl_status = status;
+	slot->sl_opcnt = resp->opcnt;
+	slot->sl_datalen = len;
+}
+
+/*
+ * Answer a retransmission from the slot's reply cache, in place of
+ * anything encoded so far.  Returns the compound status of the reply.
+ */
+__be32
+nfsd4_replay_cache_entry(struct nfsd4_compoundres *resp,
+			 struct nfs41_slot *slot)
+{
+	__be32 *start = resp->tagp + 2 + XDR_QUADLEN(resp->taglen);
+
+	dprintk("%s: replaying %u bytes, %u ops\n", __func__,
+		slot->sl_datalen, slot->sl_opcnt);
+	memcpy(start, slot->sl_data, slot->sl_datalen);
+	resp->p = start + XDR_QUADLEN(slot->sl_datalen);
+	resp->opcnt = slot->sl_opcnt;
+	return slot->sl_status;
+}
+
+/*
+ * SEQUENCE prefixes every v4.1 compound, so it takes no lock on the way
+ * in: the session is looked up under RCU, and the slot is claimed with
+ * a compare-and-exchange of its state, which makes this thread the only
+ * one to look at the slot's seqid and reply cache until it is released.
+ * cl_lock is only taken to give the slot a reply cache, the first time
+ * it is used.
+ */
 __be32
 nfsd4_sequence(struct svc_rqst *r,
 		struct nfsd4_compound_state *cstate,
@@ -2392,17 +2742,20 @@ nfsd4_sequence(struct svc_rqst *r,
 {
 	struct nfs41_session *elem;
 	struct nfs41_slot *slot;
+	struct nfs4_client *clp;
 	struct current_session *c_ses = cstate->current_ses;
+	int replay = 0;
+	u32 cached = 0;
+	int state;
 	int status;
 
 	if (STALE_CLIENTID((clientid_t *)seq->sessionid))
 		return nfserr_stale_clientid;
 
-	nfs4_lock_state();
-	status = nfserr_badsession;
 	elem = find_in_sessionid_hashtbl(&seq->sessionid);
 	if (!elem)
-		goto out;
+		return nfserr_badsession;
+	clp = elem->se_client;
 
 	status = nfserr_badslot;
 	if (seq->slotid >= elem->se_fnumslots)
@@ -2411,15 +2764,26 @@ nfsd4_sequence(struct svc_rqst *r,
 	slot = &elem->se_slots[seq->slotid];
 	dprintk("%s: slotid %d\n", __func__, seq->slotid);
 
+	state = atomic_cmpxchg(&slot->sl_state, NFS4_SLOT_AVAILABLE,
+			       NFS4_SLOT_INPROGRESS);
+	/* the slot is busy with another request, or the laundromat is
+	 * trimming it: try again shortly */
+	status = nfserr_jukebox;
+	if (state != NFS4_SLOT_AVAILABLE)
+		goto out;
+
+	/* The slot is ours from here on */
+
 	/* Server post op_sequence compound processing had an upcall which
-	 * resulted in replaying the compound processing including the
-	 * already processed op_sequence. Set current_session
-	 * but don't bump slot->sl_seqid which was incremented in successful
-	 * op_sequence processing prior to upcall.
+	 * dropped the request, and released the slot.  Whichever of the
+	 * revisit of the deferral or a retransmission comes first runs the
+	 * compound again, including the already processed op_sequence:
+	 * set current_session but don't bump slot->sl_seqid.  Only ops
+	 * that are safe to repeat come before a deferral.
 	 */
-	if (nfs41_get_slot_state(slot) == NFS4_SLOT_INPROGRESS) {
-		dprintk("%s: NFS4_SLOT_INPROGRESS. set current_session\n",
-			__func__);
+	if (slot->sl_deferred && seq->seqid == slot->sl_seqid) {
+		dprintk("%s: rerunning deferred seqid %u\n", __func__,
+			seq->seqid);
 		goto set_curr_ses;
 	}
 
@@ -2427,38 +2791,75 @@ nfsd4_sequence(struct svc_rqst *r,
 	if (status == NFSERR_REPLAY_ME)
 		goto replay;
 	else if (status)
-		goto out;
+		goto out_release;
 
 	/* Success! bump slot seqid and renew clientid */
 	slot->sl_seqid = seq->seqid;
-	renew_client(elem->se_client);
+	renew_client(clp);
 	dprintk("%s: set NFS4_SLOT_INPROGRESS\n", __func__);
-	nfs41_set_slot_state(slot, NFS4_SLOT_INPROGRESS);
+	if (!slot->sl_data && elem->se_fmaxresp_cached) {
+		spin_lock(&clp->cl_lock);
+		cached = nfsd4_slot_cache_reserve(elem, slot);
+		spin_unlock(&clp->cl_lock);
+		if (cached)
+			nfsd4_slot_cache_alloc(elem, slot, cached);
+	}
+
+	/*
+	 * A client working at its target wants more slots; let it have up
+	 * to twice as many, unless memory is short.  This is only a hint
+	 * to the client, so racing with another SEQUENCE or the laundromat
+	 * does no harm.
+	 */
+	if (seq->slotid >= elem->se_peak_slots)
+		elem->se_peak_slots = seq->slotid + 1;
+	if (seq->slotid + 1 >= elem->se_target_slots &&
+	    elem->se_target_slots < elem->se_fnumslots &&
+	    !nfsd_slot_cache_pressure()) {
+		elem->se_target_slots = min_t(u32, elem->se_target_slots * 2,
+					      elem->se_fnumslots);
+		dprintk("%s: session target raised to %u slots\n", __func__,
+			elem->se_target_slots);
+	}
 
 set_curr_ses:
-	/* Set current_session. hold reference until done processing compound.
+	/*
+	 * The client may use any slot of the table, but is asked to keep to
+	 * the target.  None of the SEQ4_STATUS flags concern slots.
+	 */
+	seq->maxslots = elem->se_fnumslots - 1;
+	seq->target_maxslots = elem->se_target_slots - 1;
+	seq->status_flags = 0;
+
+	/* Set current_session.  The reference taken by the lookup is held
+	 * until done processing compound.
 	 * nfs41_put_session called only if cs_slot is set
 	 */
 	memcpy(&c_ses->cs_sid, &seq->sessionid, sizeof(c_ses->cs_sid));
 	BUG_ON(sizeof(c_ses->cs_sid) != sizeof(seq->sessionid));
 	c_ses->cs_slot = slot;
-	nfs41_get_session(slot->sl_session);
-
-	/* FIXME: for now just initialize target_highest_slotid and flags
-	 * response fields */
-	seq->target_maxslots = seq->maxslots;
-	seq->status_flags = 0;
 
-	status = nfs_ok;
+	status = replay ? nfserr_replay_cache : nfs_ok;
+	dprintk("%s: return %d\n", __func__, ntohl(status));
+	return status;
+out_release:
+	nfs41_set_slot_state(slot, NFS4_SLOT_AVAILABLE);
 out:
+	nfs41_put_session(elem);
 	dprintk("%s: return %d\n", __func__, ntohl(status));
-	nfs4_unlock_state();
 	return status;
 replay:
-	dprintk("%s: REPLAY - AKKKK! no code yet! return BAD SESSION\n",
-		__func__);
-	status = nfserr_badsession;
-	goto out;
+	/*
+	 * A retransmission of the last request on the slot: have the
+	 * compound answered from the slot's reply cache.  We hold the slot
+	 * until then, so the cache can't change under us.
+	 */
+	dprintk("%s: REPLAY of seqid %u\n", __func__, seq->seqid);
+	status = nfserr_retry_uncached_rep;
+	if (slot->sl_datalen == 0)
+		goto out_release;
+	replay = 1;
+	goto set_curr_ses;
 }
 
 __be32
@@ -2486,6 +2887,7 @@ nfsd4_destroy_session(struct svc_rqst *r,
 	shutdown_callback_client(ses->se_client);
 
 	destroy_session(ses);
+	nfs41_put_session(ses);
 	status = nfs_ok;
 out:
 	nfs4_unlock_state();
@@ -2518,8 +2920,9 @@ nfs4_laundromat(void)
 	dprintk("NFSD: laundromat service - starting\n");
 	if (in_grace)
 		end_grace();
-	list_for_each_safe(pos, next, &client_lru) {
-		clp = list_entry(pos, struct nfs4_client, cl_lru);
+	spin_lock(&client_lru_lock);
+	while (!list_empty(&client_lru)) {
+		clp = list_entry(client_lru.next, struct nfs4_client, cl_lru);
 		if (time_after((unsigned long)clp->cl_time, (unsigned long)cutoff)) {
 			t = clp->cl_time - cutoff;
 			if (clientid_val > t)
@@ -2530,11 +2933,27 @@ nfs4_laundromat(void)
 		if (clp->cl_exchange_flags & EXCHGID4_FLAG_USE_PNFS_DS)
 			break;
 #endif /* CONFIG_PNFSD */
+		/* off the list, a late renew_client leaves it alone */
+		list_del_init(&clp->cl_lru);
+		spin_unlock(&client_lru_lock);
 		dprintk("NFSD: purging unused client(clientid %08x flags %x)\n",
 			clp->cl_clientid.cl_id, clp->cl_exchange_flags);
 		nfsd4_remove_clid_dir(clp);
 		expire_client(clp);
+		spin_lock(&client_lru_lock);
 	}
+#if defined(CONFIG_NFSD_V4_1)
+	list_for_each_entry(clp, &client_lru, cl_lru) {
+		struct nfs41_session *ses;
+		int pressure = nfsd_slot_cache_pressure();
+
+		spin_lock(&clp->cl_lock);
+		list_for_each_entry(ses, &clp->cl_sessions, se_perclnt)
+			nfsd4_shrink_slots(ses, pressure);
+		spin_unlock(&clp->cl_lock);
+	}
+#endif /* CONFIG_NFSD_V4_1 */
+	spin_unlock(&client_lru_lock);
 	INIT_LIST_HEAD(&reaplist);
 	spin_lock(&recall_lock);
 	list_for_each_safe(pos, next, &del_recall_lru) {
@@ -2555,6 +2974,9 @@ nfs4_laundromat(void)
 		list_del_init(&dp->dl_recall_lru);
 		unhash_delegation(dp);
 	}
+#if defined(CONFIG_PNFSD)
+	nfs4_pnfs_ds_laundromat(cutoff);
+#endif /* CONFIG_PNFSD */
 	test_val = NFSD_LEASE_TIME;
 	list_for_each_safe(pos, next, &close_lru) {
 		sop = list_entry(pos, struct nfs4_stateowner, so_close_lru);
@@ -2676,14 +3098,135 @@ io_during_grace_disallowed(struct inode *inode, int flags)
 }
 
 /*
-* Checks for stateid operations
+ * Check the generation of @stateid against that of the state it names.
+ * 4.1 is allowed to ignore the generation number when it is zero
+ * whereas 4.0 returns bad_stateid or stale stateid.
+ */
+static __be32
+check_stateid_generation(stateid_t *in, stateid_t *ref, int flags)
+{
+	if ((flags & NFS_4_1) && in->si_generation == 0)
+		return nfs_ok;
+	/* BAD STATEID */
+	if (in->si_generation > ref->si_generation)
+		return nfserr_bad_stateid;
+	/* OLD STATEID */
+	if (in->si_generation < ref->si_generation)
+		return nfserr_old_stateid;
+	return nfs_ok;
+}
+
+/*
+ * Check an open or lock stateid, under rcu_read_lock.  The file is
+ * returned in *filpp with a reference held, even on error: it can't be
+ * put before rcu_read_unlock.
+ */
+static __be32
+nfs4_check_open_stateid(struct inode *ino, stateid_t *stateid, int flags,
+			struct file **filpp)
+{
+	struct nfs4_stateid *stp;
+	struct file *filp;
+	__be32 status;
+
+	if (!(stp = find_stateid(stateid, flags))) {
+		dprintk("NFSD: open or lock stateid not found\n");
+		return nfserr_bad_stateid;
+	}
+	/* a CLOSE may be dropping the last reference */
+	filp = rcu_dereference(stp->st_vfs_file);
+	if (!filp || !atomic_inc_not_zero(&filp->f_count))
+		return nfserr_bad_stateid;
+	*filpp = filp;
+
+	if ((flags & CHECK_FH) && ino != filp->f_path.dentry->d_inode)
+		return nfserr_bad_stateid;
+	if (!stp->st_stateowner->so_confirmed)
+		return nfserr_bad_stateid;
+	status = check_stateid_generation(stateid, &stp->st_stateid, flags);
+	if (status)
+		return status;
+	status = nfs4_check_openmode(stp, flags);
+	if (status)
+		return status;
+	renew_client(stp->st_stateowner->so_client);
+	return nfs_ok;
+}
+
+/*
+ * Check a delegation stateid, under rcu_read_lock.  On success the file
+ * is returned in *filpp with a reference held.
+ */
+static __be32
+nfs4_check_deleg_stateid(struct inode *ino, stateid_t *stateid, int flags,
+			 struct file **filpp)
+{
+	struct nfs4_file *fp;
+	struct nfs4_delegation *dp = NULL;
+	struct nfs4_client *clp = NULL;
+	__be32 status = nfserr_bad_stateid;
+
+	fp = __find_file(ino);
+	if (fp) {
+		spin_lock(&fp->fi_lock);
+		dp = find_delegation_file(fp, stateid);
+		if (dp) {
+			status = check_stateid_generation(stateid,
+						&dp->dl_stateid, flags);
+			if (!status)
+				status = nfs4_check_delegmode(dp, flags);
+		}
+		if (dp && !status) {
+			/* held by the delegation until it leaves the file */
+			get_file(dp->dl_vfs_file);
+			*filpp = dp->dl_vfs_file;
+			clp = dp->dl_client;
+		}
+		spin_unlock(&fp->fi_lock);
+	}
+	if (!dp)
+		dprintk("NFSD: delegation stateid not found\n");
+	if (clp)
+		renew_client(clp);
+	return status;
+}
+
+/* DELEGRETURN: check the stateid and unhash the delegation */
+static __be32
+nfs4_return_deleg_stateid(struct inode *ino, stateid_t *stateid, int flags)
+{
+	struct nfs4_delegation *dp;
+	__be32 status;
+
+	BUG_ON_UNLOCKED_STATE();
+	if (stateid->si_fileid ||
+	    !(dp = find_delegation_stateid(ino, stateid))) {
+		dprintk("NFSD: delegation stateid not found\n");
+		return nfserr_bad_stateid;
+	}
+	status = check_stateid_generation(stateid, &dp->dl_stateid, flags);
+	if (status)
+		return status;
+	status = nfs4_check_delegmode(dp, flags);
+	if (status)
+		return status;
+	renew_client(dp->dl_client);
+	unhash_delegation(dp);
+	return nfs_ok;
+}
+
+/*
+* Checks for stateid operations.  On success, *filpp is set to the file
+* to do I/O on, with a reference held, or to NULL for special stateids.
+*
+* Only DELEG_RET needs the state lock; open, lock and delegation
+* stateids are otherwise checked under rcu_read_lock, so that READ and
+* WRITE from different clients don't serialize on it.
 */
 __be32
 nfs4_preprocess_stateid_op(struct svc_fh *current_fh, stateid_t *stateid, int flags, struct file **filpp)
 {
-	struct nfs4_stateid *stp = NULL;
-	struct nfs4_delegation *dp = NULL;
-	stateid_t *stidp;
+	struct file *filp = NULL;
 	struct inode *ino = current_fh->fh_dentry->d_inode;
 	__be32 status;
 
@@ -2702,68 +3245,35 @@ nfs4_preprocess_stateid_op(struct svc_fh *current_fh, stateid_t *stateid, int fl
 #if defined(CONFIG_PNFSD)
 	if (pnfs_fh_is_ds(&current_fh->fh_handle)) {
 		/* PNFS FH */
+		int did_lock = nfs4_lock_state_nested();
+
 		status = nfs4_preprocess_pnfs_ds_stateid(current_fh, stateid);
-		goto out;
+		if (did_lock)
+			nfs4_unlock_state();
+		return status;
 	}
 #endif /* CONFIG_PNFSD */
 
 	/* STALE STATEID */
-	status = nfserr_stale_stateid;
-	if (STALE_STATEID(stateid)) 
-		goto out;
-
-	/* BAD STATEID */
-	status = nfserr_bad_stateid;
-	if (!stateid->si_fileid) { /* delegation stateid */
-		if(!(dp = find_delegation_stateid(ino, stateid))) {
-			dprintk("NFSD: delegation stateid not found\n");
-			goto out;
-		}
-		stidp = &dp->dl_stateid;
-	} else { /* open or lock stateid */
-		if (!(stp = find_stateid(stateid, flags))) {
-			dprintk("NFSD: open or lock stateid not found\n");
-			goto out;
-		}
-		if ((flags & CHECK_FH) && nfs4_check_fh(current_fh, stp))
-			goto out;
-		if (!stp->st_stateowner->so_confirmed)
-			goto out;
-		stidp = &stp->st_stateid;
-	}
-	/*
-	* 4.1 is allowed to ignore the generation number when it is zero
-	* whereas 4.0 returns bad_stateid or stale stateid.
-	*/
-	if ((flags & NFS_4_1) && stateid->si_generation == 0)
-		goto checkmode;
+	if (STALE_STATEID(stateid))
+		return nfserr_stale_stateid;
 
-	if (stateid->si_generation > stidp->si_generation)
-		goto out;
+	if (flags & DELEG_RET)
+		return nfs4_return_deleg_stateid(ino, stateid, flags);
 
-	/* OLD STATEID */
-	status = nfserr_old_stateid;
-	if (stateid->si_generation < stidp->si_generation)
-		goto out;
+	rcu_read_lock();
+	if (!stateid->si_fileid) /* delegation stateid */
+		status = nfs4_check_deleg_stateid(ino, stateid, flags, &filp);
+	else /* open or lock stateid */
+		status = nfs4_check_open_stateid(ino, stateid, flags, &filp);
+	rcu_read_unlock();
 
-checkmode:
-	if (stp) {
-		if ((status = nfs4_check_openmode(stp,flags)))
-			goto out;
-		renew_client(stp->st_stateowner->so_client);
-		if (filpp)
-			*filpp = stp->st_vfs_file;
-	} else if (dp) {
-		if ((status = nfs4_check_delegmode(dp, flags)))
-			goto out;
-		renew_client(dp->dl_client);
-		if (flags & DELEG_RET)
-			unhash_delegation(dp);
-		if (filpp)
-			*filpp = dp->dl_vfs_file;
+	if (filp && (status || !filpp)) {
+		fput(filp);
+		filp = NULL;
 	}
-	status = nfs_ok;
-out:
+	if (filpp)
+		*filpp = filp;
 	return status;
 }
 
@@ -3154,7 +3664,8 @@ find_stateid(stateid_t *stid, int flags)
 	dprintk("NFSD: find_stateid flags 0x%x\n",flags);
 	if ((flags & LOCK_STATE) || (flags & RD_STATE) || (flags & WR_STATE)) {
 		hashval = stateid_hashval(st_id, f_id);
-		list_for_each_entry(local, &lockstateid_hashtbl[hashval], st_hash) {
+		list_for_each_entry_rcu(local, &lockstateid_hashtbl[hashval],
+					st_hash) {
 			if ((local->st_stateid.si_stateownerid == st_id) &&
 			    (local->st_stateid.si_fileid == f_id))
 				return local;
@@ -3162,7 +3673,8 @@ find_stateid(stateid_t *stid, int flags)
 	} 
 	if ((flags & OPEN_STATE) || (flags & RD_STATE) || (flags & WR_STATE)) {
 		hashval = stateid_hashval(st_id, f_id);
-		list_for_each_entry(local, &stateid_hashtbl[hashval], st_hash) {
+		list_for_each_entry_rcu(local, &stateid_hashtbl[hashval],
+					st_hash) {
 			if ((local->st_stateid.si_stateownerid == st_id) &&
 			    (local->st_stateid.si_fileid == f_id))
 				return local;
@@ -3309,8 +3821,9 @@ alloc_init_lock_stateid(struct nfs4_stateowner *sop, struct nfs4_file *fp, struc
 #if defined(CONFIG_PNFSD)
 	INIT_LIST_HEAD(&stp->st_pnfs_ds_id);
 #endif /* CONFIG_PNFSD */
-	list_add(&stp->st_hash, &lockstateid_hashtbl[hashval]);
+	spin_lock(&fp->fi_lock);
 	list_add(&stp->st_perfile, &fp->fi_stateids);
+	spin_unlock(&fp->fi_lock);
 	list_add(&stp->st_perstateowner, &sop->so_stateids);
 	stp->st_stateowner = sop;
 	get_nfs4_file(fp);
@@ -3323,6 +3836,7 @@ alloc_init_lock_stateid(struct nfs4_stateowner *sop, struct nfs4_file *fp, struc
 	stp->st_access_bmap = open_stp->st_access_bmap;
 	stp->st_deny_bmap = open_stp->st_deny_bmap;
 	stp->st_openstp = open_stp;
+	list_add_rcu(&stp->st_hash, &lockstateid_hashtbl[hashval]);
 
 out:
 	return stp;
@@ -3923,6 +4437,23 @@ set_max_delegations(void)
 	max_delegations = nr_free_buffer_pages() >> (20 - 2 - PAGE_SHIFT);
 }
 
+#if defined(CONFIG_NFSD_V4_1)
+/*
+ * Let session slots keep replies in up to 1/64 of low memory, so that
+ * a large number of clients can't pin much of it with idle slots.
+ */
+static void
+set_max_slot_cache(void)
+{
+	nfsd_slot_cache_max = (nr_free_buffer_pages() >> 6) << PAGE_SHIFT;
+}
+#else
+static inline void
+set_max_slot_cache(void)
+{
+}
+#endif /* CONFIG_NFSD_V4_1 */
+
 /* initialization to perform when the nfsd service is started: */
 
 static void
@@ -3939,6 +4470,7 @@ __nfs4_state_start(void)
 	laundry_wq = create_singlethread_workqueue("nfsd4");
 	queue_delayed_work(laundry_wq, &laundromat_work, grace_time);
 	set_max_delegations();
+	set_max_slot_cache();
 }
 
 void
@@ -3995,6 +4527,9 @@ __nfs4_state_shutdown(void)
 		unhash_delegation(dp);
 	}
 
+#if defined(CONFIG_PNFSD)
+	nfs4_pnfs_state_shutdown();
+#endif /* CONFIG_PNFSD */
 	nfsd4_shutdown_recdir();
 	nfs4_init = 0;
 }
@@ -4640,8 +5175,14 @@ nfs4_pnfs_get_layout(struct svc_fh *current_fh,
 
 	if (status) {
 		switch (status) {
-		case -ENOMEM:
 		case -EAGAIN:
+			/* the file system deferred the request */
+			if (args->creq) {
+				status = nfserr_dropit;
+				break;
+			}
+			/* fall through */
+		case -ENOMEM:
 		case -EINTR:
 			status = nfserr_layouttrylater;
 			break;
@@ -5206,6 +5747,17 @@ int nfsd_layout_recall_cb(struct super_block *sb, struct inode *inode,
 	if (nfsd_serv == NULL)
 		return -ENOENT;
 
+#if defined(CONFIG_SPNFS)
+	if (spnfs_enabled()) {
+		if (cbl->cbl_recall_type == RECALL_FILE)
+			spnfs_layout_cache_invalidate(sb, inode->i_ino);
+		else if (cbl->cbl_recall_type == RECALL_FSID)
+			spnfs_layout_cache_invalidate(sb, 0);
+		else
+			spnfs_layout_cache_invalidate(NULL, 0);
+	}
+#endif /* CONFIG_SPNFS */
+
 	clr = alloc_init_layoutrecall(NULL);
 	if (!clr)
 		return -ENOMEM;
@@ -5270,6 +5822,11 @@ int nfsd_device_notify_cb(struct super_block *sb, struct nfsd4_pnfs_cb_device *n
 	if (nfsd_serv == NULL)
 		return -ENOENT;
 
+#if defined(CONFIG_SPNFS)
+	if (spnfs_enabled())
+		spnfs_devinfo_cache_invalidate(nd->cbd_devid.pnfs_devid);
+#endif /* CONFIG_SPNFS */
+
 	did_lock = nfs4_lock_state_nested();
 
 	cbnd.cbd = *nd;
@@ -2867,7 +2867,7 @@ nfsd4_encode_read(struct nfsd4_compoundres *resp, __be32 nfserr,
 
 #if defined(CONFIG_SPNFS)
 	if (spnfs_enabled()) {
-		nfserr = spnfs_read(read->rd_fhp->fh_dentry->d_inode->i_ino,
+		nfserr = spnfs_read(read->rd_fhp->fh_dentry->d_inode,
 				    read->rd_offset, &maxcount, read->rd_vlen,
 				    resp->rqstp);
 		if (nfserr < 0)
@@ -3311,8 +3311,11 @@ nfsd4_encode_write(struct nfsd4_compoundres *resp, __be32 nfserr, struct nfsd4_w
 
 #if defined(CONFIG_PNFSD)
 
-/* Uses the export interface to iterate through the available devices
- * and encodes them on the response stream.
+/* Uses the export interface to retrieve as many of the available
+ * devices as fit in the reply, up to the number the client asked for,
+ * and encodes them on the response stream.  File systems that can
+ * return many devices at once are asked once through get_device_list;
+ * the others are iterated one device at a time.
  */
 static  __be32
 nfsd4_encode_devlist_iterator(struct nfsd4_compoundres *resp,
@@ -3321,13 +3324,58 @@ nfsd4_encode_devlist_iterator(struct nfsd4_compoundres *resp,
 {
 	struct super_block *sb = gdevl->gd_fhp->fh_dentry->d_inode->i_sb;
 	struct pnfs_deviter_arg iter_arg;
+	struct pnfs_devlist_arg list_arg;
 	int nfserr;
 	int maxnum = gdevl->gd_maxnum;
+	int room, i;
 
 	ENCODE_HEAD;
 
 	dprintk("%s: Begin\n", __func__);
 
+	/* leave room for the eof flag */
+	room = ((char *)resp->end - (char *)resp->p - 4) / sizeof(deviceid_t);
+	if (maxnum > room)
+		maxnum = room;
+	if (maxnum <= 0) {
+		nfserr = nfserr_toosmall;
+		goto out_err;
+	}
+
+	if (sb->s_export_op->get_device_list) {
+		list_arg.type = gdevl->gd_type;
+		list_arg.maxnum = maxnum;
+		list_arg.cookie = gdevl->gd_cookie;
+		list_arg.verf = gdevl->gd_verf;
+		list_arg.devids = kmalloc(maxnum * sizeof(u64), GFP_KERNEL);
+		if (!list_arg.devids) {
+			nfserr = nfserr_jukebox;
+			goto out_err;
+		}
+		nfserr = sb->s_export_op->get_device_list(sb, &list_arg);
+		dprintk("%s: get_device_list err: %d, count %u, eof: %u\n",
+			__func__, nfserr, list_arg.count, list_arg.eof);
+		if (nfserr) {
+			kfree(list_arg.devids);
+			nfserr = nfserrno(nfserr);
+			goto out_err;
+		}
+
+		RESERVE_SPACE(list_arg.count * sizeof(deviceid_t));
+		for (i = 0; i < list_arg.count; i++) {
+			WRITE64((__be64)gdevl->gd_fhp->fh_export->ex_fsid);
+			WRITE64(list_arg.devids[i]);	/* devid minor */
+		}
+		ADJUST_ARGS();
+		kfree(list_arg.devids);
+
+		*dev_count = list_arg.count;
+		iter_arg.eof = list_arg.eof;
+		iter_arg.cookie = list_arg.cookie;
+		iter_arg.verf = list_arg.verf;
+		goto out;
+	}
+
 	/* set initial iterator args */
 	iter_arg.type = gdevl->gd_type;
 	iter_arg.cookie = gdevl->gd_cookie;
@@ -3447,6 +3495,29 @@ out_err:
 	goto out;
 }
 
+/*
+ * Deferring a request runs the whole compound again on the revisit, so
+ * the file system may only defer LAYOUTGET or GETDEVICEINFO when the ops
+ * before it change nothing: SEQUENCE and PUTFH.  Otherwise, and on the
+ * revisit itself, it has to make its upcall synchronously.
+ */
+static struct cache_req *
+nfsd4_defer_handle(struct nfsd4_compoundres *resp)
+{
+	struct nfsd4_compoundargs *args = resp->rqstp->rq_argp;
+	int i;
+
+	if (resp->rqstp->rq_deferred)
+		return NULL;
+	/* resp->opcnt counts the op being encoded */
+	for (i = 0; i < resp->opcnt - 1; i++) {
+		if (args->ops[i].opnum != OP_SEQUENCE &&
+		    args->ops[i].opnum != OP_PUTFH)
+			return NULL;
+	}
+	return &resp->rqstp->rq_chandle;
+}
+
 /* For a given device id, have the file system retrieve and encode the
  * associated device.  For file layout, the encoding function is
  * passed down to the file system.  The file system then has the option
@@ -3506,6 +3577,8 @@ nfsd4_encode_getdevinfo(struct nfsd4_compoundres *resp,
 	args.xdr.end = resp->end;
 	args.xdr.maxcount = maxcount;
 
+	args.creq = nfsd4_defer_handle(resp);
+
 	/* Call file system to retrieve and encode device */
 	nfserr = sb->s_export_op->get_device_info(sb, &args);
 	if (nfserr) {
@@ -3514,6 +3587,8 @@ nfsd4_encode_getdevinfo(struct nfsd4_compoundres *resp,
 		ADJUST_ARGS();
 		if (nfserr == -ETOOSMALL)
 			goto toosmall;
+		if (nfserr == -EAGAIN && args.creq)
+			goto out;	/* deferred */
 		printk(KERN_ERR "%s: export ERROR %d\n", __func__, nfserr);
 		goto out;
 	}
@@ -3620,11 +3695,15 @@ nfsd4_encode_layoutget(struct nfsd4_compoundres *resp,
 	args.xdr.end = resp->end;
 	args.xdr.maxcount = maxcount;
 
+	args.creq = nfsd4_defer_handle(resp);
+
 	/* Retrieve, encode, and merge layout; process stateid */
 	nfserr = nfs4_pnfs_get_layout(lgp->lg_fhp, &args, &lgp->lg_sid);
+	if (nfserr == nfserr_dropit)
+		return nfserr;
 	if (nfserr) {
 		printk(KERN_ERR "%s: export ERROR %d\n", __func__, nfserr);
-		return nfserrno(nfserr);
+		return nfserr;
 	}
 
 	/* Ensure file system returned enough bytes for the client
@@ -16,56 +16,131 @@
 #include <linux/string.h>
 #include <linux/spinlock.h>
 #include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/highmem.h>
+#include <linux/swap.h>
+#include <linux/percpu.h>
+#include <net/checksum.h>
 
 #include <linux/sunrpc/svc.h>
 #include <linux/nfsd/nfsd.h>
 #include <linux/nfsd/cache.h>
 
-/* Size of reply cache. Common values are:
+/*
+ * Size of reply cache. Common values are:
  * 4.3BSD:	128
  * 4.4BSD:	256
  * Solaris2:	1024
  * DEC Unix:	512-4096
+ *
+ * None of these cover more than a few milliseconds of a busy server, so
+ * the cache is sized from memory instead: entries are allocated on
+ * demand up to nfsd_reply_cache_max, which nfsd_reply_cache_init sets
+ * and which may be changed later through the nfsd filesystem.
  */
-#define CACHESIZE		1024
-#define HASHSIZE		64
-#define REQHASH(xid)		(((((__force __u32)xid) >> 24) ^ ((__force __u32)xid)) & (HASHSIZE-1))
+#define RC_MIN_ENTRIES		1024
+#define RC_MAX_ENTRIES		(256 * 1024)
+/* average chain length aimed for when the cache is full */
+#define RC_BUCKET_DEPTH		16
+/* entries older than this are never matched and may be reused */
+#define RC_EXPIRE		(120 * HZ)
+/* bytes of call arguments covered by the checksum */
+#define RC_CSUMLEN		256U
 
-static struct hlist_head *	hash_list;
-static struct list_head 	lru_head;
+/*
+ * Each bucket has its own lock and its own LRU list, which doubles as
+ * the hash chain: the oldest entries are at the head.
+ */
+struct nfsd_drc_bucket {
+	struct list_head	lru_head;
+	spinlock_t		cache_lock;
+};
+
+static struct nfsd_drc_bucket	*drc_hashtbl;
+static unsigned int		drc_hashbits;
+static struct kmem_cache	*drc_slab;
+static atomic_t			num_drc_entries;
 static int			cache_disabled = 1;
 
+unsigned int			nfsd_reply_cache_max;
+
+static DEFINE_PER_CPU(struct nfsd_drc_stats, drc_stats);
+
+#define nfsd_drc_stats_inc(field)			\
+	do {						\
+		get_cpu_var(drc_stats).field++;		\
+		put_cpu_var(drc_stats);			\
+	} while (0)
+
 static int	nfsd_cache_append(struct svc_rqst *rqstp, struct kvec *vec);
 
-/* 
+/*
  * locking for the reply cache:
  * A cache entry is "single use" if c_state == RC_INPROG
- * Otherwise, it when accessing _prev or _next, the lock must be held.
+ * Otherwise, it when accessing _prev or _next, the lock of the bucket
+ * the entry hashes to must be held.
  */
-static DEFINE_SPINLOCK(cache_lock);
+
+static unsigned int
+nfsd_cache_size_limit(void)
+{
+	unsigned int limit;
+	unsigned long low_pages = nr_free_buffer_pages();
+
+	/*
+	 * 16 entries per sqrt(pages) of low memory, times the page size
+	 * in KB: 64 * sqrt(pages), or 32 * sqrt(KB), with 4K pages.
+	 */
+	limit = (16 * int_sqrt(low_pages)) << (PAGE_SHIFT - 10);
+	return min(max(limit, (unsigned int)RC_MIN_ENTRIES),
+		   (unsigned int)RC_MAX_ENTRIES);
+}
+
+static inline struct nfsd_drc_bucket *
+nfsd_cache_bucket(__be32 xid, struct sockaddr_in *sin)
+{
+	u32 key = (__force u32)xid ^ (__force u32)sin->sin_addr.s_addr;
+
+	return &drc_hashtbl[hash_long(key, drc_hashbits)];
+}
+
+/*
+ * Free an entry which is not in use by a thread.  The bucket lock must
+ * be held.
+ */
+static void
+nfsd_reply_cache_free_locked(struct svc_cacherep *rp)
+{
+	if (rp->c_type == RC_REPLBUFF)
+		kfree(rp->c_replvec.iov_base);
+	list_del(&rp->c_lru);
+	atomic_dec(&num_drc_entries);
+	kmem_cache_free(drc_slab, rp);
+}
 
 int nfsd_reply_cache_init(void)
 {
-	struct svc_cacherep	*rp;
-	int			i;
-
-	INIT_LIST_HEAD(&lru_head);
-	i = CACHESIZE;
-	while (i) {
-		rp = kmalloc(sizeof(*rp), GFP_KERNEL);
-		if (!rp)
-			goto out_nomem;
-		list_add(&rp->c_lru, &lru_head);
-		rp->c_state = RC_UNUSED;
-		rp->c_type = RC_NOCACHE;
-		INIT_HLIST_NODE(&rp->c_hash);
-		i--;
-	}
+	unsigned int		i, nbuckets;
 
-	hash_list = kcalloc (HASHSIZE, sizeof(struct hlist_head), GFP_KERNEL);
-	if (!hash_list)
+	nfsd_reply_cache_max = nfsd_cache_size_limit();
+	nbuckets = roundup_pow_of_two(nfsd_reply_cache_max / RC_BUCKET_DEPTH);
+	drc_hashbits = ilog2(nbuckets);
+
+	drc_slab = kmem_cache_create("nfsd_drc", sizeof(struct svc_cacherep),
+				     0, 0, NULL);
+	if (!drc_slab)
 		goto out_nomem;
 
+	drc_hashtbl = kcalloc(nbuckets, sizeof(*drc_hashtbl), GFP_KERNEL);
+	if (!drc_hashtbl)
+		goto out_nomem;
+	for (i = 0; i < nbuckets; i++) {
+		INIT_LIST_HEAD(&drc_hashtbl[i].lru_head);
+		spin_lock_init(&drc_hashtbl[i].cache_lock);
+	}
+
+	atomic_set(&num_drc_entries, 0);
 	cache_disabled = 0;
 	return 0;
 out_nomem:
@@ -77,132 +152,189 @@ out_nomem:
 void nfsd_reply_cache_shutdown(void)
 {
 	struct svc_cacherep	*rp;
-
-	while (!list_empty(&lru_head)) {
-		rp = list_entry(lru_head.next, struct svc_cacherep, c_lru);
-		if (rp->c_state == RC_DONE && rp->c_type == RC_REPLBUFF)
-			kfree(rp->c_replvec.iov_base);
-		list_del(&rp->c_lru);
-		kfree(rp);
-	}
+	unsigned int		i;
 
 	cache_disabled = 1;
 
-	kfree (hash_list);
-	hash_list = NULL;
+	if (drc_hashtbl) {
+		for (i = 0; i < (1U << drc_hashbits); i++) {
+			struct list_head *head = &drc_hashtbl[i].lru_head;
+
+			while (!list_empty(head)) {
+				rp = list_entry(head->next, struct svc_cacherep,
+						c_lru);
+				nfsd_reply_cache_free_locked(rp);
+			}
+		}
+		kfree(drc_hashtbl);
+		drc_hashtbl = NULL;
+	}
+
+	if (drc_slab) {
+		kmem_cache_destroy(drc_slab);
+		drc_slab = NULL;
+	}
 }
 
 /*
  * Move cache entry to end of LRU list
  */
 static void
-lru_put_end(struct svc_cacherep *rp)
+lru_put_end(struct nfsd_drc_bucket *b, struct svc_cacherep *rp)
 {
-	list_move_tail(&rp->c_lru, &lru_head);
+	list_move_tail(&rp->c_lru, &b->lru_head);
 }
 
 /*
- * Move a cache entry from one hash list to another
+ * Free expired entries from the head of a bucket, and entries beyond
+ * nfsd_reply_cache_max after it has been lowered.
  */
 static void
-hash_refile(struct svc_cacherep *rp)
+prune_bucket(struct nfsd_drc_bucket *b)
+{
+	struct svc_cacherep *rp, *tmp;
+
+	list_for_each_entry_safe(rp, tmp, &b->lru_head, c_lru) {
+		if (rp->c_state == RC_INPROG)
+			continue;
+		if (atomic_read(&num_drc_entries) <= nfsd_reply_cache_max &&
+		    time_before(jiffies, rp->c_timestamp + RC_EXPIRE))
+			break;
+		nfsd_reply_cache_free_locked(rp);
+	}
+}
+
+/*
+ * Checksum the start of the call arguments, which the decoder has not
+ * consumed yet, so that a new call reusing an old xid is not mistaken
+ * for a retransmission.
+ */
+static __wsum
+nfsd_cache_csum(struct svc_rqst *rqstp)
 {
-	hlist_del_init(&rp->c_hash);
-	hlist_add_head(&rp->c_hash, hash_list + REQHASH(rp->c_xid));
+	struct xdr_buf	*buf = &rqstp->rq_arg;
+	const unsigned char *p = buf->head[0].iov_base;
+	size_t		csum_len = min_t(size_t, buf->head[0].iov_len +
+						 buf->page_len, RC_CSUMLEN);
+	size_t		len = min_t(size_t, buf->head[0].iov_len, csum_len);
+	unsigned int	base, idx;
+	__wsum		csum;
+
+	csum = csum_partial(p, len, 0);
+	csum_len -= len;
+
+	idx = buf->page_base >> PAGE_SHIFT;
+	base = buf->page_base & ~PAGE_MASK;
+	while (csum_len) {
+		p = page_address(buf->pages[idx]) + base;
+		len = min_t(size_t, PAGE_SIZE - base, csum_len);
+		csum = csum_partial(p, len, csum);
+		csum_len -= len;
+		base = 0;
+		idx++;
+	}
+	return csum;
 }
 
 /*
  * Try to find an entry matching the current call in the cache. When none
- * is found, we grab the oldest unlocked entry off the LRU list.
- * Note that no operation within the loop may sleep.
+ * is found, a new entry is added, or the oldest idle entry of the bucket
+ * is reused once the cache has reached nfsd_reply_cache_max.  If there
+ * is neither, the call is simply not cached.
+ * Note that no operation within the locked section may sleep.
  */
 int
 nfsd_cache_lookup(struct svc_rqst *rqstp, int type)
 {
-	struct hlist_node	*hn;
-	struct hlist_head 	*rh;
-	struct svc_cacherep	*rp;
+	struct nfsd_drc_bucket	*b;
+	struct svc_cacherep	*rp, *new = NULL;
 	__be32			xid = rqstp->rq_xid;
 	u32			proto =  rqstp->rq_prot,
 				vers = rqstp->rq_vers,
 				proc = rqstp->rq_proc;
+	struct sockaddr_in	*sin = svc_addr_in(rqstp);
+	unsigned int		len = rqstp->rq_arg.len;
+	__wsum			csum;
 	unsigned long		age;
 	int rtn;
 
 	rqstp->rq_cacherep = NULL;
 	if (cache_disabled || type == RC_NOCACHE) {
-		nfsdstats.rcnocache++;
+		nfsd_drc_stats_inc(nocache);
 		return RC_DOIT;
 	}
 
-	spin_lock(&cache_lock);
+	csum = nfsd_cache_csum(rqstp);
+	b = nfsd_cache_bucket(xid, sin);
+
+	/*
+	 * Most non-idempotent calls are not retransmissions, so allocate
+	 * the new entry up front rather than under the bucket lock.
+	 */
+	if (atomic_read(&num_drc_entries) < nfsd_reply_cache_max)
+		new = kmem_cache_alloc(drc_slab, GFP_KERNEL);
+
+	spin_lock(&b->cache_lock);
 	rtn = RC_DOIT;
 
-	rh = &hash_list[REQHASH(xid)];
-	hlist_for_each_entry(rp, hn, rh, c_hash) {
+	list_for_each_entry(rp, &b->lru_head, c_lru) {
 		if (rp->c_state != RC_UNUSED &&
 		    xid == rp->c_xid && proc == rp->c_proc &&
 		    proto == rp->c_prot && vers == rp->c_vers &&
-		    time_before(jiffies, rp->c_timestamp + 120*HZ) &&
-		    memcmp((char*)&rqstp->rq_addr, (char*)&rp->c_addr, sizeof(rp->c_addr))==0) {
-			nfsdstats.rchits++;
+		    time_before(jiffies, rp->c_timestamp + RC_EXPIRE) &&
+		    memcmp((char*)sin, (char*)&rp->c_addr, sizeof(rp->c_addr))==0) {
+			if (csum != rp->c_csum || len != rp->c_len) {
+				nfsd_drc_stats_inc(payload_misses);
+				continue;
+			}
+			nfsd_drc_stats_inc(hits);
 			goto found_entry;
 		}
 	}
-	nfsdstats.rcmisses++;
-
-	/* This loop shouldn't take more than a few iterations normally */
-	{
-	int	safe = 0;
-	list_for_each_entry(rp, &lru_head, c_lru) {
-		if (rp->c_state != RC_INPROG)
-			break;
-		if (safe++ > CACHESIZE) {
-			printk("nfsd: loop in repcache LRU list\n");
-			cache_disabled = 1;
-			goto out;
-		}
-	}
-	}
 
-	/* This should not happen */
-	if (rp == NULL) {
-		static int	complaints;
-
-		printk(KERN_WARNING "nfsd: all repcache entries locked!\n");
-		if (++complaints > 5) {
-			printk(KERN_WARNING "nfsd: disabling repcache.\n");
-			cache_disabled = 1;
-		}
+	prune_bucket(b);
+
+	if (new) {
+		atomic_inc(&num_drc_entries);
+		rp = new;
+		new = NULL;
+		list_add_tail(&rp->c_lru, &b->lru_head);
+	} else {
+		/* at the limit: reuse the oldest idle entry of this bucket */
+		list_for_each_entry(rp, &b->lru_head, c_lru)
+			if (rp->c_state != RC_INPROG)
+				goto reuse;
+		nfsd_drc_stats_inc(nocache);
 		goto out;
+reuse:
+		if (rp->c_type == RC_REPLBUFF)
+			kfree(rp->c_replvec.iov_base);
+		lru_put_end(b, rp);
 	}
+	nfsd_drc_stats_inc(misses);
 
 	rqstp->rq_cacherep = rp;
 	rp->c_state = RC_INPROG;
 	rp->c_xid = xid;
 	rp->c_proc = proc;
-	memcpy(&rp->c_addr, svc_addr_in(rqstp), sizeof(rp->c_addr));
+	memcpy(&rp->c_addr, sin, sizeof(rp->c_addr));
 	rp->c_prot = proto;
 	rp->c_vers = vers;
+	rp->c_csum = csum;
+	rp->c_len = len;
 	rp->c_timestamp = jiffies;
-
-	hash_refile(rp);
-
-	/* release any buffer */
-	if (rp->c_type == RC_REPLBUFF) {
-		kfree(rp->c_replvec.iov_base);
-		rp->c_replvec.iov_base = NULL;
-	}
 	rp->c_type = RC_NOCACHE;
  out:
-	spin_unlock(&cache_lock);
+	spin_unlock(&b->cache_lock);
+	if (new)
+		kmem_cache_free(drc_slab, new);
 	return rtn;
 
 found_entry:
 	/* We found a matching entry which is either in progress or done. */
 	age = jiffies - rp->c_timestamp;
 	rp->c_timestamp = jiffies;
-	lru_put_end(rp);
+	lru_put_end(b, rp);
 
 	rtn = RC_DROPIT;
 	/* Request being processed or excessive rexmits */
@@ -230,7 +362,7 @@ found_entry:
 		break;
 	default:
 		printk(KERN_WARNING "nfsd: bad repcache type %d\n", rp->c_type);
-		rp->c_state = RC_UNUSED;
+		nfsd_reply_cache_free_locked(rp);
 	}
 
 	goto out;
@@ -255,6 +387,7 @@ found_entry:
 void
 nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, __be32 *statp)
 {
+	struct nfsd_drc_bucket *b;
 	struct svc_cacherep *rp;
 	struct kvec	*resv = &rqstp->rq_res.head[0], *cachv;
 	int		len;
@@ -262,14 +395,14 @@ nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, __be32 *statp)
 	if (!(rp = rqstp->rq_cacherep) || cache_disabled)
 		return;
 
+	b = nfsd_cache_bucket(rp->c_xid, &rp->c_addr);
+
 	len = resv->iov_len - ((char*)statp - (char*)resv->iov_base);
 	len >>= 2;
-	
+
 	/* Don't cache excessive amounts of data and XDR failures */
-	if (!statp || len > (256 >> 2)) {
-		rp->c_state = RC_UNUSED;
-		return;
-	}
+	if (!statp || len > (256 >> 2))
+		goto out_free;
 
 	switch (cachetype) {
 	case RC_REPLSTAT:
@@ -280,24 +413,25 @@ nfsd_cache_update(struct svc_rqst *rqstp, int cachetype, __be32 *statp)
 	case RC_REPLBUFF:
 		cachv = &rp->c_replvec;
 		cachv->iov_base = kmalloc(len << 2, GFP_KERNEL);
-		if (!cachv->iov_base) {
-			spin_lock(&cache_lock);
-			rp->c_state = RC_UNUSED;
-			spin_unlock(&cache_lock);
-			return;
-		}
+		if (!cachv->iov_base)
+			goto out_free;
 		cachv->iov_len = len << 2;
 		memcpy(cachv->iov_base, statp, len << 2);
 		break;
 	}
-	spin_lock(&cache_lock);
-	lru_put_end(rp);
+	spin_lock(&b->cache_lock);
+	lru_put_end(b, rp);
 	rp->c_secure = rqstp->rq_secure;
 	rp->c_type = cachetype;
 	rp->c_state = RC_DONE;
 	rp->c_timestamp = jiffies;
-	spin_unlock(&cache_lock);
+	spin_unlock(&b->cache_lock);
 	return;
+
+out_free:
+	spin_lock(&b->cache_lock);
+	nfsd_reply_cache_free_locked(rp);
+	spin_unlock(&b->cache_lock);
 }
 
 /*
@@ -319,3 +453,54 @@ nfsd_cache_append(struct svc_rqst *rqstp, struct kvec *data)
 	vec->iov_len += data->iov_len;
 	return 1;
 }
+
+/*
+ * Set the most entries the cache may hold, through the nfsd filesystem.
+ * Zero would silently turn the cache off, so it is refused.
+ */
+int
+nfsd_reply_cache_set_max(int entries)
+{
+	if (entries <= 0)
+		return -EINVAL;
+	nfsd_reply_cache_max = min_t(unsigned int, entries, RC_MAX_ENTRIES);
+	return 0;
+}
+
+/* Sum the counters of all cpus; racing updates may or may not be seen */
+void
+nfsd_reply_cache_counts(struct nfsd_drc_stats *sum)
+{
+	struct nfsd_drc_stats *s;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		s = &per_cpu(drc_stats, cpu);
+		sum->hits += s->hits;
+		sum->misses += s->misses;
+		sum->nocache += s->nocache;
+		sum->payload_misses += s->payload_misses;
+	}
+}
+
+/*
+ * Report the state of the cache for the reply_cache_stats file.
+ */
+int
+nfsd_reply_cache_stats(char *buf)
+{
+	struct nfsd_drc_stats st;
+
+	nfsd_reply_cache_counts(&st);
+	return sprintf(buf, "max entries:           %u\n"
+			    "num entries:           %d\n"
+			    "hash buckets:          %u\n"
+			    "hits:                  %u\n"
+			    "misses:                %u\n"
+			    "not cached:            %u\n"
+			    "payload misses:        %u\n",
+		       nfsd_reply_cache_max, atomic_read(&num_drc_entries),
+		       cache_disabled ? 0 : 1U << drc_hashbits,
+		       st.hits, st.misses, st.nocache, st.payload_misses);
+}
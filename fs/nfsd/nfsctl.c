@@ -35,6 +35,13 @@
 #include <linux/nfsd/cache.h>
 #include <linux/nfsd/xdr.h>
 #include <linux/nfsd/syscall.h>
+#ifdef CONFIG_SPNFS
+#include <linux/nfsd4_spnfs.h>
+#endif
+#ifdef CONFIG_PNFSD
+#include <linux/nfsd/state.h>
+#include <linux/nfsd/pnfsd.h>
+#endif
 
 #include <asm/uaccess.h>
 
@@ -57,6 +64,10 @@ enum {
 	NFSD_Versions,
 	NFSD_Ports,
 	NFSD_MaxBlkSize,
+	NFSD_ReplyCacheSize,
+	NFSD_ReplyCacheStats,
+	NFSD_MinThreads,
+	NFSD_MaxThreads,
 	/*
 	 * The below MUST come last.  Otherwise we leave a hole in nfsd_files[]
 	 * with !CONFIG_NFSD_V4 and simple_fill_super() goes oops
@@ -65,6 +76,13 @@ enum {
 	NFSD_Leasetime,
 	NFSD_RecoveryDir,
 #endif
+#ifdef CONFIG_SPNFS
+	NFSD_SpnfsLayoutCache,
+	NFSD_SpnfsUpcallTimeout,
+#endif
+#ifdef CONFIG_PNFSD
+	NFSD_PnfsDsStats,
+#endif
 };
 
 /*
@@ -83,10 +101,23 @@ static ssize_t write_pool_threads(struct file *file, char *buf, size_t size);
 static ssize_t write_versions(struct file *file, char *buf, size_t size);
 static ssize_t write_ports(struct file *file, char *buf, size_t size);
 static ssize_t write_maxblksize(struct file *file, char *buf, size_t size);
+static ssize_t write_reply_cache_size(struct file *file, char *buf, size_t size);
+static ssize_t read_reply_cache_stats(struct file *file, char *buf, size_t size);
+static ssize_t write_min_threads(struct file *file, char *buf, size_t size);
+static ssize_t write_max_threads(struct file *file, char *buf, size_t size);
 #ifdef CONFIG_NFSD_V4
 static ssize_t write_leasetime(struct file *file, char *buf, size_t size);
 static ssize_t write_recoverydir(struct file *file, char *buf, size_t size);
 #endif
+#ifdef CONFIG_SPNFS
+static ssize_t read_spnfs_layout_cache(struct file *file, char *buf,
+				       size_t size);
+static ssize_t write_spnfs_upcall_timeout(struct file *file, char *buf,
+					  size_t size);
+#endif
+#ifdef CONFIG_PNFSD
+static ssize_t read_pnfs_ds_stats(struct file *file, char *buf, size_t size);
+#endif
 
 static ssize_t (*write_op[])(struct file *, char *, size_t) = {
 	[NFSD_Svc] = write_svc,
@@ -102,10 +133,21 @@ static ssize_t (*write_op[])(struct file *, char *, size_t) = {
 	[NFSD_Versions] = write_versions,
 	[NFSD_Ports] = write_ports,
 	[NFSD_MaxBlkSize] = write_maxblksize,
+	[NFSD_ReplyCacheSize] = write_reply_cache_size,
+	[NFSD_ReplyCacheStats] = read_reply_cache_stats,
+	[NFSD_MinThreads] = write_min_threads,
+	[NFSD_MaxThreads] = write_max_threads,
 #ifdef CONFIG_NFSD_V4
 	[NFSD_Leasetime] = write_leasetime,
 	[NFSD_RecoveryDir] = write_recoverydir,
 #endif
+#ifdef CONFIG_SPNFS
+	[NFSD_SpnfsLayoutCache] = read_spnfs_layout_cache,
+	[NFSD_SpnfsUpcallTimeout] = write_spnfs_upcall_timeout,
+#endif
+#ifdef CONFIG_PNFSD
+	[NFSD_PnfsDsStats] = read_pnfs_ds_stats,
+#endif
 };
 
 static ssize_t nfsctl_transaction_write(struct file *file, const char __user *buf, size_t size, loff_t *pos)
@@ -636,6 +678,71 @@ static ssize_t write_maxblksize(struct file *file, char *buf, size_t size)
 	return sprintf(buf, "%d\n", nfsd_max_blksize);
 }
 
+static ssize_t write_reply_cache_size(struct file *file, char *buf, size_t size)
+{
+	/*
+	 * Set the most entries the reply cache may hold.  Lowering it
+	 * takes effect as old entries are looked at again.
+	 */
+	char *mesg = buf;
+	if (size > 0) {
+		int entries;
+		int rv = get_int(&mesg, &entries);
+		if (rv)
+			return rv;
+		rv = nfsd_reply_cache_set_max(entries);
+		if (rv)
+			return rv;
+	}
+	return sprintf(buf, "%u\n", nfsd_reply_cache_max);
+}
+
+static ssize_t read_reply_cache_stats(struct file *file, char *buf, size_t size)
+{
+	return nfsd_reply_cache_stats(buf);
+}
+
+static ssize_t write_thread_bound(char *buf, size_t size, unsigned int *bound)
+{
+	char *mesg = buf;
+	if (size > 0) {
+		int threads;
+		int rv = get_int(&mesg, &threads);
+		if (rv)
+			return rv;
+		if (threads < 0)
+			return -EINVAL;
+		*bound = threads;
+	}
+	return sprintf(buf, "%u\n", *bound);
+}
+
+static ssize_t write_min_threads(struct file *file, char *buf, size_t size)
+{
+	/*
+	 * Fewest threads the autoscaler leaves running, spread over
+	 * the pools; each pool keeps at least one.
+	 */
+	return write_thread_bound(buf, size, &nfsd_min_threads);
+}
+
+static ssize_t write_max_threads(struct file *file, char *buf, size_t size)
+{
+	/*
+	 * Most threads the autoscaler may start, spread over the pools;
+	 * 0 turns autoscaling off.  A pool's one thread is kept even
+	 * when that takes the total past this.
+	 */
+	ssize_t rv = write_thread_bound(buf, size, &nfsd_max_threads);
+
+	if (rv > 0 && size > 0) {
+		lock_kernel();
+		nfsd_autoscale_start();
+		unlock_kernel();
+	}
+	return rv;
+}
+
 #ifdef CONFIG_NFSD_V4
 extern time_t nfs4_leasetime(void);
 
@@ -680,6 +787,44 @@ static ssize_t write_recoverydir(struct file *file, char *buf, size_t size)
 }
 #endif
 
+#ifdef CONFIG_SPNFS
+static ssize_t read_spnfs_layout_cache(struct file *file, char *buf,
+				       size_t size)
+{
+	if (size > 0)
+		return -EINVAL;
+	return spnfs_layout_cache_stats(buf);
+}
+
+static ssize_t write_spnfs_upcall_timeout(struct file *file, char *buf,
+					  size_t size)
+{
+	/* seconds to wait for spnfsd before failing an upcall, 0 for ever */
+	char *mesg = buf;
+	int rv;
+
+	if (size > 0) {
+		int timeout;
+		rv = get_int(&mesg, &timeout);
+		if (rv)
+			return rv;
+		if (timeout < 0 || timeout > 3600)
+			return -EINVAL;
+		spnfs_upcall_timeout = timeout;
+	}
+	return sprintf(buf, "%u\n", spnfs_upcall_timeout);
+}
+#endif
+
+#ifdef CONFIG_PNFSD
+static ssize_t read_pnfs_ds_stats(struct file *file, char *buf, size_t size)
+{
+	if (size > 0)
+		return -EINVAL;
+	return nfs4_pnfs_ds_stats(buf);
+}
+#endif
+
 /*----------------------------------------------------------------------------*/
 /*
  *	populating the filesystem.
@@ -702,9 +847,20 @@ static int nfsd_fill_super(struct super_block * sb, void * data, int silent)
 		[NFSD_Versions] = {"versions", &transaction_ops, S_IWUSR|S_IRUSR},
 		[NFSD_Ports] = {"portlist", &transaction_ops, S_IWUSR|S_IRUGO},
 		[NFSD_MaxBlkSize] = {"max_block_size", &transaction_ops, S_IWUSR|S_IRUGO},
+		[NFSD_ReplyCacheSize] = {"reply_cache_size", &transaction_ops, S_IWUSR|S_IRUGO},
+		[NFSD_ReplyCacheStats] = {"reply_cache_stats", &transaction_ops, S_IRUGO},
+		[NFSD_MinThreads] = {"min_threads", &transaction_ops, S_IWUSR|S_IRUSR},
+		[NFSD_MaxThreads] = {"max_threads", &transaction_ops, S_IWUSR|S_IRUSR},
 #ifdef CONFIG_NFSD_V4
 		[NFSD_Leasetime] = {"nfsv4leasetime", &transaction_ops, S_IWUSR|S_IRUSR},
 		[NFSD_RecoveryDir] = {"nfsv4recoverydir", &transaction_ops, S_IWUSR|S_IRUSR},
+#endif
+#ifdef CONFIG_SPNFS
+		[NFSD_SpnfsLayoutCache] = {"spnfs_layout_cache", &transaction_ops, S_IRUGO},
+		[NFSD_SpnfsUpcallTimeout] = {"spnfs_upcall_timeout", &transaction_ops, S_IWUSR|S_IRUSR},
+#endif
+#ifdef CONFIG_PNFSD
+		[NFSD_PnfsDsStats] = {"pnfs_ds_stats", &transaction_ops, S_IRUGO},
 #endif
 		/* last one */ {""}
 	};
@@ -808,6 +964,7 @@ static void __exit exit_nfsd(void)
 	spnfs_init = NULL;
 #endif /* CONFIG_SPNFS */
 
+	nfsd_autoscale_shutdown();
 	nfsd_export_shutdown();
 	nfsd_reply_cache_shutdown();
 	remove_proc_entry("fs/nfs/exports", NULL);
@@ -21,6 +21,7 @@
 #include <linux/smp_lock.h>
 #include <linux/freezer.h>
 #include <linux/fs_struct.h>
+#include <linux/workqueue.h>
 
 #include <linux/sunrpc/types.h>
 #include <linux/sunrpc/stats.h>
@@ -160,6 +161,7 @@ static void nfsd_last_thread(struct svc_serv *serv)
 		lockd_down();
 	nfsd_serv = NULL;
 	nfsd_racache_shutdown();
+	nfsd_file_cache_shutdown();
 	nfs4_state_shutdown();
 
 	printk(KERN_WARNING "nfsd: last server has exited\n");
@@ -332,6 +334,9 @@ int nfsd_set_nrthreads(int n, int *nthreads)
 	return err;
 }
 
+static int nfsd_autoscale_enabled;
+static void nfsd_autoscale_stop(void);
+
 int
 nfsd_svc(unsigned short port, int nrservs)
 {
@@ -347,6 +352,9 @@ nfsd_svc(unsigned short port, int nrservs)
 	
 	/* Readahead param cache - will no-op if it already exists */
 	error =	nfsd_racache_init(2*nrservs);
+	if (error<0)
+		goto out;
+	error = nfsd_file_cache_init();
 	if (error<0)
 		goto out;
 	nfs4_state_start();
@@ -361,7 +369,15 @@ nfsd_svc(unsigned short port, int nrservs)
 	if (error)
 		goto failure;
 
+	/* an explicit 0 stops nfsd; keep the autoscaler from bringing
+	 * pools back up while the threads exit */
+	if (nrservs == 0)
+		nfsd_autoscale_stop();
 	error = svc_set_num_threads(nfsd_serv, NULL, nrservs);
+	if (!error && nrservs) {
+		nfsd_autoscale_enabled = 1;
+		nfsd_autoscale_start();
+	}
  failure:
 	svc_destroy(nfsd_serv);		/* Release server */
  out:
@@ -369,6 +385,108 @@ nfsd_svc(unsigned short port, int nrservs)
 	return error;
 }
 
+/*
+ * Thread count autoscaling.  Once a second each pool that had to queue
+ * transports for want of an idle thread grows by up to
+ * NFSD_AUTOSCALE_STEP threads, and a pool that has had idle threads at
+ * every sample for NFSD_AUTOSCALE_IDLE seconds loses one.  Pools stay
+ * between nfsd_min_threads and nfsd_max_threads, split evenly between
+ * them; autoscaling is off while nfsd_max_threads is 0, and from when
+ * nfsd is told to run 0 threads until it is started again.
+ *
+ * Every pool keeps at least one thread, and the floor wins over the
+ * ceiling: with fewer nfsd_max_threads than pools, or nfsd_min_threads
+ * above nfsd_max_threads, the total can exceed nfsd_max_threads.
+ */
+#define NFSD_AUTOSCALE_PERIOD	HZ
+#define NFSD_AUTOSCALE_STEP	8
+#define NFSD_AUTOSCALE_IDLE	30
+
+unsigned int			nfsd_min_threads;
+unsigned int			nfsd_max_threads;
+
+static void nfsd_autoscale(struct work_struct *);
+static DECLARE_DELAYED_WORK(nfsd_autoscale_work, nfsd_autoscale);
+
+static void
+nfsd_autoscale_pool(struct svc_pool *pool, int floor, int ceiling)
+{
+	unsigned int starved;
+	int idle, nr, target;
+
+	spin_lock_bh(&pool->sp_lock);
+	starved = pool->sp_starved;
+	pool->sp_starved = 0;
+	idle = !list_empty(&pool->sp_threads);
+	nr = pool->sp_nrthreads;
+	spin_unlock_bh(&pool->sp_lock);
+
+	target = nr;
+	if (starved) {
+		pool->sp_idle_periods = 0;
+		target = nr + min_t(unsigned int, starved, NFSD_AUTOSCALE_STEP);
+	} else if (!idle)
+		pool->sp_idle_periods = 0;
+	else if (++pool->sp_idle_periods >= NFSD_AUTOSCALE_IDLE) {
+		pool->sp_idle_periods = 0;
+		target = nr - 1;
+	}
+	target = min(max(target, floor), ceiling);
+
+	if (target != nr) {
+		dprintk("nfsd: pool %u threads %d -> %d\n",
+			pool->sp_id, nr, target);
+		svc_set_num_threads(nfsd_serv, pool, target);
+	}
+}
+
+static void
+nfsd_autoscale(struct work_struct *not_used)
+{
+	int i, npools, floor, ceiling;
+
+	lock_kernel();
+	/* nfsd_autoscale_start runs us again when these change */
+	if (nfsd_serv == NULL || !nfsd_max_threads || !nfsd_autoscale_enabled) {
+		unlock_kernel();
+		return;
+	}
+	svc_get(nfsd_serv);
+	npools = nfsd_serv->sv_nrpools;
+	floor = max_t(int, nfsd_min_threads / npools, 1);
+	ceiling = max_t(int, min_t(unsigned int, nfsd_max_threads,
+				   NFSD_MAXSERVS) / npools, floor);
+	for (i = 0; i < npools; i++)
+		nfsd_autoscale_pool(&nfsd_serv->sv_pools[i], floor, ceiling);
+	svc_destroy(nfsd_serv);
+	unlock_kernel();
+
+	schedule_delayed_work(&nfsd_autoscale_work, NFSD_AUTOSCALE_PERIOD);
+}
+
+/*
+ * Start autoscaling if it is enabled and nfsd is running.  The work
+ * stops rescheduling itself once either is no longer the case.
+ */
+void nfsd_autoscale_start(void)
+{
+	if (nfsd_max_threads && nfsd_autoscale_enabled)
+		schedule_delayed_work(&nfsd_autoscale_work,
+				      NFSD_AUTOSCALE_PERIOD);
+}
+
+/* Called with the BKL, which is released while we sleep on the work */
+static void nfsd_autoscale_stop(void)
+{
+	nfsd_autoscale_enabled = 0;
+	cancel_delayed_work_sync(&nfsd_autoscale_work);
+}
+
+void nfsd_autoscale_shutdown(void)
+{
+	cancel_delayed_work_sync(&nfsd_autoscale_work);
+}
+
 static inline void
 update_thread_usage(int busy_threads)
 {
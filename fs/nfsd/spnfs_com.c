@@ -47,6 +47,7 @@
 #include <linux/socket.h>
 #include <linux/in.h>
 #include <linux/sched.h>
+#include <linux/completion.h>
 
 #include <linux/sunrpc/clnt.h>
 #include <linux/workqueue.h>
@@ -62,14 +63,44 @@ static ssize_t   spnfs_pipe_upcall(struct file *, struct rpc_pipe_msg *,
 		     char __user *, size_t);
 static ssize_t   spnfs_pipe_downcall(struct file *, const char __user *,
 		     size_t);
+static void      spnfs_pipe_release(struct inode *);
 static void      spnfs_pipe_destroy_msg(struct rpc_pipe_msg *);
 
 static struct rpc_pipe_ops spnfs_upcall_ops = {
 	.upcall		= spnfs_pipe_upcall,
 	.downcall	= spnfs_pipe_downcall,
+	.release_pipe	= spnfs_pipe_release,
 	.destroy_msg	= spnfs_pipe_destroy_msg,
 };
 
+/*
+ * One outstanding upcall.  Each nfsd thread calling spnfs_upcall() owns
+ * its own request, so any number of them may be in flight to spnfsd at
+ * once; the downcall is matched back to its request by im_xid.
+ *
+ * An asynchronous upcall has no waiting thread.  Whoever finishes it
+ * runs ur_callback and frees it instead, from ur_work when that is a
+ * downcall, which holds the pipe's i_mutex.
+ */
+struct spnfs_upcall_req {
+	struct list_head	ur_hash;	/* on spnfs->spnfs_pending */
+	struct spnfs		*ur_spnfs;
+	struct rpc_pipe_msg	ur_pipemsg;
+	struct completion	ur_done;
+	int			ur_sent;	/* read by the daemon */
+	spnfs_upcall_done_t	ur_callback;	/* asynchronous upcalls only */
+	void			*ur_cbdata;
+	struct delayed_work	ur_timeout;
+	struct work_struct	ur_work;	/* runs ur_callback */
+	struct kvec		*ur_vec;	/* READ/WRITE data, or NULL */
+	int			ur_vlen;
+	size_t			ur_skip;	/* where in ur_vec it starts */
+	size_t			ur_datalen;
+	void			*ur_reply;	/* data after the reply */
+	size_t			ur_replylen;
+	struct spnfs_msg	ur_im;
+};
+
 /* evil global variable */
 struct spnfs *global_spnfs;
 /*
@@ -79,12 +110,16 @@ struct spnfs *global_spnfs;
  */
 static int spnfs_enabled_at_some_point;
 
+/* seconds before an unanswered upcall is failed, 0 to wait for ever */
+unsigned int spnfs_upcall_timeout = SPNFS_UPCALL_TIMEOUT;
+
 /* call this to start the ball rolling */
 /* code it like we're going to avoid the global variable in the future */
 int
 nfsd_spnfs_new(void)
 {
 	struct spnfs *spnfs;
+	int i;
 
 	if (global_spnfs != NULL)
 		return -EEXIST;
@@ -93,6 +128,10 @@ nfsd_spnfs_new(void)
 	if (spnfs == NULL)
 		return -ENOMEM;
 
+	spin_lock_init(&spnfs->spnfs_plock);
+	for (i = 0; i < SPNFS_XID_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&spnfs->spnfs_pending[i]);
+
 	snprintf(spnfs->spnfs_path, sizeof(spnfs->spnfs_path),
 	    "%s/spnfs", "/nfs");
 
@@ -104,9 +143,6 @@ nfsd_spnfs_new(void)
 	}
 
 	dput(spnfs->spnfs_dentry);
-	mutex_init(&spnfs->spnfs_lock);
-	mutex_init(&spnfs->spnfs_plock);
-	init_waitqueue_head(&spnfs->spnfs_wq);
 
 	global_spnfs = spnfs;
 	spnfs_enabled_at_some_point = 1;
@@ -123,8 +159,162 @@ nfsd_spnfs_delete(void)
 	if (!spnfs)
 		return;
 	rpc_unlink(spnfs->spnfs_dentry);
+	/* callbacks of the upcalls failed by the pipe teardown */
+	flush_scheduled_work();
 	global_spnfs = NULL;
 	kfree(spnfs);
+	/* a new daemon may hand out different layouts and devices */
+	spnfs_layout_cache_invalidate(NULL, 0);
+	spnfs_devinfo_cache_flush();
+}
+
+/*
+ * Find the request waiting on @xid and take it off the pending table.
+ * Once unhashed, the caller is the only one who may complete it.
+ * Called with spnfs_plock held.
+ */
+static struct spnfs_upcall_req *
+spnfs_claim_req(struct spnfs *spnfs, u32 xid)
+{
+	struct spnfs_upcall_req *req;
+
+	list_for_each_entry(req,
+	    &spnfs->spnfs_pending[xid & SPNFS_XID_HASH_MASK], ur_hash) {
+		if (req->ur_im.im_xid == xid) {
+			list_del_init(&req->ur_hash);
+			return req;
+		}
+	}
+	return NULL;
+}
+
+static void
+spnfs_callback_work(struct work_struct *work)
+{
+	struct spnfs_upcall_req *req = container_of(work,
+			struct spnfs_upcall_req, ur_work);
+
+	req->ur_callback(&req->ur_im, req->ur_reply, req->ur_replylen,
+			 req->ur_cbdata);
+	kfree(req->ur_reply);
+	kfree(req);
+}
+
+/*
+ * Hand a finished, unhashed request back to its owner: wake up the nfsd
+ * thread waiting on it or, for an asynchronous upcall, run the callback
+ * and free it.  The timeout work passes @from_timer so it doesn't wait
+ * for itself; it can run the callback directly, everybody else hands it
+ * to a work item so that no callback runs under the pipe's i_mutex.
+ */
+static void
+spnfs_finish_req(struct spnfs_upcall_req *req, int from_timer)
+{
+	struct spnfs *spnfs = req->ur_spnfs;
+
+	if (req->ur_callback == NULL) {
+		complete(&req->ur_done);
+		return;
+	}
+	if (!from_timer)
+		cancel_delayed_work_sync(&req->ur_timeout);
+	spin_lock(&spnfs->spnfs_plock);
+	spnfs->spnfs_nasync--;
+	spin_unlock(&spnfs->spnfs_plock);
+	if (from_timer)
+		spnfs_callback_work(&req->ur_work);
+	else
+		schedule_work(&req->ur_work);
+}
+
+/* Fail an unhashed request */
+static void
+spnfs_fail_req(struct spnfs_upcall_req *req)
+{
+	req->ur_im.im_status = SPNFS_STATUS_FAIL;
+	spnfs_finish_req(req, 0);
+}
+
+/*
+ * Take back a request spnfsd has not answered in time.  Returns 0 if it
+ * was unhashed and, if still queued, pulled off the pipe, so that the
+ * caller now owns it; -EBUSY if a downcall or pipe teardown is already
+ * finishing it; or -EAGAIN if spnfsd is in the middle of reading it.
+ */
+static int
+spnfs_abandon_req(struct spnfs_upcall_req *req)
+{
+	struct spnfs *spnfs = req->ur_spnfs;
+	int sent;
+
+	spin_lock(&spnfs->spnfs_plock);
+	if (list_empty(&req->ur_hash)) {
+		spin_unlock(&spnfs->spnfs_plock);
+		return -EBUSY;
+	}
+	sent = req->ur_sent;
+	if (sent)
+		list_del_init(&req->ur_hash);
+	spin_unlock(&spnfs->spnfs_plock);
+	if (sent)
+		return 0;
+
+	/* nothing can claim an unsent request once it is off the pipe */
+	if (rpc_cancel_upcall(spnfs->spnfs_dentry->d_inode, &req->ur_pipemsg))
+		return -EAGAIN;
+	spin_lock(&spnfs->spnfs_plock);
+	list_del_init(&req->ur_hash);
+	spin_unlock(&spnfs->spnfs_plock);
+	return 0;
+}
+
+static void
+spnfs_upcall_timeout_work(struct work_struct *work)
+{
+	struct spnfs_upcall_req *req = container_of(work,
+			struct spnfs_upcall_req, ur_timeout.work);
+	unsigned int timeout = spnfs_upcall_timeout;
+
+	switch (spnfs_abandon_req(req)) {
+	case 0:
+		dprintk("spnfs: upcall xid %u timed out\n", req->ur_im.im_xid);
+		req->ur_im.im_status = SPNFS_STATUS_FAIL;
+		spnfs_finish_req(req, 1);
+		break;
+	case -EAGAIN:
+		if (timeout)
+			schedule_delayed_work(&req->ur_timeout, timeout * HZ);
+		break;
+	}
+}
+
+/*
+ * Copy @len bytes between a user buffer and a kvec array, starting @skip
+ * bytes into the array.  This is how READ and WRITE data moves between
+ * the nfsd request pages and spnfsd without an intermediate buffer.
+ */
+static int
+spnfs_copy_vec(struct kvec *vec, int vlen, size_t skip, char __user *ubuf,
+    size_t len, int to_user)
+{
+	size_t n;
+	char *kbuf;
+
+	for (; len > 0 && vlen > 0; vec++, vlen--) {
+		if (skip >= vec->iov_len) {
+			skip -= vec->iov_len;
+			continue;
+		}
+		kbuf = (char *)vec->iov_base + skip;
+		n = min(vec->iov_len - skip, len);
+		if (to_user ? copy_to_user(ubuf, kbuf, n) :
+			      copy_from_user(kbuf, ubuf, n))
+			return -EFAULT;
+		ubuf += n;
+		len -= n;
+		skip = 0;
+	}
+	return len ? -EFAULT : 0;
 }
 
 /* RPC pipefs upcall/downcall routines */
@@ -135,132 +325,466 @@ static ssize_t
 spnfs_pipe_upcall(struct file *filp, struct rpc_pipe_msg *msg,
     char __user *dst, size_t buflen)
 {
-	char *data = (char *)msg->data + msg->copied;
-	ssize_t mlen = msg->len - msg->copied;
-	ssize_t left;
-
-	if (mlen > buflen)
-		mlen = buflen;
+	struct spnfs_upcall_req *req =
+		container_of(msg, struct spnfs_upcall_req, ur_pipemsg);
+	size_t hdrlen = sizeof(struct spnfs_msg);
+	ssize_t mlen = 0;
+	size_t n;
+
+	/* the fixed size message itself */
+	if (msg->copied < hdrlen) {
+		n = min(hdrlen - msg->copied, buflen);
+		if (copy_to_user(dst, (char *)msg->data + msg->copied, n))
+			goto efault;
+		msg->copied += n;
+		mlen += n;
+	}
 
-	left = copy_to_user(dst, data, mlen);
-	if (left < 0) {
-		msg->errno = left;
-		return left;
+	/* followed by any WRITE data, straight from the request pages */
+	n = min_t(size_t, msg->len - msg->copied, buflen - mlen);
+	if (n > 0) {
+		if (spnfs_copy_vec(req->ur_vec, req->ur_vlen,
+		    req->ur_skip + msg->copied - hdrlen, dst + mlen, n, 1))
+			goto efault;
+		msg->copied += n;
+		mlen += n;
 	}
-	mlen -= left;
-	msg->copied += mlen;
+
 	msg->errno = 0;
 	return mlen;
+efault:
+	msg->errno = -EFAULT;
+	return -EFAULT;
+}
+
+/* How many bytes may follow the reply to @req */
+static size_t
+spnfs_reply_maxdata(struct spnfs_upcall_req *req)
+{
+	switch (req->ur_im.im_type) {
+	case SPNFS_TYPE_READ:
+		return req->ur_datalen;
+	case SPNFS_TYPE_LAYOUTGET:
+	case SPNFS_TYPE_GETDEVICEINFO:
+	case SPNFS_TYPE_GETDEVICELIST:
+		return SPNFS_MAX_REPLY_DATA;
+	}
+	return 0;
 }
 
+/*
+ * rpc_pipe_write() holds the pipe's i_mutex across this call, so downcalls
+ * are serialized against each other and against destroy_msg.  Only the
+ * header is looked at up front; the result is copied straight into the
+ * matching request once it has been claimed.  A READ reply may be
+ * followed by up to the requested number of data bytes, which go to the
+ * request's pages; LAYOUTGET and GETDEVICEINFO replies by a stripe or
+ * device list, which is kept in a buffer of its own.
+ */
 static ssize_t
 spnfs_pipe_downcall(struct file *filp, const char __user *src, size_t mlen)
 {
 	struct rpc_inode *rpci = RPC_I(filp->f_dentry->d_inode);
 	struct spnfs *spnfs = (struct spnfs *)rpci->private;
-	struct spnfs_msg im_in, *im = &spnfs->spnfs_im;
-	int ret;
+	struct spnfs_msg __user *im_in = (struct spnfs_msg __user *)src;
+	struct spnfs_upcall_req *req;
+	unsigned char type, status;
+	size_t datalen;
+	u32 xid;
 
-	if (mlen != sizeof(im_in))
+	if (mlen < sizeof(struct spnfs_msg))
 		return (-ENOSPC);
+	datalen = mlen - sizeof(struct spnfs_msg);
 
-	if (copy_from_user(&im_in, src, mlen) != 0)
+	if (get_user(type, &im_in->im_type) ||
+	    get_user(status, &im_in->im_status) ||
+	    get_user(xid, &im_in->im_xid))
 		return (-EFAULT);
 
-	mutex_lock(&spnfs->spnfs_plock);
+	spin_lock(&spnfs->spnfs_plock);
+	req = spnfs_claim_req(spnfs, xid);
+	if (req && !req->ur_sent) {
+		/* the daemon can't answer what it hasn't read */
+		list_add(&req->ur_hash,
+		    &spnfs->spnfs_pending[xid & SPNFS_XID_HASH_MASK]);
+		req = NULL;
+	}
+	spin_unlock(&spnfs->spnfs_plock);
 
-	ret = mlen;
-	im->im_status = im_in.im_status;
-	/* If we got an error, terminate now, and wake up pending upcalls */
-	if (!(im_in.im_status & SPNFS_STATUS_SUCCESS)) {
-		wake_up(&spnfs->spnfs_wq);
-		goto out;
+	if (req == NULL) {
+		dprintk("spnfs: downcall for unknown xid %u\n", xid);
+		return -EINVAL;
 	}
 
-	ret = -EINVAL;
-	/* Did we match the current upcall? */
-	/* DMXXX: do not understand the comment above, from original code */
-	/* DMXXX: when do we _not_ match the current upcall? */
-	/* DMXXX: anyway, let's to a simplistic check */
-	if (im_in.im_type == im->im_type) {
-		/* copy the response into the spnfs struct */
-		memcpy(&im->im_res, &im_in.im_res, sizeof(im->im_res));
-		ret = mlen;
-	} else
+	if (type != req->ur_im.im_type) {
 		dprintk("spnfs: downcall type != upcall type\n");
+		spnfs_fail_req(req);
+		return -EINVAL;
+	}
 
+	if (datalen > spnfs_reply_maxdata(req)) {
+		dprintk("spnfs: downcall with %Zu unexpected bytes\n", datalen);
+		spnfs_fail_req(req);
+		return -ENOSPC;
+	}
 
-	wake_up(&spnfs->spnfs_wq);
-/* DMXXX handle rval processing */
-out:
-	mutex_unlock(&spnfs->spnfs_plock);
-	return ret;
+	/* If we got an error, terminate now, and wake up the upcall */
+	if (!(status & SPNFS_STATUS_SUCCESS)) {
+		req->ur_im.im_status = status;
+		spnfs_finish_req(req, 0);
+		return mlen;
+	}
+
+	/* copy the response into the waiting request */
+	if (copy_from_user(&req->ur_im.im_res, &im_in->im_res,
+	    sizeof(req->ur_im.im_res)) != 0)
+		goto efault;
+	if (type == SPNFS_TYPE_READ) {
+		if (spnfs_copy_vec(req->ur_vec, req->ur_vlen, req->ur_skip,
+		    (char __user *)(im_in + 1), datalen, 0))
+			goto efault;
+		req->ur_datalen = datalen;
+	} else if (datalen) {
+		req->ur_reply = kmalloc(datalen, GFP_KERNEL);
+		if (req->ur_reply == NULL) {
+			spnfs_fail_req(req);
+			return -ENOMEM;
+		}
+		if (copy_from_user(req->ur_reply, im_in + 1, datalen)) {
+			kfree(req->ur_reply);
+			req->ur_reply = NULL;
+			goto efault;
+		}
+		req->ur_replylen = datalen;
+	}
+	req->ur_im.im_status = status;
+	spnfs_finish_req(req, 0);
+	return mlen;
+efault:
+	spnfs_fail_req(req);
+	return -EFAULT;
 }
 
+/*
+ * Called once the message has left the pipe: either spnfsd read it
+ * (errno == 0) and we now wait for the downcall, or it was purged
+ * before anyone read it and the upcall has failed.
+ */
 static void
 spnfs_pipe_destroy_msg(struct rpc_pipe_msg *msg)
 {
-	struct spnfs_msg *im = msg->data;
-	struct spnfs *spnfs = container_of(im, struct spnfs, spnfs_im);
+	struct spnfs_upcall_req *req =
+		container_of(msg, struct spnfs_upcall_req, ur_pipemsg);
+	struct spnfs *spnfs = req->ur_spnfs;
+	int failed = 0;
 
+	spin_lock(&spnfs->spnfs_plock);
 	if (msg->errno >= 0)
+		req->ur_sent = 1;
+	else if (!list_empty(&req->ur_hash)) {
+		list_del_init(&req->ur_hash);
+		failed = 1;
+	}
+	spin_unlock(&spnfs->spnfs_plock);
+
+	if (failed)
+		spnfs_fail_req(req);
+}
+
+/*
+ * When the last reader goes away nobody is left to answer upcalls the
+ * daemon already read, so fail them rather than leave nfsd threads
+ * waiting forever.  Unread messages are purged by rpc_pipe itself.
+ */
+static void
+spnfs_pipe_release(struct inode *inode)
+{
+	struct rpc_inode *rpci = RPC_I(inode);
+	struct spnfs *spnfs = (struct spnfs *)rpci->private;
+	struct spnfs_upcall_req *req, *tmp;
+	LIST_HEAD(dead);
+	int i;
+
+	if (spnfs == NULL || rpci->nreaders != 0)
 		return;
-	mutex_lock(&spnfs->spnfs_plock);
-	im->im_status = SPNFS_STATUS_FAIL;  /* DMXXX */
-	wake_up(&spnfs->spnfs_wq);
-	mutex_unlock(&spnfs->spnfs_plock);
+
+	spin_lock(&spnfs->spnfs_plock);
+	for (i = 0; i < SPNFS_XID_HASH_SIZE; i++) {
+		list_for_each_entry_safe(req, tmp, &spnfs->spnfs_pending[i],
+		    ur_hash) {
+			if (req->ur_sent)
+				list_move(&req->ur_hash, &dead);
+		}
+	}
+	spin_unlock(&spnfs->spnfs_plock);
+
+	list_for_each_entry_safe(req, tmp, &dead, ur_hash) {
+		list_del_init(&req->ur_hash);
+		spnfs_fail_req(req);
+	}
 }
 
-/* generic upcall.  called by functions in spnfs_ops.c  */
-int
-spnfs_upcall(struct spnfs *spnfs, struct spnfs_msg *upmsg,
-		union spnfs_msg_res *res)
+static struct spnfs_upcall_req *
+spnfs_alloc_req(struct spnfs *spnfs, struct spnfs_msg *upmsg)
 {
-	struct rpc_pipe_msg msg;
-	struct spnfs_msg *im;
-	DECLARE_WAITQUEUE(wq, current);
-	int ret = -EIO;
+	struct spnfs_upcall_req *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (req == NULL)
+		return NULL;
+
+	memcpy(&req->ur_im, upmsg, sizeof(*upmsg));
+	req->ur_im.im_status = 0;
+	req->ur_spnfs = spnfs;
+	init_completion(&req->ur_done);
+	INIT_LIST_HEAD(&req->ur_hash);
+	INIT_DELAYED_WORK(&req->ur_timeout, spnfs_upcall_timeout_work);
+	INIT_WORK(&req->ur_work, spnfs_callback_work);
+	INIT_LIST_HEAD(&req->ur_pipemsg.list);
+	req->ur_pipemsg.data = &req->ur_im;
+	req->ur_pipemsg.len = sizeof(req->ur_im);
+	return req;
+}
+
+/*
+ * Give @req an xid, hash it and put it on the pipe for spnfsd.  The
+ * timeout of an asynchronous upcall is armed before the message is
+ * queued, as the reply may come back and free @req at any point after.
+ */
+static int
+spnfs_queue_req(struct spnfs *spnfs, struct spnfs_upcall_req *req)
+{
+	unsigned int timeout = spnfs_upcall_timeout;
 	int rval;
 
-	im = &spnfs->spnfs_im;
+	spin_lock(&spnfs->spnfs_plock);
+	req->ur_im.im_xid = spnfs->spnfs_xid++;
+	list_add(&req->ur_hash,
+	    &spnfs->spnfs_pending[req->ur_im.im_xid & SPNFS_XID_HASH_MASK]);
+	spin_unlock(&spnfs->spnfs_plock);
 
-	mutex_lock(&spnfs->spnfs_lock);
-	mutex_lock(&spnfs->spnfs_plock);
+	if (req->ur_callback && timeout)
+		schedule_delayed_work(&req->ur_timeout, timeout * HZ);
 
-	memset(im, 0, sizeof(*im));
-	memcpy(im, upmsg, sizeof(*upmsg));
+	rval = rpc_queue_upcall(spnfs->spnfs_dentry->d_inode, &req->ur_pipemsg);
+	if (rval < 0) {
+		spin_lock(&spnfs->spnfs_plock);
+		list_del_init(&req->ur_hash);
+		spin_unlock(&spnfs->spnfs_plock);
+		cancel_delayed_work_sync(&req->ur_timeout);
+	}
+	return rval;
+}
 
-	memset(&msg, 0, sizeof(msg));
-	msg.data = im;
-	msg.len = sizeof(*im);
+/*
+ * Wait for the reply to a queued synchronous request.  Returns 0 once it
+ * has been finished, or -ETIMEDOUT if spnfsd didn't answer within
+ * spnfs_upcall_timeout seconds and the request was taken back.
+ */
+static int
+spnfs_wait_req(struct spnfs_upcall_req *req)
+{
+	unsigned long timeout;
+
+	for (;;) {
+		timeout = spnfs_upcall_timeout * HZ;
+		if (timeout == 0)
+			timeout = MAX_SCHEDULE_TIMEOUT;
+		if (wait_for_completion_timeout(&req->ur_done, timeout))
+			return 0;
+		if (spnfs_abandon_req(req) == 0) {
+			printk(KERN_WARNING "spnfs: no reply from spnfsd to "
+			       "upcall type %u xid %u\n", req->ur_im.im_type,
+			       req->ur_im.im_xid);
+			return -ETIMEDOUT;
+		}
+	}
+}
 
-	add_wait_queue(&spnfs->spnfs_wq, &wq);
-	rval = rpc_queue_upcall(spnfs->spnfs_dentry->d_inode, &msg);
-	if (rval < 0) {
-		remove_wait_queue(&spnfs->spnfs_wq, &wq);
+/*
+ * Queue @upmsg to spnfsd and wait for the reply.  Each call gets its own
+ * request and xid, so concurrent nfsd threads do not wait on one another,
+ * only on spnfsd.  If spnfsd doesn't answer within spnfs_upcall_timeout
+ * seconds the upcall fails with -ETIMEDOUT.
+ *
+ * @vec/@vlen carry READ and WRITE data outside of the message: a WRITE
+ * sends *@lenp bytes of it after the message, a READ accepts up to *@lenp
+ * bytes after the reply and sets *@lenp to the number received.
+ *
+ * Any other data following the reply is returned in a buffer in *@replyp
+ * for the caller to kfree(), with its length in *@replylenp.
+ */
+static int
+__spnfs_upcall(struct spnfs *spnfs, struct spnfs_msg *upmsg,
+		union spnfs_msg_res *res, struct kvec *vec, int vlen,
+		size_t *lenp, void **replyp, size_t *replylenp)
+{
+	struct spnfs_upcall_req *req;
+	int ret = -EIO;
+
+	req = spnfs_alloc_req(spnfs, upmsg);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->ur_vec = vec;
+	req->ur_vlen = vlen;
+	req->ur_datalen = vec ? *lenp : 0;
+	if (upmsg->im_type == SPNFS_TYPE_WRITE)
+		req->ur_pipemsg.len += req->ur_datalen;
+
+	if (spnfs_queue_req(spnfs, req) < 0)
 		goto out;
-	}
 
-	set_current_state(TASK_UNINTERRUPTIBLE);
-	mutex_unlock(&spnfs->spnfs_plock);
-	schedule();
-	current->state = TASK_RUNNING;
-	remove_wait_queue(&spnfs->spnfs_wq, &wq);
-	mutex_lock(&spnfs->spnfs_plock);
+	ret = spnfs_wait_req(req);
+	if (ret)
+		goto out;
 
-	if (im->im_status & SPNFS_STATUS_SUCCESS) {
+	ret = -EIO;
+	if (req->ur_im.im_status & SPNFS_STATUS_SUCCESS) {
 		/* copy our result from the upcall */
-		memcpy(res, &im->im_res, sizeof(*res));
+		memcpy(res, &req->ur_im.im_res, sizeof(*res));
+		if (vec && upmsg->im_type == SPNFS_TYPE_READ)
+			*lenp = req->ur_datalen;
+		if (replyp) {
+			*replyp = req->ur_reply;
+			*replylenp = req->ur_replylen;
+			req->ur_reply = NULL;
+		}
 		ret = 0;
 	}
 
 out:
-	memset(im, 0, sizeof(*im));
-	mutex_unlock(&spnfs->spnfs_plock);
-	mutex_unlock(&spnfs->spnfs_lock);
+	kfree(req->ur_reply);
+	kfree(req);
 	return(ret);
 }
 
+/*
+ * Send several READ or WRITE upcalls for different parts of one request
+ * at once and wait for all of them, so that a multi-threaded spnfsd can
+ * work on them in parallel.  The data of @io[i] is io_len bytes starting
+ * io_skip bytes into @vec.  Each piece gets its own result in io_status
+ * (0 or a negative errno) and io_res; for a READ io_len is set to the
+ * number of bytes received.
+ */
+void
+spnfs_upcall_vec(struct spnfs *spnfs, struct spnfs_io *io, int nio,
+		struct kvec *vec, int vlen)
+{
+	struct spnfs_upcall_req *reqs[SPNFS_MAX_FANOUT];
+	struct spnfs_upcall_req *req;
+	int i;
+
+	BUG_ON(nio > SPNFS_MAX_FANOUT);
+	for (i = 0; i < nio; i++) {
+		reqs[i] = req = spnfs_alloc_req(spnfs, &io[i].io_msg);
+		if (req == NULL) {
+			io[i].io_status = -ENOMEM;
+			continue;
+		}
+		req->ur_vec = vec;
+		req->ur_vlen = vlen;
+		req->ur_skip = io[i].io_skip;
+		req->ur_datalen = io[i].io_len;
+		if (req->ur_im.im_type == SPNFS_TYPE_WRITE)
+			req->ur_pipemsg.len += req->ur_datalen;
+		if (spnfs_queue_req(spnfs, req) < 0) {
+			io[i].io_status = -EIO;
+			kfree(req);
+			reqs[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < nio; i++) {
+		req = reqs[i];
+		if (req == NULL)
+			continue;
+		io[i].io_status = spnfs_wait_req(req);
+		if (io[i].io_status == 0) {
+			if (req->ur_im.im_status & SPNFS_STATUS_SUCCESS) {
+				memcpy(&io[i].io_res, &req->ur_im.im_res,
+				       sizeof(io[i].io_res));
+				if (req->ur_im.im_type == SPNFS_TYPE_READ)
+					io[i].io_len = req->ur_datalen;
+			} else
+				io[i].io_status = -EIO;
+		}
+		kfree(req->ur_reply);
+		kfree(req);
+	}
+}
+
+/* generic upcall.  called by functions in spnfs_ops.c  */
+int
+spnfs_upcall(struct spnfs *spnfs, struct spnfs_msg *upmsg,
+		union spnfs_msg_res *res)
+{
+	return __spnfs_upcall(spnfs, upmsg, res, NULL, 0, NULL, NULL, NULL);
+}
+
+/* upcall carrying READ or WRITE data in @vec, see __spnfs_upcall() */
+int
+spnfs_upcall_data(struct spnfs *spnfs, struct spnfs_msg *upmsg,
+		union spnfs_msg_res *res, struct kvec *vec, int vlen,
+		size_t *lenp)
+{
+	return __spnfs_upcall(spnfs, upmsg, res, vec, vlen, lenp, NULL, NULL);
+}
+
+/* upcall whose reply may be followed by a list, see __spnfs_upcall() */
+int
+spnfs_upcall_reply(struct spnfs *spnfs, struct spnfs_msg *upmsg,
+		union spnfs_msg_res *res, void **replyp, size_t *replylenp)
+{
+	*replyp = NULL;
+	*replylenp = 0;
+	return __spnfs_upcall(spnfs, upmsg, res, NULL, 0, NULL,
+			      replyp, replylenp);
+}
+
+/*
+ * Queue @upmsg to spnfsd without waiting for the reply.  Once this
+ * returns 0, @done is called exactly once with the finished message,
+ * from whichever context finishes it: the downcall, pipe teardown or the
+ * upcall timeout.  It must not sleep for long.  Returns -EBUSY if too
+ * many asynchronous upcalls are already outstanding; the caller should
+ * then fall back to spnfs_upcall().
+ */
+int
+spnfs_upcall_async(struct spnfs *spnfs, struct spnfs_msg *upmsg,
+		spnfs_upcall_done_t done, void *data)
+{
+	struct spnfs_upcall_req *req;
+	int ret = -ENOMEM;
+
+	spin_lock(&spnfs->spnfs_plock);
+	if (spnfs->spnfs_nasync >= SPNFS_MAX_ASYNC_UPCALLS) {
+		spin_unlock(&spnfs->spnfs_plock);
+		return -EBUSY;
+	}
+	spnfs->spnfs_nasync++;
+	spin_unlock(&spnfs->spnfs_plock);
+
+	req = spnfs_alloc_req(spnfs, upmsg);
+	if (req == NULL)
+		goto out_dec;
+	req->ur_callback = done;
+	req->ur_cbdata = data;
+
+	ret = spnfs_queue_req(spnfs, req);
+	if (ret < 0) {
+		kfree(req);
+		goto out_dec;
+	}
+	return 0;
+
+out_dec:
+	spin_lock(&spnfs->spnfs_plock);
+	spnfs->spnfs_nasync--;
+	spin_unlock(&spnfs->spnfs_plock);
+	return ret;
+}
+
 /*
  * This is used to determine if the spnfsd daemon has been started at
  * least once since the system came up.  This is used to by the export
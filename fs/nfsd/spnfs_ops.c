@@ -39,6 +39,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/namei.h>
+#include <linux/hash.h>
 
 #include <linux/sunrpc/clnt.h>
 #include <linux/workqueue.h>
@@ -70,73 +71,359 @@ spnfs_layout_type(void)
 	return LAYOUT_NFSV4_FILES;
 }
 
+/*
+ * Layout cache.
+ *
+ * The stripe layout of a file practically never changes once spnfsd has
+ * created it, so the answer to a LAYOUTGET upcall is remembered here,
+ * keyed by superblock, inode number and generation.  Entries are dropped
+ * when the file is removed or truncated and when its layout is recalled.
+ */
+#define SPNFS_LAYOUT_HASH_BITS		8
+#define SPNFS_LAYOUT_HASH_SIZE		(1 << SPNFS_LAYOUT_HASH_BITS)
+#define SPNFS_LAYOUT_CACHE_MAX		4096
+
+struct spnfs_layout_entry {
+	struct hlist_node		le_hash;
+	struct list_head		le_lru;
+	atomic_t			le_count;
+	struct super_block		*le_sb;
+	unsigned long			le_ino;
+	u32				le_generation;
+	struct pnfs_filelayout_layout	le_layout;
+	struct knfsd_fh			le_fh[0];
+};
+
+static struct hlist_head spnfs_layout_hashtbl[SPNFS_LAYOUT_HASH_SIZE];
+static LIST_HEAD(spnfs_layout_lru);
+static DEFINE_SPINLOCK(spnfs_layout_lock);
+static unsigned int spnfs_layout_count;
+/* bumped by every invalidation, so racing upcalls don't insert stale data */
+static unsigned long spnfs_layout_gen;
+static unsigned long spnfs_layout_hits, spnfs_layout_misses;
+
+static inline unsigned int
+spnfs_layout_hashval(struct super_block *sb, unsigned long ino)
+{
+	return hash_long((unsigned long)sb ^ ino, SPNFS_LAYOUT_HASH_BITS);
+}
+
+static void
+spnfs_layout_put(struct spnfs_layout_entry *le)
+{
+	if (atomic_dec_and_test(&le->le_count))
+		kfree(le);
+}
+
+/* Called with spnfs_layout_lock held */
+static void
+spnfs_layout_unhash(struct spnfs_layout_entry *le)
+{
+	hlist_del(&le->le_hash);
+	list_del(&le->le_lru);
+	spnfs_layout_count--;
+	spnfs_layout_put(le);
+}
+
+static struct spnfs_layout_entry *
+spnfs_layout_cache_lookup(struct inode *inode)
+{
+	struct spnfs_layout_entry *le;
+	struct hlist_node *pos;
+	unsigned int hashval = spnfs_layout_hashval(inode->i_sb, inode->i_ino);
+
+	spin_lock(&spnfs_layout_lock);
+	hlist_for_each_entry(le, pos, &spnfs_layout_hashtbl[hashval], le_hash) {
+		if (le->le_sb == inode->i_sb && le->le_ino == inode->i_ino &&
+		    le->le_generation == inode->i_generation) {
+			atomic_inc(&le->le_count);
+			list_move(&le->le_lru, &spnfs_layout_lru);
+			spnfs_layout_hits++;
+			spin_unlock(&spnfs_layout_lock);
+			return le;
+		}
+	}
+	spnfs_layout_misses++;
+	spin_unlock(&spnfs_layout_lock);
+	return NULL;
+}
+
+/*
+ * Build a cache entry from a LAYOUTGET reply and the file handle list
+ * that followed it and, unless the cache was invalidated since @gen was
+ * sampled, insert it.  Returns the entry with a reference held for the
+ * caller.
+ */
+static struct spnfs_layout_entry *
+spnfs_layout_cache_insert(struct super_block *sb, unsigned long ino,
+			  u32 generation, struct spnfs_msg_layoutget_res *res,
+			  char *list, size_t listlen, unsigned long gen)
+{
+	struct spnfs_layout_entry *le, *old;
+	struct pnfs_filelayout_layout *flp;
+	struct spnfs_filelayout_list *fl;
+	struct hlist_node *pos;
+	unsigned int hashval = spnfs_layout_hashval(sb, ino);
+	size_t off;
+	int i;
+
+	if (res->stripe_count == 0 ||
+	    res->stripe_count > listlen / sizeof(struct spnfs_filelayout_list))
+		return ERR_PTR(-EIO);
+
+	le = kmalloc(sizeof(*le) + res->stripe_count * sizeof(struct knfsd_fh),
+		     GFP_KERNEL);
+	if (le == NULL)
+		return ERR_PTR(-ENOMEM);
+	atomic_set(&le->le_count, 1);
+	le->le_sb = sb;
+	le->le_ino = ino;
+	le->le_generation = generation;
+
+	flp = &le->le_layout;
+	flp->device_id.pnfs_devid = res->devid;
+	flp->lg_layout_type = 1; /* XXX */
+	flp->lg_stripe_type = res->stripe_type;
+	flp->lg_commit_through_mds = 0;
+	flp->lg_stripe_unit =  res->stripe_size;
+	flp->lg_first_stripe_index = 0;
+	flp->lg_pattern_offset = 0;
+	flp->lg_fh_length = res->stripe_count;
+	flp->lg_fh_list = le->le_fh;
+	for (i = 0, off = 0; i < flp->lg_fh_length; i++) {
+		if (listlen - off < sizeof(*fl))
+			goto out_bad;
+		fl = (struct spnfs_filelayout_list *)(list + off);
+		off += sizeof(*fl);
+		if (fl->fh_len > sizeof(le->le_fh[i].fh_base) ||
+		    listlen - off < fl->fh_len)
+			goto out_bad;
+		le->le_fh[i].fh_size = fl->fh_len;
+		memcpy(&le->le_fh[i].fh_base, fl->fh_val, fl->fh_len);
+		off += min_t(size_t, (fl->fh_len + 3) & ~3, listlen - off);
+	}
+
+	spin_lock(&spnfs_layout_lock);
+	if (gen != spnfs_layout_gen)
+		goto out_unlock;
+	hlist_for_each_entry(old, pos, &spnfs_layout_hashtbl[hashval], le_hash) {
+		if (old->le_sb == le->le_sb && old->le_ino == le->le_ino &&
+		    old->le_generation == le->le_generation) {
+			spnfs_layout_unhash(old);
+			break;
+		}
+	}
+	if (spnfs_layout_count >= SPNFS_LAYOUT_CACHE_MAX)
+		spnfs_layout_unhash(list_entry(spnfs_layout_lru.prev,
+					struct spnfs_layout_entry, le_lru));
+	atomic_inc(&le->le_count);
+	hlist_add_head(&le->le_hash, &spnfs_layout_hashtbl[hashval]);
+	list_add(&le->le_lru, &spnfs_layout_lru);
+	spnfs_layout_count++;
+out_unlock:
+	spin_unlock(&spnfs_layout_lock);
+	return le;
+out_bad:
+	dprintk("%s: bad file handle list from spnfsd\n", __func__);
+	kfree(le);
+	return ERR_PTR(-EIO);
+}
+
+/*
+ * Forget the cached layout of @ino on @sb.  If @ino is 0, forget those of
+ * every file on @sb, or on any filesystem if @sb is NULL as well.
+ */
+void
+spnfs_layout_cache_invalidate(struct super_block *sb, unsigned long ino)
+{
+	struct spnfs_layout_entry *le, *next;
+	struct hlist_node *pos, *tmp;
+	unsigned int hashval;
+
+	spin_lock(&spnfs_layout_lock);
+	spnfs_layout_gen++;
+	if (ino == 0) {
+		list_for_each_entry_safe(le, next, &spnfs_layout_lru, le_lru) {
+			if (sb == NULL || le->le_sb == sb)
+				spnfs_layout_unhash(le);
+		}
+	} else {
+		hashval = spnfs_layout_hashval(sb, ino);
+		hlist_for_each_entry_safe(le, pos, tmp,
+				&spnfs_layout_hashtbl[hashval], le_hash) {
+			if (le->le_sb == sb && le->le_ino == ino)
+				spnfs_layout_unhash(le);
+		}
+	}
+	spin_unlock(&spnfs_layout_lock);
+}
+
+/*
+ * Stripe unit of the cached layout of @inode, or 0 if none is cached.  Only
+ * used to decide where to split READs and WRITEs through the MDS, so a
+ * layout left over from an earlier generation of the inode does no harm.
+ */
+static u64
+spnfs_layout_stripe_unit(struct inode *inode)
+{
+	struct spnfs_layout_entry *le;
+	struct hlist_node *pos;
+	unsigned int hashval = spnfs_layout_hashval(inode->i_sb, inode->i_ino);
+	u64 unit = 0;
+
+	spin_lock(&spnfs_layout_lock);
+	hlist_for_each_entry(le, pos, &spnfs_layout_hashtbl[hashval], le_hash) {
+		if (le->le_sb == inode->i_sb && le->le_ino == inode->i_ino) {
+			unit = le->le_layout.lg_stripe_unit;
+			break;
+		}
+	}
+	spin_unlock(&spnfs_layout_lock);
+	return unit;
+}
+
+int
+spnfs_layout_cache_stats(char *buf)
+{
+	int len;
+
+	spin_lock(&spnfs_layout_lock);
+	len = sprintf(buf, "entries %u\nhits %lu\nmisses %lu\n",
+		      spnfs_layout_count, spnfs_layout_hits,
+		      spnfs_layout_misses);
+	spin_unlock(&spnfs_layout_lock);
+	return len;
+}
+
+/*
+ * Deferred upcalls.
+ *
+ * A LAYOUTGET or GETDEVICEINFO that misses its cache needn't hold an nfsd
+ * thread while spnfsd works on it.  The request is deferred instead, the
+ * reply goes into the cache when it arrives, and the request is then
+ * revisited and finds its answer there.  nfsd only offers to defer when
+ * running the compound again is harmless, and never on the revisit;
+ * otherwise, or should the cache have been invalidated meanwhile, an
+ * ordinary upcall is made.
+ */
+struct spnfs_deferred {
+	struct cache_deferred_req	*sd_dreq;
+	unsigned long			sd_gen;		/* cache generation */
+	struct super_block		*sd_sb;		/* LAYOUTGET */
+	unsigned long			sd_ino;
+	u32				sd_generation;
+	u64				sd_devid;	/* GETDEVICEINFO */
+	pnfs_encodedev_t		sd_func;
+};
+
+/*
+ * Defer the current request and send @im to spnfsd in the background;
+ * @done gets @sd once the reply is in.  Returns -EAGAIN if the request
+ * was deferred.  Otherwise @sd has been freed and the caller should make
+ * the upcall itself.
+ */
+static int
+spnfs_defer_upcall(struct cache_req *creq, struct spnfs_msg *im,
+		   spnfs_upcall_done_t done, struct spnfs_deferred *sd)
+{
+	sd->sd_dreq = creq->defer(creq);
+	if (sd->sd_dreq == NULL)
+		goto out_free;
+	if (spnfs_upcall_async(global_spnfs, im, done, sd) != 0) {
+		sd->sd_dreq->revisit(sd->sd_dreq, 1);
+		goto out_free;
+	}
+	return -EAGAIN;
+out_free:
+	kfree(sd);
+	return 0;
+}
+
+static void
+spnfs_layoutget_done(struct spnfs_msg *im, void *list, size_t listlen,
+		     void *data)
+{
+	struct spnfs_deferred *sd = data;
+	struct spnfs_layout_entry *le;
+
+	if ((im->im_status & SPNFS_STATUS_SUCCESS) &&
+	    im->im_res.layoutget_res.status == 0) {
+		le = spnfs_layout_cache_insert(sd->sd_sb, sd->sd_ino,
+				sd->sd_generation, &im->im_res.layoutget_res,
+				list, listlen, sd->sd_gen);
+		if (!IS_ERR(le))
+			spnfs_layout_put(le);
+	}
+	sd->sd_dreq->revisit(sd->sd_dreq, 0);
+	kfree(sd);
+}
+
 int
 spnfs_layoutget(struct inode *inode, struct pnfs_layoutget_arg *lgp)
 {
 	struct spnfs *spnfs = global_spnfs; /* keep up the pretence */
 	struct spnfs_msg im;
 	union spnfs_msg_res res;
-	struct pnfs_filelayout_layout *flp = NULL;
-	int status = 0, i;
+	struct spnfs_layout_entry *le;
+	struct spnfs_deferred *sd;
+	struct pnfs_filelayout_layout fl;
+	void *list;
+	size_t listlen;
+	unsigned long gen;
+	int status = 0;
+
+	le = spnfs_layout_cache_lookup(inode);
+	if (le)
+		goto encode;
+
+	spin_lock(&spnfs_layout_lock);
+	gen = spnfs_layout_gen;
+	spin_unlock(&spnfs_layout_lock);
 
 	im.im_type = SPNFS_TYPE_LAYOUTGET;
 	im.im_args.layoutget_args.inode = inode->i_ino;
 
+	if (lgp->creq) {
+		sd = kmalloc(sizeof(*sd), GFP_KERNEL);
+		if (sd) {
+			sd->sd_gen = gen;
+			sd->sd_sb = inode->i_sb;
+			sd->sd_ino = inode->i_ino;
+			sd->sd_generation = inode->i_generation;
+			if (spnfs_defer_upcall(lgp->creq, &im,
+			    spnfs_layoutget_done, sd) == -EAGAIN)
+				return -EAGAIN;
+		}
+	}
+
 	/* call function to queue the msg for upcall */
-	if (spnfs_upcall(spnfs, &im, &res) != 0) {
+	if (spnfs_upcall_reply(spnfs, &im, &res, &list, &listlen) != 0) {
 		dprintk("failed spnfs upcall: layoutget\n");
-		status = -EIO;
-		goto layoutget_cleanup;
+		return -EIO;
 	}
 	status = res.layoutget_res.status;
+	if (status == 0)
+		le = spnfs_layout_cache_insert(inode->i_sb, inode->i_ino,
+					       inode->i_generation,
+					       &res.layoutget_res, list,
+					       listlen, gen);
+	kfree(list);
 	if (status != 0)
-		goto layoutget_cleanup;
+		return status;
+	if (IS_ERR(le))
+		return PTR_ERR(le);
 
+encode:
 	lgp->return_on_close = 0;
 	lgp->seg.length = NFS4_LENGTH_EOF;
 
-	flp = kmalloc(sizeof(struct pnfs_filelayout_layout), GFP_KERNEL);
-	if (flp == NULL) {
-		status = -ENOMEM;
-		goto layoutget_cleanup;
-	}
-	flp->device_id.pnfs_fsid = lgp->fsid;
-	flp->device_id.pnfs_devid = res.layoutget_res.devid;
-	flp->lg_layout_type = 1; /* XXX */
-	flp->lg_stripe_type = res.layoutget_res.stripe_type;
-	flp->lg_commit_through_mds = 0;
-	flp->lg_stripe_unit =  res.layoutget_res.stripe_size;
-	flp->lg_first_stripe_index = 0;
-	flp->lg_pattern_offset = 0;
-	flp->lg_fh_length = res.layoutget_res.stripe_count;
-
-	flp->lg_fh_list = kmalloc(flp->lg_fh_length * sizeof(struct knfsd_fh),
-				  GFP_KERNEL);
-	if (flp->lg_fh_list == NULL) {
-		status = -ENOMEM;
-		goto layoutget_cleanup;
-	}
-	/*
-	 * FIX: Doing an extra copy here.  Should group res.flist's fh_len
-	 * and fh_val into a knfsd_fh structure.
-	 */
-	for (i = 0; i < flp->lg_fh_length; i++) {
-		flp->lg_fh_list[i].fh_size = res.layoutget_res.flist[i].fh_len;
-		memcpy(&flp->lg_fh_list[i].fh_base,
-		       res.layoutget_res.flist[i].fh_val,
-		       res.layoutget_res.flist[i].fh_len);
-	}
+	fl = le->le_layout;
+	fl.device_id.pnfs_fsid = lgp->fsid;
 
 	/* encode the layoutget body */
-	status = lgp->func(&lgp->xdr, flp);
-
-layoutget_cleanup:
-	if (flp) {
-		if (flp->lg_fh_list)
-			kfree(flp->lg_fh_list);
-		kfree(flp);
-	}
+	status = lgp->func(&lgp->xdr, &fl);
 
+	spnfs_layout_put(le);
 	return status;
 }
 
@@ -183,34 +470,219 @@ spnfs_getdeviceiter(struct super_block *sb, struct pnfs_deviter_arg *iter)
 	return status;
 }
 
+/*
+ * Fetch up to iter->maxnum device ids with a single upcall.  A spnfsd
+ * that doesn't know GETDEVICELIST fails it, and the list is then built
+ * one GETDEVICEITER upcall at a time as before.
+ */
 int
-spnfs_getdeviceinfo(struct super_block *sb, struct pnfs_devinfo_arg *info)
+spnfs_getdevicelist(struct super_block *sb, struct pnfs_devlist_arg *arg)
 {
-	struct spnfs *spnfs = global_spnfs;
+	struct spnfs *spnfs = global_spnfs;   /* XXX keep up the pretence */
 	struct spnfs_msg im;
 	union spnfs_msg_res res;
+	struct spnfs_msg_getdevicelist_res *dlres = &res.getdevicelist_res;
+	struct pnfs_deviter_arg iter;
+	void *list;
+	size_t listlen;
+	int status;
+
+	arg->count = 0;
+	arg->eof = 0;
+	if (arg->maxnum == 0)
+		return 0;
+
+	im.im_type = SPNFS_TYPE_GETDEVICELIST;
+	im.im_args.getdevicelist_args.cookie = arg->cookie;
+	im.im_args.getdevicelist_args.verf = arg->verf;
+	im.im_args.getdevicelist_args.maxcount = min_t(u32, arg->maxnum,
+				SPNFS_MAX_REPLY_DATA / sizeof(u64));
+
+	status = spnfs_upcall_reply(spnfs, &im, &res, &list, &listlen);
+	if (status != 0)
+		goto iterate;
+	status = dlres->status;
+	if (status == 0) {
+		if (dlres->count > im.im_args.getdevicelist_args.maxcount ||
+		    listlen < dlres->count * sizeof(u64)) {
+			dprintk("%s: bad device list from spnfsd\n", __func__);
+			status = -EIO;
+		} else {
+			memcpy(arg->devids, list, dlres->count * sizeof(u64));
+			arg->count = dlres->count;
+			arg->cookie = dlres->cookie;
+			arg->verf = dlres->verf;
+			arg->eof = dlres->eof;
+		}
+	}
+	kfree(list);
+	return status;
+
+iterate:
+	dprintk("%s: upcall failed (%d), using GETDEVICEITER\n",
+		__func__, status);
+	iter.type = arg->type;
+	iter.cookie = arg->cookie;
+	iter.verf = arg->verf;
+	iter.eof = 0;
+	while (arg->count < arg->maxnum) {
+		status = spnfs_getdeviceiter(sb, &iter);
+		if (status)
+			return status;
+		if (iter.eof)
+			break;
+		arg->devids[arg->count++] = iter.devid;
+	}
+	arg->cookie = iter.cookie;
+	arg->verf = iter.verf;
+	arg->eof = iter.eof;
+	return 0;
+}
+
+/*
+ * GETDEVICEINFO cache.
+ *
+ * Device lists are effectively static, so the XDR encoded device address
+ * body is kept per devid and copied straight into each reply.  An entry
+ * is dropped when a device notification goes out for its devid.
+ */
+#define SPNFS_DEVINFO_HASH_BITS		4
+#define SPNFS_DEVINFO_HASH_SIZE		(1 << SPNFS_DEVINFO_HASH_BITS)
+
+struct spnfs_devinfo_entry {
+	struct hlist_node	de_hash;
+	atomic_t		de_count;
+	u64			de_devid;
+	pnfs_encodedev_t	de_func;	/* encoder that produced de_xdr */
+	u32			de_notify_types;
+	u32			de_len;		/* bytes of de_xdr in use */
+	u32			de_xdr[0];
+};
+
+static struct hlist_head spnfs_devinfo_hashtbl[SPNFS_DEVINFO_HASH_SIZE];
+static DEFINE_SPINLOCK(spnfs_devinfo_lock);
+static unsigned long spnfs_devinfo_gen;
+
+static inline unsigned int
+spnfs_devinfo_hashval(u64 devid)
+{
+	return hash_long((unsigned long)devid, SPNFS_DEVINFO_HASH_BITS);
+}
+
+static void
+spnfs_devinfo_put(struct spnfs_devinfo_entry *de)
+{
+	if (atomic_dec_and_test(&de->de_count))
+		kfree(de);
+}
+
+/* Called with spnfs_devinfo_lock held */
+static struct spnfs_devinfo_entry *
+spnfs_devinfo_cache_lookup_locked(u64 devid, pnfs_encodedev_t func)
+{
+	struct spnfs_devinfo_entry *de;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(de, pos,
+	    &spnfs_devinfo_hashtbl[spnfs_devinfo_hashval(devid)], de_hash) {
+		if (de->de_devid == devid && de->de_func == func)
+			return de;
+	}
+	return NULL;
+}
+
+static struct spnfs_devinfo_entry *
+spnfs_devinfo_cache_lookup(u64 devid, pnfs_encodedev_t func)
+{
+	struct spnfs_devinfo_entry *de;
+
+	spin_lock(&spnfs_devinfo_lock);
+	de = spnfs_devinfo_cache_lookup_locked(devid, func);
+	if (de)
+		atomic_inc(&de->de_count);
+	spin_unlock(&spnfs_devinfo_lock);
+	return de;
+}
+
+/* Add @de unless the cache was invalidated since @gen was sampled */
+static void
+spnfs_devinfo_cache_insert(struct spnfs_devinfo_entry *de, unsigned long gen)
+{
+	spin_lock(&spnfs_devinfo_lock);
+	if (gen == spnfs_devinfo_gen &&
+	    !spnfs_devinfo_cache_lookup_locked(de->de_devid, de->de_func)) {
+		atomic_inc(&de->de_count);
+		hlist_add_head(&de->de_hash,
+		    &spnfs_devinfo_hashtbl[spnfs_devinfo_hashval(de->de_devid)]);
+	}
+	spin_unlock(&spnfs_devinfo_lock);
+}
+
+static void
+__spnfs_devinfo_cache_invalidate(u64 devid, int all)
+{
+	struct spnfs_devinfo_entry *de;
+	struct hlist_node *pos, *next;
+	int i;
+
+	spin_lock(&spnfs_devinfo_lock);
+	spnfs_devinfo_gen++;
+	for (i = 0; i < SPNFS_DEVINFO_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(de, pos, next,
+		    &spnfs_devinfo_hashtbl[i], de_hash) {
+			if (all || de->de_devid == devid) {
+				hlist_del(&de->de_hash);
+				spnfs_devinfo_put(de);
+			}
+		}
+	}
+	spin_unlock(&spnfs_devinfo_lock);
+}
+
+/* Forget the encoded device info of @devid */
+void
+spnfs_devinfo_cache_invalidate(u64 devid)
+{
+	__spnfs_devinfo_cache_invalidate(devid, 0);
+}
+
+/* Forget the encoded device info of every device */
+void
+spnfs_devinfo_cache_flush(void)
+{
+	__spnfs_devinfo_cache_invalidate(0, 1);
+}
+
+/*
+ * Encode the address body of the device in a GETDEVICEINFO reply, whose
+ * data servers are in @dslist, with @func.  Returns a new, unhashed cache
+ * entry holding the encoded bytes.  The body is encoded into a scratch
+ * page first, since nfsd4_encode_getdevinfo never offers more than
+ * PAGE_SIZE, and the entry is sized to what the encoder wrote.
+ */
+static struct spnfs_devinfo_entry *
+spnfs_devinfo_build(u64 devid, pnfs_encodedev_t func,
+		    struct spnfs_msg_getdeviceinfo_res *res,
+		    struct spnfs_data_server *dslist, size_t listlen)
+{
 	struct spnfs_device *dev;
+	struct spnfs_devinfo_entry *de = NULL;
 	struct pnfs_filelayout_device *fldev = NULL;
 	struct pnfs_filelayout_multipath *mp = NULL;
 	struct pnfs_filelayout_devaddr *fldap = NULL;
+	struct pnfs_xdr_info xdr;
+	u32 *buf = NULL;
 	int status = 0, i, len;
 
-	im.im_type = SPNFS_TYPE_GETDEVICEINFO;
-	/* XXX FIX: figure out what to do about fsid */
-	im.im_args.getdeviceinfo_args.devid = info->devid.pnfs_devid;
+	status = res->status;
+	if (status != 0)
+		goto getdeviceinfo_out;
 
-	/* call function to queue the msg for upcall */
-	status = spnfs_upcall(spnfs, &im, &res);
-	if (status != 0) {
-		dprintk("%s spnfs upcall failure: %d\n", __func__, status);
+	dev = &res->devinfo;
+	if (dev->dscount < 0 || dev->dscount > listlen / sizeof(*dslist)) {
 		status = -EIO;
 		goto getdeviceinfo_out;
 	}
-	status = res.getdeviceinfo_res.status;
-	if (status != 0)
-		goto getdeviceinfo_out;
-
-	dev = &res.getdeviceinfo_res.devinfo;
 
 	/* Fill in the device data, i.e., nfs4_1_file_layout_ds_addr4 */
 	fldev = kmalloc(sizeof(struct pnfs_filelayout_device), GFP_KERNEL);
@@ -244,7 +716,7 @@ spnfs_getdeviceinfo(struct super_block *sb, struct pnfs_devinfo_arg *info)
 	 *
 	 */
 	fldev->fl_device_list =
-		kmalloc(fldev->fl_device_length *
+		kzalloc(fldev->fl_device_length *
 			sizeof(struct pnfs_filelayout_multipath),
 			GFP_KERNEL);
 	if (fldev->fl_device_list == NULL) {
@@ -255,7 +727,7 @@ spnfs_getdeviceinfo(struct super_block *sb, struct pnfs_devinfo_arg *info)
 		mp = &fldev->fl_device_list[i];
 		mp->fl_multipath_length = 1;
 		mp->fl_multipath_list =
-			kmalloc(sizeof(struct pnfs_filelayout_devaddr),
+			kzalloc(sizeof(struct pnfs_filelayout_devaddr),
 				GFP_KERNEL);
 		if (mp->fl_multipath_list == NULL) {
 			status = -ENOMEM;
@@ -266,42 +738,65 @@ spnfs_getdeviceinfo(struct super_block *sb, struct pnfs_devinfo_arg *info)
 		/*
 		 * Copy the netid into the device address, for example: "tcp"
 		 */
-		len = strlen(dev->dslist[i].netid);
+		len = strnlen(dslist[i].netid, sizeof(dslist[i].netid));
 		fldap->r_netid.data = kmalloc(len, GFP_KERNEL);
 		if (fldap->r_netid.data == NULL) {
 			status = -ENOMEM;
 			goto getdeviceinfo_out;
 		}
-		memcpy(fldap->r_netid.data, dev->dslist[i].netid, len);
+		memcpy(fldap->r_netid.data, dslist[i].netid, len);
 		fldap->r_netid.len = len;
 
 		/*
 		 * Copy the network address into the device address,
 		 * for example: "10.35.9.16.08.01"
 		 */
-		len = strlen(dev->dslist[i].addr);
+		len = strnlen(dslist[i].addr, sizeof(dslist[i].addr));
 		fldap->r_addr.data = kmalloc(len, GFP_KERNEL);
 		if (fldap->r_addr.data == NULL) {
 			status = -ENOMEM;
 			goto getdeviceinfo_out;
 		}
-		memcpy(fldap->r_addr.data, dev->dslist[i].addr, len);
+		memcpy(fldap->r_addr.data, dslist[i].addr, len);
 		fldap->r_addr.len = len;
 	}
 
-	/* XXX FIX: this should go through the userspace daemon */
-	info->notify_types = 0;
+	buf = (u32 *)__get_free_page(GFP_KERNEL);
+	if (buf == NULL) {
+		status = -ENOMEM;
+		goto getdeviceinfo_out;
+	}
+	xdr.p = buf;
+	xdr.end = buf + (PAGE_SIZE >> 2);
+	xdr.maxcount = PAGE_SIZE;
+	xdr.bytes_written = 0;
+	status = func(&xdr, fldev);
+	if (status)
+		goto getdeviceinfo_out;
 
-	/* encode the device data */
-	status = info->func(&info->xdr, fldev);
+	de = kmalloc(sizeof(*de) + xdr.bytes_written, GFP_KERNEL);
+	if (de == NULL) {
+		status = -ENOMEM;
+		goto getdeviceinfo_out;
+	}
+	atomic_set(&de->de_count, 1);
+	de->de_devid = devid;
+	de->de_func = func;
+	/* XXX FIX: this should go through the userspace daemon */
+	de->de_notify_types = 0;
+	memcpy(de->de_xdr, buf, xdr.bytes_written);
+	de->de_len = xdr.bytes_written;
 
 getdeviceinfo_out:
+	free_page((unsigned long)buf);
 	if (fldev) {
 		kfree(fldev->fl_stripeindices_list);
 		if (fldev->fl_device_list) {
 			for (i = 0; i < fldev->fl_device_length; i++) {
 				fldap =
 				    fldev->fl_device_list[i].fl_multipath_list;
+				if (fldap == NULL)
+					continue;
 				kfree(fldap->r_netid.data);
 				kfree(fldap->r_addr.data);
 				kfree(fldap);
@@ -310,7 +805,94 @@ getdeviceinfo_out:
 		}
 		kfree(fldev);
 	}
+	if (status) {
+		kfree(de);
+		return ERR_PTR(status);
+	}
+	return de;
+}
+
+static void
+spnfs_getdeviceinfo_done(struct spnfs_msg *im, void *list, size_t listlen,
+			 void *data)
+{
+	struct spnfs_deferred *sd = data;
+	struct spnfs_devinfo_entry *de;
+
+	if (im->im_status & SPNFS_STATUS_SUCCESS) {
+		de = spnfs_devinfo_build(sd->sd_devid, sd->sd_func,
+					 &im->im_res.getdeviceinfo_res,
+					 list, listlen);
+		if (!IS_ERR(de)) {
+			spnfs_devinfo_cache_insert(de, sd->sd_gen);
+			spnfs_devinfo_put(de);
+		}
+	}
+	sd->sd_dreq->revisit(sd->sd_dreq, 0);
+	kfree(sd);
+}
+
+int
+spnfs_getdeviceinfo(struct super_block *sb, struct pnfs_devinfo_arg *info)
+{
+	struct spnfs *spnfs = global_spnfs;
+	struct spnfs_msg im;
+	union spnfs_msg_res res;
+	struct spnfs_devinfo_entry *de;
+	struct spnfs_deferred *sd;
+	void *list;
+	size_t listlen;
+	unsigned long gen;
+	int status = 0;
+
+	de = spnfs_devinfo_cache_lookup(info->devid.pnfs_devid, info->func);
+	if (de == NULL) {
+		spin_lock(&spnfs_devinfo_lock);
+		gen = spnfs_devinfo_gen;
+		spin_unlock(&spnfs_devinfo_lock);
+
+		im.im_type = SPNFS_TYPE_GETDEVICEINFO;
+		/* XXX FIX: figure out what to do about fsid */
+		im.im_args.getdeviceinfo_args.devid = info->devid.pnfs_devid;
+
+		if (info->creq) {
+			sd = kmalloc(sizeof(*sd), GFP_KERNEL);
+			if (sd) {
+				sd->sd_gen = gen;
+				sd->sd_devid = info->devid.pnfs_devid;
+				sd->sd_func = info->func;
+				if (spnfs_defer_upcall(info->creq, &im,
+				    spnfs_getdeviceinfo_done, sd) == -EAGAIN)
+					return -EAGAIN;
+			}
+		}
+
+		/* call function to queue the msg for upcall */
+		status = spnfs_upcall_reply(spnfs, &im, &res, &list, &listlen);
+		if (status != 0) {
+			dprintk("%s spnfs upcall failure: %d\n",
+				__func__, status);
+			return -EIO;
+		}
+		de = spnfs_devinfo_build(info->devid.pnfs_devid, info->func,
+					 &res.getdeviceinfo_res, list, listlen);
+		kfree(list);
+		if (IS_ERR(de))
+			return PTR_ERR(de);
+		spnfs_devinfo_cache_insert(de, gen);
+	}
 
+	info->xdr.bytes_written = 0;
+	if (de->de_len > info->xdr.maxcount ||
+	    info->xdr.p + XDR_QUADLEN(de->de_len) > info->xdr.end) {
+		status = -ETOOSMALL;
+		goto out;
+	}
+	memcpy(info->xdr.p, de->de_xdr, XDR_QUADLEN(de->de_len) << 2);
+	info->xdr.bytes_written = de->de_len;
+	info->notify_types = de->de_notify_types;
+out:
+	spnfs_devinfo_put(de);
 	return status;
 }
 
@@ -335,6 +917,8 @@ spnfs_open(struct inode *inode, void *p)
 	im.im_args.open_args.create = poa->op_create;
 	im.im_args.open_args.createmode = poa->op_createmode;
 	im.im_args.open_args.truncate = poa->op_truncate;
+	if (poa->op_truncate)
+		spnfs_layout_cache_invalidate(inode->i_sb, inode->i_ino);
 
 	/* call function to queue the msg for upcall */
 	status = spnfs_upcall(spnfs, &im, &res);
@@ -400,13 +984,15 @@ spnfs_create(void)
  * Returns 0 on success otherwise error code
  */
 int
-spnfs_remove(unsigned long ino)
+spnfs_remove(struct super_block *sb, unsigned long ino)
 {
 	struct spnfs *spnfs = global_spnfs; /* keep up the pretence */
 	struct spnfs_msg im;
 	union spnfs_msg_res res;
 	int status = 0;
 
+	spnfs_layout_cache_invalidate(sb, ino);
+
 	im.im_type = SPNFS_TYPE_REMOVE;
 	im.im_args.remove_args.inode = ino;
 
@@ -423,156 +1009,168 @@ remove_out:
 	return status;
 }
 
-int
-spnfs_read_one(unsigned long ino, loff_t offset, size_t len, char *buf)
+/*
+ * Cut the @todo bytes at @offset, whose data starts @skip bytes into the
+ * request's rq_vec, into at most SPNFS_MAX_FANOUT upcalls of at most
+ * SPNFS_MAX_IO bytes that don't cross a stripe unit boundary, so each
+ * goes to a single data server.  Returns the number of pieces.
+ */
+static int
+spnfs_split_io(struct spnfs_io *io, unsigned char type, unsigned long ino,
+		loff_t offset, size_t skip, size_t todo, u64 unit)
 {
-	struct spnfs *spnfs = global_spnfs; /* keep up the pretence */
-	struct spnfs_msg im;
-	union spnfs_msg_res res;
-	int status = 0;
-	unsigned long todo = len;
-	unsigned long bytecount = 0;
-
-	im.im_type = SPNFS_TYPE_READ;
-	im.im_args.read_args.inode = ino;
-	while (todo > 0) {
-		im.im_args.read_args.offset = offset;
-		if (todo > SPNFS_MAX_IO)
-			im.im_args.read_args.len = SPNFS_MAX_IO;
-		else
-			im.im_args.read_args.len = todo;
-		/* call function to queue the msg for upcall */
-		status = spnfs_upcall(spnfs, &im, &res);
-		if (status != 0) {
-			dprintk("%s spnfs upcall failure: %d\n",
-				__func__, status);
-			status = -EIO;
-			goto read_out;
-		}
-		/* status < 0 => error, status > 0 => bytes moved */
-		status = res.read_res.status;
-		if (status < 0) {
-			dprintk("%s spnfs read failure: %d\n",
-				__func__, status);
-			status = -EIO;
-			goto read_out;
+	size_t len;
+	u64 pos;
+	int n;
+
+	/* do_div() wants a 32 bit divisor */
+	if (unit > UINT_MAX)
+		unit = 0;
+
+	for (n = 0; todo > 0 && n < SPNFS_MAX_FANOUT; n++) {
+		len = min_t(size_t, todo, SPNFS_MAX_IO);
+		if (unit) {
+			pos = offset;
+			len = min_t(u64, len, unit - do_div(pos, (u32)unit));
 		}
-		/* status == 0, maybe eof.  not making forward progress */
-		if (status == 0) {
-			status = bytecount;
-			goto read_out;
+		memset(&io[n], 0, sizeof(io[n]));
+		io[n].io_msg.im_type = type;
+		if (type == SPNFS_TYPE_READ) {
+			io[n].io_msg.im_args.read_args.inode = ino;
+			io[n].io_msg.im_args.read_args.offset = offset;
+			io[n].io_msg.im_args.read_args.len = len;
+		} else {
+			io[n].io_msg.im_args.write_args.inode = ino;
+			io[n].io_msg.im_args.write_args.offset = offset;
+			io[n].io_msg.im_args.write_args.len = len;
 		}
-		/* status = number of bytes successfully i/o'd */
-		memcpy(buf, res.read_res.data, status);
-		buf += status;
-		offset += status;
-		bytecount += status;
-		todo -= status;
+		io[n].io_skip = skip;
+		io[n].io_len = len;
+		offset += len;
+		skip += len;
+		todo -= len;
 	}
-	status = bytecount;
-
-read_out:
-	return status;
+	return n;
 }
 
+/*
+ * READ through the MDS.  The data is written by spnfsd directly into the
+ * reply pages described by rq_vec.  The READ is split on stripe unit
+ * boundaries when the file's layout is known, and the pieces are sent to
+ * spnfsd together so that they are fetched from the data servers in
+ * parallel.  A short piece ends the READ.
+ */
 int
-spnfs_read(unsigned long ino, loff_t offset, unsigned long *lenp, int vlen,
+spnfs_read(struct inode *inode, loff_t offset, unsigned long *lenp, int vlen,
 		struct svc_rqst *rqstp)
 {
-	int vnum, err, bytecount = 0;
-	size_t iolen;
+	struct spnfs *spnfs = global_spnfs; /* keep up the pretence */
+	struct kvec *vec = rqstp->rq_vec;
+	struct spnfs_io *io;
+	unsigned long todo = 0;
+	unsigned long bytecount = 0;
+	u64 unit = spnfs_layout_stripe_unit(inode);
+	int i, n, status;
 
-	for (vnum = 0 ; vnum < vlen ; vnum++) {
-		iolen = rqstp->rq_vec[vnum].iov_len;
-		err = spnfs_read_one(ino, offset + bytecount, iolen,
-				(char *)rqstp->rq_vec[vnum].iov_base);
-		if (err < 0)
-			return -EIO;
-		if (err < iolen) {
-			bytecount += err;
-			goto out;
+	for (i = 0; i < vlen; i++)
+		todo += vec[i].iov_len;
+
+	io = kmalloc(SPNFS_MAX_FANOUT * sizeof(*io), GFP_KERNEL);
+	if (io == NULL)
+		return -ENOMEM;
+
+	while (todo > 0) {
+		n = spnfs_split_io(io, SPNFS_TYPE_READ, inode->i_ino,
+				   offset + bytecount, bytecount, todo, unit);
+		spnfs_upcall_vec(spnfs, io, n, vec, vlen);
+		for (i = 0; i < n; i++) {
+			if (io[i].io_status != 0) {
+				dprintk("%s spnfs upcall failure: %d\n",
+					__func__, io[i].io_status);
+				goto out_err;
+			}
+			/* status < 0 => error, status > 0 => bytes moved */
+			status = io[i].io_res.read_res.status;
+			if (status < 0 || (status > 0 && status != io[i].io_len)) {
+				dprintk("%s spnfs read failure: %d\n",
+					__func__, status);
+				goto out_err;
+			}
+			bytecount += status;
+			todo -= status;
+			/* short read, maybe eof */
+			if (status < io[i].io_msg.im_args.read_args.len)
+				goto out;
 		}
-		bytecount += rqstp->rq_vec[vnum].iov_len;
 	}
-
 out:
+	kfree(io);
 	*lenp = bytecount;
 	return 0;
+out_err:
+	kfree(io);
+	return -EIO;
 }
 
+/*
+ * WRITE through the MDS.  The data is handed to spnfsd straight from the
+ * request pages described by rq_vec, split and sent in parallel like a
+ * READ.  The rest of a piece spnfsd wrote only part of is sent again.
+ */
 int
-spnfs_write_one(unsigned long ino, loff_t offset, size_t len, char *buf)
+spnfs_write(struct inode *inode, loff_t offset, size_t len, int vlen,
+		struct svc_rqst *rqstp)
 {
 	struct spnfs *spnfs = global_spnfs; /* keep up the pretence */
-	struct spnfs_msg im;
-	union spnfs_msg_res res;
-	int status = 0;
+	struct kvec *vec = rqstp->rq_vec;
+	struct spnfs_io *io, *p;
 	size_t todo = len;
 	unsigned long bytecount = 0;
+	u64 unit = spnfs_layout_stripe_unit(inode);
+	int i, n, status;
 
-	im.im_type = SPNFS_TYPE_WRITE;
-	im.im_args.write_args.inode = ino;
-	while (todo > 0) {
-		im.im_args.write_args.offset = offset;
-		if (todo > SPNFS_MAX_IO)
-			im.im_args.write_args.len = SPNFS_MAX_IO;
-		else
-			im.im_args.write_args.len = todo;
-		memcpy(im.im_args.write_args.data, buf,
-			im.im_args.write_args.len);
-		/* call function to queue the msg for upcall */
-		status = spnfs_upcall(spnfs, &im, &res);
-		if (status != 0) {
-			dprintk("%s spnfs upcall failure: %d\n",
-				__func__, status);
-			status = -EIO;
-			goto write_out;
-		}
-		/* status < 0 => error, status > 0 => bytes moved */
-		status = res.write_res.status;
-		if (status < 0) {
-			dprintk("%s spnfs write failure: %d\n",
-				__func__, status);
-			status = -EIO;
-			goto write_out;
-		}
-		/* status == 0.  not making forward progress */
-		if (status == 0) {
-			dprintk("spnfs write no forward progress\n");
-			status = bytecount;
-			goto write_out;
-		}
-		/* status = number of bytes successfully i/o'd */
-		buf += status;
-		offset += status;
-		bytecount += status;
-		todo -= status;
-	}
-	status = bytecount;
-
-write_out:
-	return status;
-}
+	io = kmalloc(SPNFS_MAX_FANOUT * sizeof(*io), GFP_KERNEL);
+	if (io == NULL)
+		return -ENOMEM;
 
-int
-spnfs_write(unsigned long ino, loff_t offset, size_t len, int vlen,
-		struct svc_rqst *rqstp)
-{
-	int vnum, err, bytecount = 0;
-	size_t iolen;
-
-	for (vnum = 0 ; vnum < vlen ; vnum++) {
-		iolen = rqstp->rq_vec[vnum].iov_len;
-		err = spnfs_write_one(ino, offset + bytecount, iolen,
-				(char *)rqstp->rq_vec[vnum].iov_base);
-		if (err != iolen) {
-			dprintk("err=%d expected %Zd\n", err, len);
-			return -EIO;
+	while (todo > 0) {
+		n = spnfs_split_io(io, SPNFS_TYPE_WRITE, inode->i_ino,
+				   offset + bytecount, bytecount, todo, unit);
+		spnfs_upcall_vec(spnfs, io, n, vec, vlen);
+		for (i = 0; i < n; i++) {
+			p = &io[i];
+			for (;;) {
+				if (p->io_status != 0) {
+					dprintk("%s spnfs upcall failure: %d\n",
+						__func__, p->io_status);
+					goto out_err;
+				}
+				/* status < 0 => error, status > 0 => bytes moved */
+				status = p->io_res.write_res.status;
+				if (status <= 0 || status > p->io_len) {
+					dprintk("%s spnfs write failure: %d\n",
+						__func__, status);
+					goto out_err;
+				}
+				bytecount += status;
+				todo -= status;
+				if (status == p->io_len)
+					break;
+				p->io_msg.im_args.write_args.offset += status;
+				p->io_msg.im_args.write_args.len -= status;
+				p->io_skip += status;
+				p->io_len -= status;
+				spnfs_upcall_vec(spnfs, p, 1, vec, vlen);
+			}
 		}
-		bytecount += rqstp->rq_vec[vnum].iov_len;
 	}
 
+	kfree(io);
 	return 0;
+out_err:
+	dprintk("err=%lu expected %Zd\n", bytecount, len);
+	kfree(io);
+	return -EIO;
 }
 
 int
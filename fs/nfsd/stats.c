@@ -33,6 +33,7 @@
 #include <linux/sunrpc/svc.h>
 #include <linux/sunrpc/stats.h>
 #include <linux/nfsd/nfsd.h>
+#include <linux/nfsd/cache.h>
 #include <linux/nfsd/stats.h>
 
 struct nfsd_stats	nfsdstats;
@@ -42,12 +43,14 @@ struct svc_stat		nfsd_svcstats = {
 
 static int nfsd_proc_show(struct seq_file *seq, void *v)
 {
+	struct nfsd_drc_stats rc;
 	int i;
 
+	nfsd_reply_cache_counts(&rc);
 	seq_printf(seq, "rc %u %u %u\nfh %u %u %u %u %u\nio %u %u\n",
-		      nfsdstats.rchits,
-		      nfsdstats.rcmisses,
-		      nfsdstats.rcnocache,
+		      rc.hits,
+		      rc.misses,
+		      rc.nocache,
 		      nfsdstats.fh_stale,
 		      nfsdstats.fh_lookup,
 		      nfsdstats.fh_anon,
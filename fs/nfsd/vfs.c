@@ -56,6 +56,11 @@
 #include <linux/nfsd4_spnfs.h>
 #endif /* CONFIG_NFSD_V4 */
 #include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/swap.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 
@@ -66,11 +71,12 @@
  * This is a cache of readahead params that help us choose the proper
  * readahead strategy. Initially, we set all readahead parameters to 0
  * and let the VFS handle things.
- * If you increase the number of cached files very much, you'll need to
- * add a hash table here.
+ * The cache is sized from memory so that many files can be streamed at
+ * once without evicting each other's readahead state.  Each hash bucket
+ * keeps its entries in LRU order, most recently used first.
  */
 struct raparms {
-	struct raparms		*p_next;
+	struct list_head	p_lru;
 	unsigned int		p_count;
 	ino_t			p_ino;
 	dev_t			p_dev;
@@ -80,15 +86,18 @@ struct raparms {
 };
 
 struct raparm_hbucket {
-	struct raparms		*pb_head;
+	struct list_head	pb_lru;
 	spinlock_t		pb_lock;
 } ____cacheline_aligned_in_smp;
 
 static struct raparms *		raparml;
-#define RAPARM_HASH_BITS	4
-#define RAPARM_HASH_SIZE	(1<<RAPARM_HASH_BITS)
-#define RAPARM_HASH_MASK	(RAPARM_HASH_SIZE-1)
-static struct raparm_hbucket	raparm_hash[RAPARM_HASH_SIZE];
+/* entries per bucket the hash table is sized for */
+#define RAPARM_BUCKET_DEPTH	4
+/* readahead entries per MB of low memory, and an upper bound */
+#define RAPARM_PER_MB		4
+#define RAPARM_MAX_ENTRIES	32768
+static unsigned int		raparm_hash_bits;
+static struct raparm_hbucket *	raparm_hash;
 
 /* 
  * Called from nfsd_lookup and encode_dirent. Check if we have crossed 
@@ -395,6 +404,11 @@ nfsd_setattr(struct svc_rqst *rqstp, struct svc_fh *fhp, struct iattr *iap,
 	}
 	if (size_change)
 		put_write_access(inode);
+#if defined(CONFIG_SPNFS)
+	/* spnfs: the stripes change with the size, drop the cached layout */
+	if (size_change && !err && spnfs_enabled())
+		spnfs_layout_cache_invalidate(inode->i_sb, inode->i_ino);
+#endif /* CONFIG_SPNFS */
 	if (!err)
 		if (EX_ISSYNC(fhp->fh_export))
 			write_inode_now(inode, 1);
@@ -661,17 +675,14 @@ nfsd_access(struct svc_rqst *rqstp, struct svc_fh *fhp, u32 *access, u32 *suppor
 
 
 /*
- * Open an existing file or directory.
- * The access argument indicates the type of open (read/write/lock)
- * N.B. After this call fhp needs an fh_put
+ * Check that an existing file or directory may be opened for the given
+ * access, and break any conflicting leases.
  */
-__be32
-nfsd_open(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
-			int access, struct file **filp)
+static __be32
+nfsd_open_verify(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
+			int access)
 {
-	struct dentry	*dentry;
 	struct inode	*inode;
-	int		flags = O_RDONLY|O_LARGEFILE;
 	__be32		err;
 	int		host_err;
 
@@ -684,8 +695,7 @@ nfsd_open(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
 	if (err)
 		goto out;
 
-	dentry = fhp->fh_dentry;
-	inode = dentry->d_inode;
+	inode = fhp->fh_dentry->d_inode;
 
 	/* Disallow write access to files with the append-only bit set
 	 * or any access when mandatory locking enabled
@@ -711,8 +721,17 @@ nfsd_open(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
 	host_err = break_lease(inode, O_NONBLOCK | ((access & MAY_WRITE) ? FMODE_WRITE : 0));
 	if (host_err == -EWOULDBLOCK)
 		host_err = -ETIMEDOUT;
-	if (host_err) /* NOMEM or WOULDBLOCK */
-		goto out_nfserr;
+	/* NOMEM or WOULDBLOCK */
+	err = nfserrno(host_err);
+out:
+	return err;
+}
+
+static __be32
+__nfsd_open(struct svc_fh *fhp, int access, struct file **filp)
+{
+	struct dentry	*dentry = fhp->fh_dentry;
+	int		flags = O_RDONLY|O_LARGEFILE;
 
 	if (access & MAY_WRITE) {
 		if (access & MAY_READ)
@@ -720,16 +739,30 @@ nfsd_open(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
 		else
 			flags = O_WRONLY|O_LARGEFILE;
 
-		DQUOT_INIT(inode);
+		DQUOT_INIT(dentry->d_inode);
 	}
 	*filp = dentry_open(dget(dentry), mntget(fhp->fh_export->ex_path.mnt),
 				flags);
 	if (IS_ERR(*filp))
-		host_err = PTR_ERR(*filp);
-out_nfserr:
-	err = nfserrno(host_err);
-out:
-	return err;
+		return nfserrno(PTR_ERR(*filp));
+	return 0;
+}
+
+/*
+ * Open an existing file or directory.
+ * The access argument indicates the type of open (read/write/lock)
+ * N.B. After this call fhp needs an fh_put
+ */
+__be32
+nfsd_open(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
+			int access, struct file **filp)
+{
+	__be32		err;
+
+	err = nfsd_open_verify(rqstp, fhp, type, access);
+	if (err)
+		return err;
+	return __nfsd_open(fhp, access, filp);
 }
 
 /*
@@ -741,6 +774,259 @@ nfsd_close(struct file *filp)
 	fput(filp);
 }
 
+/*
+ * Cache of files opened by v2/v3 READ, WRITE and COMMIT, so that a
+ * stream of small I/O to the same file does not open and close it for
+ * every call.  Files are keyed by inode, mount and access mode and are
+ * closed once they have been idle for NFSD_FILE_IDLE.  The hash table
+ * holds one reference to each entry and every user holds another; the
+ * bucket lock orders lookups against unhashing.
+ *
+ * Permission checks and lease breaking are still done on every call by
+ * nfsd_open_verify(); only the open itself is saved.  Unlink, rename
+ * and delegations close the cached files of the inode concerned.
+ */
+#define NFSD_FILE_HASH_BITS	10
+#define NFSD_FILE_HASH_SIZE	(1 << NFSD_FILE_HASH_BITS)
+#define NFSD_FILE_IDLE		(2 * HZ)
+
+struct nfsd_file {
+	struct hlist_node	nf_node;
+	struct file		*nf_file;
+	struct inode		*nf_inode;
+	struct vfsmount		*nf_mnt;
+	int			nf_may;
+	atomic_t		nf_ref;
+	unsigned long		nf_time;	/* last released */
+};
+
+struct nfsd_file_hbucket {
+	struct hlist_head	fb_head;
+	spinlock_t		fb_lock;
+} ____cacheline_aligned_in_smp;
+
+static struct nfsd_file_hbucket	*nfsd_file_hash;
+static atomic_t			nfsd_file_count;
+static unsigned int		nfsd_file_max;
+
+static void nfsd_file_laundrette(struct work_struct *);
+static DECLARE_DELAYED_WORK(nfsd_file_work, nfsd_file_laundrette);
+
+static inline struct nfsd_file_hbucket *
+nfsd_file_bucket(struct inode *inode)
+{
+	return &nfsd_file_hash[hash_ptr(inode, NFSD_FILE_HASH_BITS)];
+}
+
+static void
+nfsd_file_put(struct nfsd_file *nf)
+{
+	nf->nf_time = jiffies;
+	if (atomic_dec_and_test(&nf->nf_ref)) {
+		fput(nf->nf_file);
+		kfree(nf);
+	}
+}
+
+/* called with the bucket lock held; the caller drops the hash's reference */
+static void
+nfsd_file_unhash(struct nfsd_file *nf)
+{
+	hlist_del_init(&nf->nf_node);
+	atomic_dec(&nfsd_file_count);
+}
+
+/*
+ * Find or open a regular file for READ (MAY_READ) or WRITE and COMMIT
+ * (MAY_WRITE).  N.B. After this call fhp needs an fh_put
+ */
+static __be32
+nfsd_file_acquire(struct svc_rqst *rqstp, struct svc_fh *fhp, int access,
+		  struct nfsd_file **nfp)
+{
+	struct nfsd_file_hbucket *fb;
+	struct nfsd_file *nf, *new;
+	struct hlist_node *pos;
+	struct inode	*inode;
+	struct vfsmount	*mnt;
+	struct file	*file;
+	__be32		err;
+
+	err = nfsd_open_verify(rqstp, fhp, S_IFREG, access);
+	if (err)
+		return err;
+
+	inode = fhp->fh_dentry->d_inode;
+	mnt = fhp->fh_export->ex_path.mnt;
+	fb = nfsd_file_bucket(inode);
+
+	spin_lock(&fb->fb_lock);
+	hlist_for_each_entry(nf, pos, &fb->fb_head, nf_node) {
+		if (nf->nf_inode == inode && nf->nf_mnt == mnt &&
+		    nf->nf_may == access)
+			goto found;
+	}
+	spin_unlock(&fb->fb_lock);
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return nfserr_jukebox;
+	err = __nfsd_open(fhp, access, &file);
+	if (err) {
+		kfree(new);
+		return err;
+	}
+	new->nf_file = file;
+	new->nf_inode = inode;
+	new->nf_mnt = mnt;
+	new->nf_may = access;
+	atomic_set(&new->nf_ref, 1);
+	INIT_HLIST_NODE(&new->nf_node);
+	*nfp = new;
+
+	/*
+	 * Files without fsync are always written O_SYNC, which must not
+	 * leak into other users of a shared file.
+	 */
+	if ((access & MAY_WRITE) && !file->f_op->fsync)
+		return 0;
+
+	spin_lock(&fb->fb_lock);
+	hlist_for_each_entry(nf, pos, &fb->fb_head, nf_node) {
+		if (nf->nf_inode == inode && nf->nf_mnt == mnt &&
+		    nf->nf_may == access) {
+			/* lost a race; close ours outside the lock */
+			atomic_inc(&nf->nf_ref);
+			spin_unlock(&fb->fb_lock);
+			nfsd_file_put(new);
+			*nfp = nf;
+			return 0;
+		}
+	}
+	if (atomic_read(&nfsd_file_count) < nfsd_file_max) {
+		atomic_inc(&nfsd_file_count);
+		atomic_inc(&new->nf_ref);
+		hlist_add_head(&new->nf_node, &fb->fb_head);
+		schedule_delayed_work(&nfsd_file_work, NFSD_FILE_IDLE);
+	}
+	spin_unlock(&fb->fb_lock);
+	return 0;
+
+found:
+	atomic_inc(&nf->nf_ref);
+	spin_unlock(&fb->fb_lock);
+	*nfp = nf;
+	return 0;
+}
+
+/*
+ * Close files that have not been used for NFSD_FILE_IDLE, or all of
+ * them when purge is set.
+ */
+static void
+nfsd_file_close_idle(int purge)
+{
+	struct nfsd_file *nf;
+	struct hlist_node *pos, *tmp;
+	HLIST_HEAD(dispose);
+	int i;
+
+	for (i = 0; i < NFSD_FILE_HASH_SIZE; i++) {
+		struct nfsd_file_hbucket *fb = &nfsd_file_hash[i];
+
+		spin_lock(&fb->fb_lock);
+		hlist_for_each_entry_safe(nf, pos, tmp, &fb->fb_head, nf_node) {
+			if (!purge && (atomic_read(&nf->nf_ref) > 1 ||
+			    time_before(jiffies, nf->nf_time + NFSD_FILE_IDLE)))
+				continue;
+			nfsd_file_unhash(nf);
+			hlist_add_head(&nf->nf_node, &dispose);
+		}
+		spin_unlock(&fb->fb_lock);
+	}
+
+	hlist_for_each_entry_safe(nf, pos, tmp, &dispose, nf_node) {
+		hlist_del(&nf->nf_node);
+		nfsd_file_put(nf);
+	}
+}
+
+static void
+nfsd_file_laundrette(struct work_struct *not_used)
+{
+	nfsd_file_close_idle(0);
+	if (atomic_read(&nfsd_file_count))
+		schedule_delayed_work(&nfsd_file_work, NFSD_FILE_IDLE);
+}
+
+/*
+ * Close any cached files of an inode that is going away or is about to
+ * be leased.  Files still in use are closed by their last user.
+ */
+void
+nfsd_file_close_inode(struct inode *inode)
+{
+	struct nfsd_file_hbucket *fb;
+	struct nfsd_file *nf;
+	struct hlist_node *pos, *tmp;
+	HLIST_HEAD(dispose);
+
+	if (!nfsd_file_hash)
+		return;
+	fb = nfsd_file_bucket(inode);
+	spin_lock(&fb->fb_lock);
+	hlist_for_each_entry_safe(nf, pos, tmp, &fb->fb_head, nf_node) {
+		if (nf->nf_inode != inode)
+			continue;
+		nfsd_file_unhash(nf);
+		hlist_add_head(&nf->nf_node, &dispose);
+	}
+	spin_unlock(&fb->fb_lock);
+
+	hlist_for_each_entry_safe(nf, pos, tmp, &dispose, nf_node) {
+		hlist_del(&nf->nf_node);
+		nfsd_file_put(nf);
+	}
+}
+
+/*
+ * Initialize the open file cache; a no-op if it already exists.
+ */
+int
+nfsd_file_cache_init(void)
+{
+	int	i;
+
+	if (nfsd_file_hash)
+		return 0;
+	nfsd_file_hash = kcalloc(NFSD_FILE_HASH_SIZE,
+				 sizeof(struct nfsd_file_hbucket), GFP_KERNEL);
+	if (!nfsd_file_hash) {
+		printk(KERN_WARNING
+			"nfsd: Could not allocate memory for open file cache.\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < NFSD_FILE_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&nfsd_file_hash[i].fb_head);
+		spin_lock_init(&nfsd_file_hash[i].fb_lock);
+	}
+	/* leave most of the system's file table to everybody else */
+	nfsd_file_max = max(files_stat.max_files / 16, NFSD_FILE_HASH_SIZE);
+	atomic_set(&nfsd_file_count, 0);
+	return 0;
+}
+
+void
+nfsd_file_cache_shutdown(void)
+{
+	if (!nfsd_file_hash)
+		return;
+	cancel_delayed_work_sync(&nfsd_file_work);
+	nfsd_file_close_idle(1);
+	kfree(nfsd_file_hash);
+	nfsd_file_hash = NULL;
+}
+
 /*
  * Sync a file
  * As this calls fsync (not fdatasync) there is no need for a write_inode
@@ -790,41 +1076,39 @@ nfsd_sync_dir(struct dentry *dp)
 static inline struct raparms *
 nfsd_get_raparms(dev_t dev, ino_t ino)
 {
-	struct raparms	*ra, **rap, **frap = NULL;
+	struct raparms	*ra;
 	int depth = 0;
 	unsigned int hash;
 	struct raparm_hbucket *rab;
 
-	hash = jhash_2words(dev, ino, 0xfeedbeef) & RAPARM_HASH_MASK;
+	hash = jhash_2words(dev, ino, 0xfeedbeef) &
+		((1U << raparm_hash_bits) - 1);
 	rab = &raparm_hash[hash];
 
 	spin_lock(&rab->pb_lock);
-	for (rap = &rab->pb_head; (ra = *rap); rap = &ra->p_next) {
+	list_for_each_entry(ra, &rab->pb_lru, p_lru) {
 		if (ra->p_ino == ino && ra->p_dev == dev)
 			goto found;
 		depth++;
-		if (ra->p_count == 0)
-			frap = rap;
 	}
-	depth = nfsdstats.ra_size*11/10;
-	if (!frap) {	
-		spin_unlock(&rab->pb_lock);
-		return NULL;
+	/* reuse the least recently used entry nobody is reading with */
+	list_for_each_entry_reverse(ra, &rab->pb_lru, p_lru) {
+		if (ra->p_count == 0)
+			goto reuse;
 	}
-	rap = frap;
-	ra = *frap;
+	spin_unlock(&rab->pb_lock);
+	return NULL;
+reuse:
+	depth = RAPARM_BUCKET_DEPTH;
 	ra->p_dev = dev;
 	ra->p_ino = ino;
 	ra->p_set = 0;
 	ra->p_hindex = hash;
 found:
-	if (rap != &rab->pb_head) {
-		*rap = ra->p_next;
-		ra->p_next   = rab->pb_head;
-		rab->pb_head = ra;
-	}
+	list_move(&ra->p_lru, &rab->pb_lru);
 	ra->p_count++;
-	nfsdstats.ra_depth[depth*10/nfsdstats.ra_size]++;
+	/* slot 10 counts misses */
+	nfsdstats.ra_depth[min(depth * 10 / RAPARM_BUCKET_DEPTH, 10)]++;
 	spin_unlock(&rab->pb_lock);
 	return ra;
 }
@@ -1076,11 +1360,14 @@ nfsd_read(struct svc_rqst *rqstp, struct svc_fh *fhp, struct file *file,
 			goto out;
 		err = nfsd_vfs_read(rqstp, fhp, file, offset, vec, vlen, count);
 	} else {
-		err = nfsd_open(rqstp, fhp, S_IFREG, MAY_READ, &file);
+		struct nfsd_file *nf;
+
+		err = nfsd_file_acquire(rqstp, fhp, MAY_READ, &nf);
 		if (err)
 			goto out;
-		err = nfsd_vfs_read(rqstp, fhp, file, offset, vec, vlen, count);
-		nfsd_close(file);
+		err = nfsd_vfs_read(rqstp, fhp, nf->nf_file, offset, vec, vlen,
+				    count);
+		nfsd_file_put(nf);
 	}
 out:
 	return err;
@@ -1105,7 +1392,19 @@ nfsd_write(struct svc_rqst *rqstp, struct svc_fh *fhp, struct file *file,
 			goto out;
 		err = nfsd_vfs_write(rqstp, fhp, file, offset, vec, vlen, cnt,
 				stablep);
+	} else if (*stablep == 0) {
+		struct nfsd_file *nf;
+
+		err = nfsd_file_acquire(rqstp, fhp, MAY_WRITE, &nf);
+		if (err)
+			goto out;
+
+		if (cnt)
+			err = nfsd_vfs_write(rqstp, fhp, nf->nf_file, offset,
+					     vec, vlen, cnt, stablep);
+		nfsd_file_put(nf);
 	} else {
+		/* stable writes may set O_SYNC, so never share the file */
 		err = nfsd_open(rqstp, fhp, S_IFREG, MAY_WRITE, &file);
 		if (err)
 			goto out;
@@ -1132,14 +1431,16 @@ __be32
 nfsd_commit(struct svc_rqst *rqstp, struct svc_fh *fhp,
                loff_t offset, unsigned long count)
 {
+	struct nfsd_file *nf;
 	struct file	*file;
 	__be32		err;
 
 	if ((u64)count > ~(u64)offset)
 		return nfserr_inval;
 
-	if ((err = nfsd_open(rqstp, fhp, S_IFREG, MAY_WRITE, &file)) != 0)
+	if ((err = nfsd_file_acquire(rqstp, fhp, MAY_WRITE, &nf)) != 0)
 		return err;
+	file = nf->nf_file;
 	if (EX_ISSYNC(fhp->fh_export)) {
 		if (file->f_op && file->f_op->fsync) {
 			err = nfserrno(nfsd_sync(file));
@@ -1148,7 +1449,7 @@ nfsd_commit(struct svc_rqst *rqstp, struct svc_fh *fhp,
 		}
 	}
 
-	nfsd_close(file);
+	nfsd_file_put(nf);
 	return err;
 }
 #endif /* CONFIG_NFSD_V3 */
@@ -1679,6 +1980,8 @@ nfsd_rename(struct svc_rqst *rqstp, struct svc_fh *ffhp, char *fname, int flen,
 	if (ndentry == trap)
 		goto out_dput_new;
 
+	if (ndentry->d_inode)
+		nfsd_file_close_inode(ndentry->d_inode);
 #ifdef MSNFS
 	if ((ffhp->fh_export->ex_flags & NFSEXP_MSNFS) &&
 		((atomic_read(&odentry->d_count) > 1)
@@ -1763,6 +2066,7 @@ nfsd_unlink(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
 		type = rdentry->d_inode->i_mode & S_IFMT;
 
 	if (type != S_IFDIR) { /* It's UNLINK */
+		nfsd_file_close_inode(rdentry->d_inode);
 #ifdef MSNFS
 		if ((fhp->fh_export->ex_flags & NFSEXP_MSNFS) &&
 			(atomic_read(&rdentry->d_count) > 1)) {
@@ -1794,7 +2098,7 @@ nfsd_unlink(struct svc_rqst *rqstp, struct svc_fh *fhp, int type,
 		BUG_ON(ino == 0);
 		dprintk("%s calling spnfs_remove inumber=%ld\n",
 			__FUNCTION__, ino);
-		if (spnfs_remove(ino) == 0) {
+		if (spnfs_remove(dirp->i_sb, ino) == 0) {
 			dprintk("%s spnfs_remove success\n", __FUNCTION__);
 		} else {
 			/* XXX How do we make this atomic? */
@@ -1964,7 +2268,9 @@ nfsd_racache_shutdown(void)
 	if (!raparml)
 		return;
 	dprintk("nfsd: freeing readahead buffers.\n");
-	kfree(raparml);
+	vfree(raparm_hash);
+	raparm_hash = NULL;
+	vfree(raparml);
 	raparml = NULL;
 }
 /*
@@ -1974,34 +2280,40 @@ int
 nfsd_racache_init(int cache_size)
 {
 	int	i;
-	int	j = 0;
-	int	nperbucket;
-
+	int	nbuckets;
+	unsigned long low_mb;
 
 	if (raparml)
 		return 0;
-	if (cache_size < 2*RAPARM_HASH_SIZE)
-		cache_size = 2*RAPARM_HASH_SIZE;
-	raparml = kcalloc(cache_size, sizeof(struct raparms), GFP_KERNEL);
-
-	if (!raparml) {
+	low_mb = nr_free_buffer_pages() >> (20 - PAGE_SHIFT);
+	cache_size = max_t(unsigned long, cache_size, low_mb * RAPARM_PER_MB);
+	cache_size = min(cache_size, RAPARM_MAX_ENTRIES);
+	nbuckets = roundup_pow_of_two(DIV_ROUND_UP(cache_size,
+						   RAPARM_BUCKET_DEPTH));
+	raparm_hash_bits = ilog2(nbuckets);
+
+	/* up to 8192 cacheline sized buckets: too much for kmalloc */
+	raparml = vmalloc(cache_size * sizeof(struct raparms));
+	raparm_hash = vmalloc(nbuckets * sizeof(struct raparm_hbucket));
+	if (!raparml || !raparm_hash) {
 		printk(KERN_WARNING
 			"nfsd: Could not allocate memory read-ahead cache.\n");
+		vfree(raparm_hash);
+		raparm_hash = NULL;
+		vfree(raparml);
+		raparml = NULL;
 		return -ENOMEM;
 	}
+	memset(raparml, 0, cache_size * sizeof(struct raparms));
 
 	dprintk("nfsd: allocating %d readahead buffers.\n", cache_size);
-	for (i = 0 ; i < RAPARM_HASH_SIZE ; i++) {
-		raparm_hash[i].pb_head = NULL;
+	for (i = 0 ; i < nbuckets ; i++) {
+		INIT_LIST_HEAD(&raparm_hash[i].pb_lru);
 		spin_lock_init(&raparm_hash[i].pb_lock);
 	}
-	nperbucket = DIV_ROUND_UP(cache_size, RAPARM_HASH_SIZE);
-	for (i = 0; i < cache_size - 1; i++) {
-		if (i % nperbucket == 0)
-			raparm_hash[j++].pb_head = raparml + i;
-		if (i % nperbucket < nperbucket-1)
-			raparml[i].p_next = raparml + i + 1;
-	}
+	/* entries stay in the bucket they start in */
+	for (i = 0; i < cache_size; i++)
+		list_add(&raparml[i].p_lru, &raparm_hash[i & (nbuckets - 1)].pb_lru);
 
 	nfsdstats.ra_size = cache_size;
 	return 0;
@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 
+struct cache_req;
 struct dentry;
 struct inode;
 struct super_block;
@@ -59,13 +60,18 @@ struct pnfs_xdr_info {
 */
 typedef int (*pnfs_encodedev_t)(struct pnfs_xdr_info *xdr, void *device);
 
-/* Arguments for get_device_info */
+/* Arguments for get_device_info
+ * creq - if set, a file system that would otherwise block for a long
+ * time may instead defer the request with creq->defer() and return
+ * -EAGAIN; the request is replayed once it is revisited.
+ */
 struct pnfs_devinfo_arg {
 	u32 type;			/* request */
 	deviceid_t devid;		/* request */
 	u32 notify_types;		/* request/response */
 	struct pnfs_xdr_info xdr;	/* request/response */
 	pnfs_encodedev_t func;		/* request */
+	struct cache_req *creq;		/* request */
 };
 
 /* Used by get_device_iter to retrieve all available devices.
@@ -83,6 +89,24 @@ struct pnfs_deviter_arg {
 	u32 eof;	/* response */
 };
 
+/* Used by get_device_list to retrieve many devices at once.
+ * Args:
+ * type - layout type
+ * maxnum - room in devids
+ * cookie/verf - index and verifier of the next list item
+ * devids/count - the device ids found
+ * eof - no more devices after these
+ */
+struct pnfs_devlist_arg {
+	u32 type;	/* request */
+	u32 maxnum;	/* request */
+	u64 cookie;	/* request/response */
+	u64 verf;	/* request/response */
+	u64 *devids;	/* response */
+	u32 count;	/* response */
+	u32 eof;	/* response */
+};
+
 struct nfsd4_layout_seg {
 	u64	clientid;
 	u32	layout_type;
@@ -101,6 +125,7 @@ struct nfsd4_layout_seg {
  * seg - layout info requested and layout info returned
  * xdr - xdr info
  * return_on_close - true if layout to be returned on file close
+ * creq - request may be deferred, as for get_device_info
  * TODO: use common func with dev?
  */
 typedef int (*pnfs_encodelayout_t)(struct pnfs_xdr_info *xdr, void *layout);
@@ -114,6 +139,7 @@ struct pnfs_layoutget_arg {
 	struct nfsd4_layout_seg	seg;		/* request/response */
 	struct pnfs_xdr_info	xdr;		/* request/response */
 	u32			return_on_close;/* response */
+	struct cache_req	*creq;		/* request */
 };
 
 #endif /* CONFIG_PNFSD */
@@ -212,6 +238,9 @@ struct export_operations {
 	/* Retrieve all available devices via an iterator */
 	int (*get_device_iter) (struct super_block *sb,
 				struct pnfs_deviter_arg *arg);
+	/* Retrieve up to arg->maxnum devices at once; optional */
+	int (*get_device_list) (struct super_block *sb,
+				struct pnfs_devlist_arg *arg);
 		/* can layout segments be merged for this layout type? */
 	int (*can_merge_layouts)(u32 layout_type);
 	/* Retrieve and encode a layout onto the xdr stream.
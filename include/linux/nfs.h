@@ -125,8 +125,10 @@
 	NFSERR_UNKNOWN_LAYOUTTYPE = 10062,	/* v4.1 */
 	NFSERR_SEQ_MISORDERED = 10063,          /* v4.1 */
 	NFSERR_SEQUENCE_POS = 10064,		/* v4.1 */
+	NFSERR_RETRY_UNCACHED_REP = 10068,	/* v4.1 */
 
 	NFSERR_REPLAY_ME = 11001,	/* linux internal */
+	NFSERR_REPLAY_CACHE = 11002,	/* linux internal */
 };
 
 /* NFSv2 file types - beware, these are not the same in NFSv3 */
@@ -15,6 +15,7 @@
 #if defined(CONFIG_PNFS)
 
 #include <linux/nfs_page.h>
+#include <linux/rbtree.h>
 
 #define NFS4_PNFS_DEV_MAXNUM 16
 /* FIXME: This is way too small for block driver */
@@ -41,7 +42,8 @@ struct pnfs_mount_type {
  */
 struct pnfs_layout_type {
 	int refcount;
-	struct list_head segs;		/* layout segments list */
+	struct rb_root segs[2];		/* layout segments by offset,
+					 * [0] READ, [1] RW */
 	int roc_iomode;			/* iomode to return on close, 0=none */
 	struct inode *inode;
 	seqlock_t seqlock;		/* Protects the stateid */
@@ -103,7 +105,8 @@ PNFS_LD_POLICY_OPS(struct pnfs_layout_type *lo)
 }
 
 struct pnfs_layout_segment {
-	struct list_head fi_list;
+	struct rb_node fi_node;
+	u64 fi_max_end;			/* highest end in fi_node's subtree */
 	struct nfs4_pnfs_layout_segment range;
 	struct kref kref;
 	struct pnfs_layout_type *layout;
@@ -171,6 +174,9 @@ struct layoutdriver_io_operations {
 	struct pnfs_mount_type * (*initialize_mountpoint) (struct super_block *, struct nfs_fh *fh);
 	int (*uninitialize_mountpoint) (struct pnfs_mount_type *mountid);
 
+	/* The server notified that a device changed or was deleted */
+	void (*device_notify) (struct pnfs_mount_type *mountid, u32 notify_type, struct pnfs_deviceid *dev_id);
+
 	/* Other ops... */
 	int (*ioctl) (struct pnfs_layout_type *, struct inode *, struct file *, unsigned int, unsigned long);
 };
@@ -182,6 +182,7 @@ struct nfs_inode {
 	unsigned long pnfs_layout_state;
 #define NFS_INO_LAYOUT_FAILED	0x0001	/* get layout failed, stop trying */
 #define NFS_INO_LAYOUT_ALLOC	0x0002	/* get layout failed, stop trying */
+#define NFS_INO_LAYOUT_PREFETCH	0x0008	/* async layoutget outstanding */
 	time_t pnfs_layout_suspend;
 	wait_queue_head_t lo_waitq;
 	spinlock_t lo_lock;
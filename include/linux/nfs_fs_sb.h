@@ -84,6 +84,8 @@ struct nfs_client {
 #endif /* CONFIG_NFS_V4_1 */
 #ifdef CONFIG_PNFS
 	struct nfs4_session *	cl_ds_session; /* pNFS data server session */
+	unsigned long		cl_ds_failed;	/* jiffies of last DS I/O error,
+						 * 0 if the last I/O succeeded */
 	struct list_head	cl_lo_inodes;	/* Inodes having layouts */
 #endif /* CONFIG_PNFS */
 };
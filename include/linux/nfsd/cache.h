@@ -15,11 +15,10 @@
 #include <linux/uio.h>
 
 /*
- * Representation of a reply cache entry. The first two members *must*
- * be hash_next and hash_prev.
+ * Representation of a reply cache entry.  c_lru links the entry into
+ * the LRU list of its hash bucket, which is also the hash chain.
  */
 struct svc_cacherep {
-	struct hlist_node	c_hash;
 	struct list_head	c_lru;
 
 	unsigned char		c_state,	/* unused, inprog, done */
@@ -30,6 +29,8 @@ struct svc_cacherep {
 	u32			c_prot;
 	u32			c_proc;
 	u32			c_vers;
+	__wsum			c_csum;		/* of the start of the args */
+	unsigned int		c_len;		/* length of the args */
 	unsigned long		c_timestamp;
 	union {
 		struct kvec	u_vec;
@@ -76,6 +77,20 @@ int	nfsd_reply_cache_init(void);
 void	nfsd_reply_cache_shutdown(void);
 int	nfsd_cache_lookup(struct svc_rqst *, int);
 void	nfsd_cache_update(struct svc_rqst *, int, __be32 *);
+int	nfsd_reply_cache_stats(char *);
+int	nfsd_reply_cache_set_max(int);
+
+/* Reply cache counters, kept per cpu as lookups take only a bucket lock */
+struct nfsd_drc_stats {
+	unsigned int	hits;
+	unsigned int	misses;
+	unsigned int	nocache;
+	unsigned int	payload_misses;	/* xid matched, arguments did not */
+};
+
+void	nfsd_reply_cache_counts(struct nfsd_drc_stats *);
+
+extern unsigned int	nfsd_reply_cache_max;
 
 #endif /* __KERNEL__ */
 #endif /* NFSCACHE_H */
@@ -60,10 +60,13 @@ extern struct svc_program	nfsd_program;
 extern struct svc_version	nfsd_version2, nfsd_version3,
 				nfsd_version4;
 extern struct svc_serv		*nfsd_serv;
+extern unsigned int		nfsd_min_threads, nfsd_max_threads;
 /*
  * Function prototypes.
  */
 int		nfsd_svc(unsigned short port, int nrservs);
+void		nfsd_autoscale_start(void);
+void		nfsd_autoscale_shutdown(void);
 int		nfsd_dispatch(struct svc_rqst *rqstp, __be32 *statp);
 
 /* nfsd/vfs.c */
@@ -103,6 +106,9 @@ __be32		nfsd_commit(struct svc_rqst *, struct svc_fh *,
 __be32		nfsd_open(struct svc_rqst *, struct svc_fh *, int,
 				int, struct file **);
 void		nfsd_close(struct file *);
+int		nfsd_file_cache_init(void);
+void		nfsd_file_cache_shutdown(void);
+void		nfsd_file_close_inode(struct inode *);
 __be32 		nfsd_read(struct svc_rqst *, struct svc_fh *, struct file *,
 				loff_t, struct kvec *, int, unsigned long *);
 __be32 		nfsd_write(struct svc_rqst *, struct svc_fh *,struct file *,
@@ -267,6 +273,8 @@ void		nfsd_lockd_shutdown(void);
 #define	nfserr_unknown_layouttype	__constant_htonl(NFSERR_UNKNOWN_LAYOUTTYPE)
 #define	nfserr_seq_misordered		__constant_htonl(NFSERR_SEQ_MISORDERED)
 #define nfserr_sequence_pos	__constant_htonl(NFSERR_SEQUENCE_POS)
+#define nfserr_retry_uncached_rep	__constant_htonl(NFSERR_RETRY_UNCACHED_REP)
+#define	nfserr_replay_cache	__constant_htonl(NFSERR_REPLAY_CACHE)
 
 /* error codes for internal use */
 /* if a request fails due to kmalloc failure, it gets dropped.
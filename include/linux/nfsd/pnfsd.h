@@ -63,6 +63,9 @@ struct pnfs_inval_state {
 struct pnfs_ds_stateid {
 	struct list_head	ds_hash;        /* ds_stateid hash entry */
 	struct list_head	ds_perclid;     /* per client hash entry */
+	struct list_head	ds_lru;         /* ds_stid_lru entry */
+	struct pnfs_ds_clientid	*ds_client;
+	time_t			ds_time;        /* last use, for reclaim */
 	stateid_t		ds_stid;
 	struct knfsd_fh		ds_fh;
 	unsigned long		ds_access;
@@ -74,11 +77,12 @@ struct pnfs_ds_clientid {
 	struct list_head	dc_hash;        /* mds_clid_hashtbl entry */
 	struct list_head	dc_stateid;     /* ds_stateid head */
 	struct list_head	dc_permdsid;    /* per mdsid hash entry */
+	struct pnfs_mds_id	*dc_mds;
 	clientid_t		dc_mdsclid;
 };
 
 struct pnfs_mds_id {
-	struct list_head	di_hash;        /* mds_nodeid list entry */
+	struct list_head	di_hash;        /* mds_id_hashtbl entry */
 	struct list_head	di_mdsclid;     /* mds_clientid head */
 	uint32_t		di_mdsid;
 	time_t			di_mdsboot;	/* mds boot time */
@@ -88,6 +92,9 @@ int nfsd_layout_recall_cb(struct super_block *, struct inode *, struct nfsd4_pnf
 int nfsd_device_notify_cb(struct super_block *, struct nfsd4_pnfs_cb_device *);
 int nfs4_pnfs_cb_get_state(struct super_block *, struct pnfs_get_state *);
 void nfs4_pnfs_state_init(void);
+void nfs4_pnfs_state_shutdown(void);
+void nfs4_pnfs_ds_laundromat(time_t);
+int nfs4_pnfs_ds_stats(char *);
 int nfs4_pnfs_get_layout(struct svc_fh *, struct pnfs_layoutget_arg *,
 			 		stateid_t *);
 int nfs4_pnfs_return_layout(struct super_block *, struct svc_fh *,
@@ -39,6 +39,7 @@
 
 #include <linux/list.h>
 #include <linux/kref.h>
+#include <linux/rcupdate.h>
 #include <linux/nfs_xdr.h>
 #include <linux/sunrpc/clnt.h>
 #include <linux/nfs4.h>
@@ -122,22 +123,36 @@ struct nfs41_channel {
 
 /* Maximum number of slots per session - XXX arbitrary */
 #define NFS41_MAX_SLOTS 64
+/* Largest reply a slot keeps for answering retransmissions */
+#define NFSD_SLOT_CACHE_SIZE		2048
+/* Reply cache memory shared by the slots of all sessions of a client */
+#define NFSD_CLIENT_SLOT_CACHE		(NFS41_MAX_SLOTS * NFSD_SLOT_CACHE_SIZE)
+/* Slots a new session is asked to use before it has shown it needs more */
+#define NFSD_INITIAL_TARGET_SLOTS	8
 
 /* slot states */
 enum {
 	NFS4_SLOT_AVAILABLE,
-	NFS4_SLOT_INPROGRESS
+	NFS4_SLOT_INPROGRESS,
+	NFS4_SLOT_RECLAIM	/* laundromat freeing its reply cache */
 };
 
 /*
  * nfs41_slot
  *
- * for now, just slot sequence number - will hold DRC for this slot.
+ * slot sequence number, and the reply to the last request on the slot
+ * (everything after the compound tag) for answering a retransmission.
  */
 struct nfs41_slot {
 	atomic_t		sl_state;
 	struct nfs41_session	*sl_session;
 	u32			sl_seqid;
+	__be32			sl_status;	/* compound status */
+	u32			sl_opcnt;
+	u32			sl_datalen;	/* 0: reply not cached */
+	char			*sl_data;	/* se_fmaxresp_cached bytes, or NULL */
+	int			sl_deferred;	/* sl_seqid was dropped for an
+						 * upcall and must be run again */
 };
 
 /*
@@ -152,6 +167,10 @@ struct nfs41_session {
 	nfs41_sessionid		se_sessionid;
 	struct nfs41_channel	se_forward;
 	struct nfs41_slot	*se_slots;	/* forward channel slots */
+	u32			se_target_slots; /* slots the client should use */
+	u32			se_peak_slots;	/* highest slotid + 1 seen since
+						 * the last laundromat run */
+	struct rcu_head		se_rcu;
 };
 
 #define se_fheaderpad_sz	se_forward.ch_headerpad_sz
@@ -220,6 +239,7 @@ struct nfs4_client {
 						     callbacks */
 #endif /* CONFIG_PNFSD */
 #if defined(CONFIG_NFSD_V4_1)
+	spinlock_t		cl_lock;	/* sessions and their slots */
 	struct list_head	cl_sessions;
 #endif /* CONFIG_NFSD_V4_1 */
 	struct list_head        cl_lru;         /* tail queue */
@@ -233,11 +253,13 @@ struct nfs4_client {
 	nfs4_verifier		cl_confirm;	/* generated by server */
 	struct nfs4_callback	cl_callback;    /* callback info */
 	atomic_t		cl_count;	/* ref count */
+	struct rcu_head		cl_rcu;
 	u32			cl_firststate;	/* recovery dir creation */
 #if defined(CONFIG_NFSD_V4_1)
 	u32			cl_seqid;	/* seqid for create_session */
 	u32			cl_exchange_flags;
 	nfs41_sessionid		cl_sessionid;
+	u32			cl_slot_cache;	/* slot reply cache bytes */
 
 	struct svc_xprt		*cl_cb_xprt;	/* 4.1 callback transport */
 	struct mutex		cl_cb_mutex;
@@ -372,16 +394,21 @@ struct nfs4_stateowner {
 	int                     so_confirmed; /* successful OPEN_CONFIRM? */
 	u32			so_minorversion;
 	struct nfs4_replay	so_replay;
+	struct rcu_head		so_rcu;
 };
 
 /*
 *  nfs4_file: a file opened by some number of (open) nfs4_stateowners.
 *    o fi_perfile list is used to search for conflicting 
 *      share_acces, share_deny on the file.
+*    o fi_lock is taken, with the state lock, to change fi_stateids and
+*      fi_delegations, so that READ and WRITE can look at them without
+*      the state lock.
 */
 struct nfs4_file {
 	struct kref		fi_ref;
 	struct list_head        fi_hash;    /* hash by "struct inode *" */
+	spinlock_t		fi_lock;
 	struct list_head        fi_stateids;
 	struct list_head	fi_delegations;
 #if defined(CONFIG_PNFSD)
@@ -398,6 +425,7 @@ struct nfs4_file {
 	u32			fi_fhlen;
 	u8			fi_fhval[NFS4_FHSIZE];
 #endif /* CONFIG_PNFSD */
+	struct rcu_head		fi_rcu;
 };
 
 #if defined(CONFIG_PNFSD)
@@ -441,6 +469,7 @@ struct nfs4_stateid {
 	unsigned long                 st_access_bmap;
 	unsigned long                 st_deny_bmap;
 	struct nfs4_stateid         * st_openstp;
+	struct rcu_head               st_rcu;
 };
 
 /* flags for preprocess_seqid_op() */
@@ -12,6 +12,7 @@
 #include <linux/nfs4.h>
 
 struct nfsd_stats {
+	/* rc*: no longer updated, see nfsd_reply_cache_counts */
 	unsigned int	rchits;		/* repcache hits */
 	unsigned int	rcmisses;	/* repcache hits */
 	unsigned int	rcnocache;	/* uncached reqs */
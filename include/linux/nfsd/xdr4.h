@@ -536,6 +536,10 @@ extern __be32 nfsd4_exchange_id(struct svc_rqst *rqstp,
 extern __be32 nfsd4_create_session(struct svc_rqst *,
 		struct nfsd4_compound_state *,
 		struct nfsd4_create_session *);
+extern void nfsd4_store_cache_entry(struct nfsd4_compoundres *,
+		struct nfs41_slot *, __be32);
+extern __be32 nfsd4_replay_cache_entry(struct nfsd4_compoundres *,
+		struct nfs41_slot *);
 extern __be32 nfsd4_sequence(struct svc_rqst *,
 		struct nfsd4_compound_state *,
 		struct nfsd4_sequence *);
@@ -57,10 +57,22 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SPNFS_TYPE_COMMIT		0x0b
 #define SPNFS_TYPE_READ			0x0c
 #define SPNFS_TYPE_WRITE		0x0d
+#define SPNFS_TYPE_GETDEVICELIST	0x0e
 
-#define	SPNFS_MAX_DEVICES		1
-#define	SPNFS_MAX_DATA_SERVERS		16
-#define SPNFS_MAX_IO			512
+/* most READ or WRITE data carried by a single message */
+#define SPNFS_MAX_IO			(1024 * 1024)
+/* most data following a LAYOUTGET, GETDEVICEINFO or GETDEVICELIST reply */
+#define SPNFS_MAX_REPLY_DATA		(64 * 1024)
+
+/*
+ * Like READ and WRITE data, stripe and device lists are not part of
+ * struct spnfs_msg, so a message costs the same whatever the number of
+ * data servers.  A successful LAYOUTGET reply is followed by stripe_count
+ * file handles, each a struct spnfs_filelayout_list and fh_len bytes of
+ * handle padded to a multiple of four.  A successful GETDEVICEINFO reply
+ * is followed by dscount struct spnfs_data_server, and a successful
+ * GETDEVICELIST reply by count device ids.
+ */
 
 /* layout */
 struct spnfs_msg_layoutget_args {
@@ -68,8 +80,8 @@ struct spnfs_msg_layoutget_args {
 };
 
 struct spnfs_filelayout_list {
-	u_int32_t       fh_len;
-	unsigned char   fh_val[128]; /* DMXXX fix this const */
+	u_int32_t       fh_len;		/* at most 128 */
+	unsigned char   fh_val[0];
 };
 
 struct spnfs_msg_layoutget_res {
@@ -78,7 +90,6 @@ struct spnfs_msg_layoutget_res {
 	u_int64_t stripe_size;
 	u_int32_t stripe_type;
 	u_int32_t stripe_count;
-	struct spnfs_filelayout_list flist[SPNFS_MAX_DATA_SERVERS];
 };
 
 /* layoutcommit */
@@ -116,6 +127,26 @@ struct spnfs_msg_getdeviceiter_res {
 	u_int32_t eof;
 };
 
+/*
+ * getdevicelist
+ *
+ * Up to maxcount devices at once.  A successful reply is followed by
+ * count u_int64_t device ids.
+ */
+struct spnfs_msg_getdevicelist_args {
+	u_int64_t cookie;
+	u_int64_t verf;
+	u_int32_t maxcount;
+};
+
+struct spnfs_msg_getdevicelist_res {
+	int status;
+	u_int64_t cookie;
+	u_int64_t verf;
+	u_int32_t count;
+	u_int32_t eof;
+};
+
 /* getdeviceinfo */
 struct spnfs_data_server {
 	u_int32_t dsid;
@@ -126,7 +157,6 @@ struct spnfs_data_server {
 struct spnfs_device {
 	u_int64_t devid;
 	int dscount;
-	struct spnfs_data_server dslist[SPNFS_MAX_DATA_SERVERS];
 };
 
 struct spnfs_msg_getdeviceinfo_args {
@@ -201,6 +231,12 @@ struct spnfs_msg_commit_res {
 };
 */
 
+/*
+ * READ and WRITE data is not part of struct spnfs_msg.  A WRITE upcall
+ * is followed by write_args.len bytes of data, and a successful READ
+ * downcall by read_res.status bytes; neither exceeds SPNFS_MAX_IO.
+ */
+
 /* read */
 struct spnfs_msg_read_args {
 	unsigned long inode;
@@ -210,7 +246,6 @@ struct spnfs_msg_read_args {
 
 struct spnfs_msg_read_res {
 	int status;
-	char data[SPNFS_MAX_IO];
 };
 
 /* write */
@@ -218,7 +253,6 @@ struct spnfs_msg_write_args {
 	unsigned long inode;
 	loff_t offset;
 	unsigned long len;
-	char data[SPNFS_MAX_IO];
 };
 
 struct spnfs_msg_write_res {
@@ -233,6 +267,7 @@ union spnfs_msg_args {
 	struct spnfs_msg_layoutreturn_args	layoutreturn_args;
 */
 	struct spnfs_msg_getdeviceiter_args     getdeviceiter_args;
+	struct spnfs_msg_getdevicelist_args	getdevicelist_args;
 	struct spnfs_msg_getdeviceinfo_args     getdeviceinfo_args;
 	struct spnfs_msg_setattr_args		setattr_args;
 	struct spnfs_msg_open_args		open_args;
@@ -255,6 +290,7 @@ union spnfs_msg_res {
 	struct spnfs_msg_layoutreturn_res	layoutreturn_res;
 */
 	struct spnfs_msg_getdeviceiter_res      getdeviceiter_res;
+	struct spnfs_msg_getdevicelist_res	getdevicelist_res;
 	struct spnfs_msg_getdeviceinfo_res      getdeviceinfo_res;
 	struct spnfs_msg_setattr_res		setattr_res;
 	struct spnfs_msg_open_res		open_res;
@@ -270,24 +306,52 @@ union spnfs_msg_res {
 	struct spnfs_msg_write_res		write_res;
 };
 
-/* a spnfs message, args and response */
+/*
+ * a spnfs message, args and response
+ *
+ * im_xid is assigned by the kernel for each upcall and must be echoed
+ * back unchanged in the downcall; it is how a reply is matched to the
+ * waiting request when several upcalls are outstanding at once.
+ */
 struct spnfs_msg {
 	unsigned char		im_type;
 	unsigned char		im_status;
+	u_int32_t		im_xid;
 	union spnfs_msg_args	im_args;
 	union spnfs_msg_res	im_res;
 };
 
 #ifdef __KERNEL__
 
+#define SPNFS_XID_HASH_BITS		6
+#define SPNFS_XID_HASH_SIZE		(1 << SPNFS_XID_HASH_BITS)
+#define SPNFS_XID_HASH_MASK		(SPNFS_XID_HASH_SIZE - 1)
+
+/* default seconds to wait for spnfsd to answer an upcall, 0 for ever */
+#define SPNFS_UPCALL_TIMEOUT		30
+/* most upcalls that may be outstanding on behalf of deferred requests */
+#define SPNFS_MAX_ASYNC_UPCALLS		128
+/* most upcalls one READ or WRITE is split into at a time */
+#define SPNFS_MAX_FANOUT		16
+
+/* one piece of a READ or WRITE, see spnfs_upcall_vec() */
+struct spnfs_io {
+	struct spnfs_msg	io_msg;
+	size_t			io_skip;	/* where its data starts */
+	size_t			io_len;		/* bytes of data */
+	int			io_status;
+	union spnfs_msg_res	io_res;
+};
+
 /* pipe mgmt structure.  messages flow through here */
 struct spnfs {
 	char			spnfs_path[48];   /* path to pipe */
 	struct dentry		*spnfs_dentry;    /* dentry for pipe */
-	wait_queue_head_t	spnfs_wq;
-	struct spnfs_msg	spnfs_im;         /* spnfs message */
-	struct mutex		spnfs_lock;       /* Serializes upcalls */
-	struct mutex		spnfs_plock;
+	spinlock_t		spnfs_plock;      /* protects xid and table */
+	u32			spnfs_xid;        /* next upcall xid */
+	int			spnfs_nasync;     /* async upcalls in flight */
+	/* upcalls awaiting a downcall, hashed by xid */
+	struct list_head	spnfs_pending[SPNFS_XID_HASH_SIZE];
 };
 
 int spnfs_layout_type(void);
@@ -295,18 +359,38 @@ int spnfs_layoutget(struct inode *, struct pnfs_layoutget_arg *);
 int spnfs_layoutcommit(void);
 int spnfs_layoutreturn(struct inode *, void *);
 int spnfs_getdeviceiter(struct super_block *, struct pnfs_deviter_arg *);
+int spnfs_getdevicelist(struct super_block *, struct pnfs_devlist_arg *);
 int spnfs_getdeviceinfo(struct super_block *, struct pnfs_devinfo_arg *);
 int spnfs_setattr(void);
 int spnfs_open(struct inode *, void *);
 int spnfs_close(struct inode *);
 int spnfs_get_state(struct inode *, void *, void *);
-int spnfs_remove(unsigned long);
-int spnfs_read(unsigned long, loff_t, unsigned long *, int, struct svc_rqst *);
-int spnfs_write(unsigned long, loff_t, size_t, int, struct svc_rqst *);
+int spnfs_remove(struct super_block *, unsigned long);
+void spnfs_layout_cache_invalidate(struct super_block *, unsigned long);
+int spnfs_layout_cache_stats(char *);
+void spnfs_devinfo_cache_invalidate(u64);
+void spnfs_devinfo_cache_flush(void);
+int spnfs_read(struct inode *, loff_t, unsigned long *, int, struct svc_rqst *);
+int spnfs_write(struct inode *, loff_t, size_t, int, struct svc_rqst *);
 
 int nfsd_spnfs_new(void);
 void nfsd_spnfs_delete(void);
 int spnfs_upcall(struct spnfs *, struct spnfs_msg *, union spnfs_msg_res *);
+int spnfs_upcall_data(struct spnfs *, struct spnfs_msg *, union spnfs_msg_res *,
+		      struct kvec *, int, size_t *);
+int spnfs_upcall_reply(struct spnfs *, struct spnfs_msg *, union spnfs_msg_res *,
+		       void **, size_t *);
+void spnfs_upcall_vec(struct spnfs *, struct spnfs_io *, int, struct kvec *,
+		      int);
+/*
+ * called once with the finished message (SPNFS_STATUS_SUCCESS if it was
+ * answered) and any data that followed the reply
+ */
+typedef void (*spnfs_upcall_done_t)(struct spnfs_msg *, void *, size_t,
+				    void *);
+int spnfs_upcall_async(struct spnfs *, struct spnfs_msg *,
+		       spnfs_upcall_done_t, void *);
+extern unsigned int spnfs_upcall_timeout;
 int spnfs_enabled(void);
 int nfs4_spnfs_propagate_open(struct super_block *, struct svc_fh *, void *);
 
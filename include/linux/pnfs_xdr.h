@@ -60,6 +60,7 @@ struct nfs4_pnfs_layoutget {
 	struct nfs4_pnfs_layoutget_res res;
 	struct pnfs_layout_segment **lsegpp;
 	int status;
+	int async;		/* prefetch, nobody waits for the reply */
 };
 
 struct pnfs_layoutcommit_arg {
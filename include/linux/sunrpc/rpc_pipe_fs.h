@@ -42,6 +42,7 @@ RPC_I(struct inode *inode)
 }
 
 extern int rpc_queue_upcall(struct inode *, struct rpc_pipe_msg *);
+extern int rpc_cancel_upcall(struct inode *, struct rpc_pipe_msg *);
 
 extern struct dentry *rpc_mkdir(char *, struct rpc_clnt *);
 extern int rpc_rmdir(struct dentry *);
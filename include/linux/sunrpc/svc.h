@@ -41,6 +41,9 @@ struct svc_pool {
 	struct list_head	sp_sockets;	/* pending sockets */
 	unsigned int		sp_nrthreads;	/* # of threads in pool */
 	struct list_head	sp_all_threads;	/* all server threads */
+	unsigned int		sp_starved;	/* transports queued with no
+						 * idle thread */
+	unsigned int		sp_idle_periods; /* for the service's use */
 } ____cacheline_aligned_in_smp;
 
 /*
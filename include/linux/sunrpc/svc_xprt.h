@@ -53,6 +53,8 @@ struct svc_xprt {
 #define XPT_CACHE_AUTH	12		/* cache auth info */
 
 	struct svc_pool		*xpt_pool;	/* current pool iff queued */
+	int			xpt_home;	/* pool of the cpu taking its
+						 * interrupts, or -1 */
 	struct svc_serv		*xpt_server;	/* service for transport */
 	atomic_t    	    	xpt_reserved;	/* space on outq that is rsvd */
 	struct mutex		xpt_mutex;	/* to serialize sending data */
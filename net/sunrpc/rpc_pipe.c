@@ -115,6 +115,36 @@ out:
 }
 EXPORT_SYMBOL(rpc_queue_upcall);
 
+/**
+ * rpc_cancel_upcall
+ * @inode: inode of upcall pipe on which the message was queued
+ * @msg: message to take back
+ *
+ * Removes @msg from the upcall queue, provided no reader has started
+ * on it yet.  Returns 0 if it was removed, in which case ->destroy_msg
+ * will not be called for it, or -EBUSY if it is no longer queued.
+ */
+int
+rpc_cancel_upcall(struct inode *inode, struct rpc_pipe_msg *msg)
+{
+	struct rpc_inode *rpci = RPC_I(inode);
+	struct rpc_pipe_msg *pos;
+	int res = -EBUSY;
+
+	spin_lock(&inode->i_lock);
+	list_for_each_entry(pos, &rpci->pipe, list) {
+		if (pos == msg) {
+			list_del_init(&msg->list);
+			rpci->pipelen -= msg->len;
+			res = 0;
+			break;
+		}
+	}
+	spin_unlock(&inode->i_lock);
+	return res;
+}
+EXPORT_SYMBOL(rpc_cancel_upcall);
+
 static inline void
 rpc_inode_setowner(struct inode *inode, void *private)
 {
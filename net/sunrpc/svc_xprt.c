@@ -175,6 +175,7 @@ void svc_xprt_init(struct svc_xprt_class *xcl, struct svc_xprt *xprt,
 	INIT_LIST_HEAD(&xprt->xpt_deferred);
 	mutex_init(&xprt->xpt_mutex);
 	spin_lock_init(&xprt->xpt_lock);
+	xprt->xpt_home = -1;
 	set_bit(XPT_BUSY, &xprt->xpt_flags);
 }
 EXPORT_SYMBOL_GPL(svc_xprt_init);
@@ -280,6 +281,76 @@ static void svc_thread_dequeue(struct svc_pool *pool, struct svc_rqst *rqstp)
 	list_del(&rqstp->rq_list);
 }
 
+/*
+ * Choose the pool to queue a transport on.  data_ready and write_space
+ * run in softirq context on the cpu taking the NIC's interrupts, so the
+ * pool of that cpu becomes the transport's home, and enqueues from
+ * process context (e.g. svc_xprt_received on whichever cpu the thread
+ * ran) send it back there.  If the home pool has no idle thread, any
+ * pool that does gets the transport instead.  The list_empty() checks
+ * are racy; losing the race only means queueing on the chosen pool.
+ */
+static struct svc_pool *svc_xprt_choose_pool(struct svc_xprt *xprt)
+{
+	struct svc_serv	*serv = xprt->xpt_server;
+	struct svc_pool *pool;
+	unsigned int i;
+	int cpu;
+
+	if (in_softirq() || xprt->xpt_home < 0) {
+		cpu = get_cpu();
+		pool = svc_pool_for_cpu(serv, cpu);
+		put_cpu();
+		xprt->xpt_home = pool->sp_id;
+	} else
+		pool = &serv->sv_pools[xprt->xpt_home];
+
+	if (serv->sv_nrpools > 1 && list_empty(&pool->sp_threads)) {
+		for (i = 1; i < serv->sv_nrpools; i++) {
+			struct svc_pool *p = &serv->sv_pools[
+				(pool->sp_id + i) % serv->sv_nrpools];
+
+			if (!list_empty(&p->sp_threads))
+				return p;
+		}
+	}
+	return pool;
+}
+
+/*
+ * A transport was queued on a pool without idle threads: wake an idle
+ * thread of another pool, as svc_wake_up does, so that it comes round
+ * and steals the transport.  Pairs with the check svc_recv makes after
+ * putting a thread to sleep; the smp_mb() orders our queueing of the
+ * transport before the racy sp_threads checks, as theirs orders their
+ * queueing of the thread before the sp_sockets checks.
+ */
+static void svc_xprt_wake_other(struct svc_serv *serv, struct svc_pool *pool)
+{
+	struct svc_rqst	*rqstp;
+	unsigned int i;
+
+	smp_mb();
+	for (i = 1; i < serv->sv_nrpools; i++) {
+		struct svc_pool *p = &serv->sv_pools[
+			(pool->sp_id + i) % serv->sv_nrpools];
+
+		if (list_empty(&p->sp_threads))
+			continue;
+		spin_lock_bh(&p->sp_lock);
+		if (!list_empty(&p->sp_threads)) {
+			rqstp = list_entry(p->sp_threads.next,
+					   struct svc_rqst, rq_list);
+			dprintk("svc: daemon %p of pool %u woken to steal\n",
+				rqstp, p->sp_id);
+			wake_up(&rqstp->rq_wait);
+			spin_unlock_bh(&p->sp_lock);
+			return;
+		}
+		spin_unlock_bh(&p->sp_lock);
+	}
+}
+
 /*
  * Queue up a transport with data pending. If there are idle nfsd
  * processes, wake 'em up.
@@ -290,7 +361,7 @@ void svc_xprt_enqueue(struct svc_xprt *xprt)
 	struct svc_serv	*serv = xprt->xpt_server;
 	struct svc_pool *pool;
 	struct svc_rqst	*rqstp;
-	int cpu;
+	int queued = 0;
 
 	if (!(xprt->xpt_flags &
 	      ((1<<XPT_CONN)|(1<<XPT_DATA)|(1<<XPT_CLOSE)|(1<<XPT_DEFERRED))))
@@ -298,9 +369,7 @@ void svc_xprt_enqueue(struct svc_xprt *xprt)
 	if (test_bit(XPT_DEAD, &xprt->xpt_flags))
 		return;
 
-	cpu = get_cpu();
-	pool = svc_pool_for_cpu(xprt->xpt_server, cpu);
-	put_cpu();
+	pool = svc_xprt_choose_pool(xprt);
 
 	spin_lock_bh(&pool->sp_lock);
 
@@ -368,11 +437,15 @@ void svc_xprt_enqueue(struct svc_xprt *xprt)
 	} else {
 		dprintk("svc: transport %p put into queue\n", xprt);
 		list_add_tail(&xprt->xpt_ready, &pool->sp_sockets);
+		pool->sp_starved++;
 		BUG_ON(xprt->xpt_pool != pool);
+		queued = 1;
 	}
 
 out_unlock:
 	spin_unlock_bh(&pool->sp_lock);
+	if (queued && serv->sv_nrpools > 1)
+		svc_xprt_wake_other(serv, pool);
 }
 EXPORT_SYMBOL_GPL(svc_xprt_enqueue);
 
@@ -396,6 +469,48 @@ static struct svc_xprt *svc_xprt_dequeue(struct svc_pool *pool)
 	return xprt;
 }
 
+/*
+ * Take a transport queued on another pool, for a thread whose own pool
+ * has nothing to do.  Must be called without any pool lock held.
+ */
+static struct svc_xprt *svc_xprt_steal(struct svc_serv *serv,
+				       struct svc_pool *pool)
+{
+	struct svc_xprt	*xprt = NULL;
+	unsigned int i;
+
+	for (i = 1; i < serv->sv_nrpools && !xprt; i++) {
+		struct svc_pool *p = &serv->sv_pools[
+			(pool->sp_id + i) % serv->sv_nrpools];
+
+		if (list_empty(&p->sp_sockets))
+			continue;
+		spin_lock_bh(&p->sp_lock);
+		xprt = svc_xprt_dequeue(p);
+		spin_unlock_bh(&p->sp_lock);
+	}
+	return xprt;
+}
+
+/*
+ * Are transports waiting on a pool other than @pool?  See
+ * svc_xprt_wake_other.
+ */
+static int svc_xprt_other_queued(struct svc_serv *serv, struct svc_pool *pool)
+{
+	unsigned int i;
+
+	smp_mb();
+	for (i = 1; i < serv->sv_nrpools; i++) {
+		struct svc_pool *p = &serv->sv_pools[
+			(pool->sp_id + i) % serv->sv_nrpools];
+
+		if (!list_empty(&p->sp_sockets))
+			return 1;
+	}
+	return 0;
+}
+
 /*
  * svc_xprt_received conditionally queues the transport for processing
  * by another thread. The caller must hold the XPT_BUSY bit and must
@@ -612,6 +727,13 @@ int svc_recv(struct svc_rqst *rqstp, long timeout)
 
 	spin_lock_bh(&pool->sp_lock);
 	xprt = svc_xprt_dequeue(pool);
+	if (!xprt && serv->sv_nrpools > 1) {
+		spin_unlock_bh(&pool->sp_lock);
+		xprt = svc_xprt_steal(serv, pool);
+		spin_lock_bh(&pool->sp_lock);
+		if (!xprt)
+			xprt = svc_xprt_dequeue(pool);
+	}
 	if (xprt) {
 		rqstp->rq_xprt = xprt;
 		svc_xprt_get(xprt);
@@ -629,7 +751,15 @@ int svc_recv(struct svc_rqst *rqstp, long timeout)
 		add_wait_queue(&rqstp->rq_wait, &wait);
 		spin_unlock_bh(&pool->sp_lock);
 
-		schedule_timeout(timeout);
+		/*
+		 * A transport queued elsewhere between the steal above and
+		 * our going idle found no idle thread to wake; don't sleep
+		 * on it, come round again and steal it.
+		 */
+		if (serv->sv_nrpools > 1 && svc_xprt_other_queued(serv, pool))
+			__set_current_state(TASK_RUNNING);
+		else
+			schedule_timeout(timeout);
 
 		try_to_freeze();
 